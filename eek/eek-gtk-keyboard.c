@@ -53,10 +53,25 @@ typedef struct _EekGtkKeyboardPrivate
     struct squeek_layout_state *layout; // unowned
     LevelKeyboard *keyboard; // unowned reference; it's kept in server-context
 
-    GdkEventSequence *sequence; // unowned reference
     LfbEvent *event;
+
+    /// Latest positions of moving input points,
+    /// waiting for the next frame
+    GArray *drags; // of struct pending_drag, owned
+    guint drag_tick_id; // 0 if there are no pending drags
 } EekGtkKeyboardPrivate;
 
+struct pending_drag {
+    uintptr_t point;
+    gdouble x;
+    gdouble y;
+    guint32 time;
+};
+
+/// Input point of the mouse.
+/// Touch points are identified by their sequences, which are never NULL.
+static const uintptr_t MOUSE_POINT = 0;
+
 G_DEFINE_TYPE_WITH_PRIVATE (EekGtkKeyboard, eek_gtk_keyboard, GTK_TYPE_DRAWING_AREA)
 
 static void
@@ -77,11 +92,13 @@ eek_gtk_keyboard_real_realize (GtkWidget      *self)
 static void set_allocation_size(EekGtkKeyboard *gtk_keyboard,
     struct squeek_layout *layout, gdouble width, gdouble height)
 {
-    // This is where size-dependent surfaces would be released
+    // Size-dependent surfaces are released by the renderer
+    // when it notices the new geometry.
     EekGtkKeyboardPrivate *priv =
         eek_gtk_keyboard_get_instance_private (gtk_keyboard);
     priv->render_geometry = eek_render_geometry_from_allocation_size(
-        layout, width, height);
+        layout, width, height,
+        gtk_widget_get_scale_factor (GTK_WIDGET (gtk_keyboard)));
 }
 
 static gboolean
@@ -107,9 +124,16 @@ eek_gtk_keyboard_real_draw (GtkWidget *self,
 
         set_allocation_size (keyboard, priv->keyboard->layout,
             allocation.width, allocation.height);
-        eek_renderer_set_scale_factor (priv->renderer,
-                                       gtk_widget_get_scale_factor (self));
     }
+    gint scale_factor = gtk_widget_get_scale_factor (self);
+    // Moving to another monitor doesn't necessarily change the allocation,
+    // but buttons must stay snapped to its pixels
+    if (priv->render_geometry.scale_factor != scale_factor) {
+        set_allocation_size (keyboard, priv->keyboard->layout,
+            allocation.width, allocation.height);
+    }
+    // Cheap, and the renderer drops outdated surfaces on its own
+    eek_renderer_set_scale_factor (priv->renderer, scale_factor);
 
     eek_renderer_render_keyboard (priv->renderer, priv->render_geometry,
         priv->submission, cr, priv->keyboard);
@@ -164,19 +188,22 @@ on_event_triggered (LfbEvent      *event,
     }
 }
 
-static void depress(EekGtkKeyboard *self,
+static void flush_drags(EekGtkKeyboard *self);
+
+static void depress(EekGtkKeyboard *self, uintptr_t point,
                     gdouble x, gdouble y, guint32 time)
 {
     EekGtkKeyboardPrivate *priv = eek_gtk_keyboard_get_instance_private (self);
     if (!priv->keyboard) {
         return;
     }
+    flush_drags(self);
     squeek_layout_depress(priv->keyboard->layout,
-                          priv->submission,
+                          priv->submission, point,
                           x, y, priv->render_geometry.widget_to_layout, time, self);
 }
 
-static void drag(EekGtkKeyboard *self,
+static void drag(EekGtkKeyboard *self, uintptr_t point,
                  gdouble x, gdouble y, guint32 time)
 {
     EekGtkKeyboardPrivate *priv = eek_gtk_keyboard_get_instance_private (self);
@@ -184,19 +211,87 @@ static void drag(EekGtkKeyboard *self,
         return;
     }
     squeek_layout_drag(eekboard_context_service_get_keyboard(priv->eekboard_context)->layout,
-                       priv->submission,
+                       priv->submission, point,
                        x, y, priv->render_geometry.widget_to_layout, time,
                        priv->eekboard_context, self);
 }
 
-static void release(EekGtkKeyboard *self, guint32 time)
+/// Applies the pending drags, if any.
+/// Must be called before presses and releases to keep the event order.
+static void flush_drags(EekGtkKeyboard *self)
+{
+    EekGtkKeyboardPrivate *priv = eek_gtk_keyboard_get_instance_private (self);
+    for (guint i = 0; i < priv->drags->len; i++) {
+        struct pending_drag *pending =
+            &g_array_index(priv->drags, struct pending_drag, i);
+        drag(self, pending->point, pending->x, pending->y, pending->time);
+    }
+    g_array_set_size(priv->drags, 0);
+}
+
+static gboolean on_drag_tick(GtkWidget *widget, GdkFrameClock *clock,
+                             gpointer user_data)
+{
+    (void)clock;
+    (void)user_data;
+    EekGtkKeyboard *self = EEK_GTK_KEYBOARD(widget);
+    EekGtkKeyboardPrivate *priv = eek_gtk_keyboard_get_instance_private (self);
+    priv->drag_tick_id = 0;
+    flush_drags(self);
+    return G_SOURCE_REMOVE;
+}
+
+/// Touch screens can report movement more often than the screen refreshes,
+/// so only the latest position of each point gets processed, once per frame.
+static void queue_drag(EekGtkKeyboard *self, uintptr_t point,
+                       gdouble x, gdouble y, guint32 time)
+{
+    EekGtkKeyboardPrivate *priv = eek_gtk_keyboard_get_instance_private (self);
+    struct pending_drag drag = {
+        .point = point,
+        .x = x,
+        .y = y,
+        .time = time,
+    };
+    guint i;
+    for (i = 0; i < priv->drags->len; i++) {
+        if (g_array_index(priv->drags, struct pending_drag, i).point == point) {
+            break;
+        }
+    }
+    if (i < priv->drags->len) {
+        g_array_index(priv->drags, struct pending_drag, i) = drag;
+    } else {
+        g_array_append_val(priv->drags, drag);
+    }
+    if (!priv->drag_tick_id) {
+        priv->drag_tick_id = gtk_widget_add_tick_callback(GTK_WIDGET(self),
+            on_drag_tick, NULL, NULL);
+    }
+}
+
+static void cancel_drags(EekGtkKeyboard *self)
+{
+    EekGtkKeyboardPrivate *priv = eek_gtk_keyboard_get_instance_private (self);
+    if (priv->drags) {
+        g_array_set_size(priv->drags, 0);
+    }
+    if (priv->drag_tick_id) {
+        gtk_widget_remove_tick_callback(GTK_WIDGET(self), priv->drag_tick_id);
+        priv->drag_tick_id = 0;
+    }
+}
+
+static void release(EekGtkKeyboard *self, uintptr_t point, guint32 time)
 {
     EekGtkKeyboardPrivate *priv = eek_gtk_keyboard_get_instance_private (self);
     if (!priv->keyboard) {
         return;
     }
+    flush_drags(self);
     squeek_layout_release(eekboard_context_service_get_keyboard(priv->eekboard_context)->layout,
-                          priv->submission, priv->render_geometry.widget_to_layout, time,
+                          priv->submission, point,
+                          priv->render_geometry.widget_to_layout, time,
                           priv->eekboard_context, self);
 }
 
@@ -205,7 +300,8 @@ eek_gtk_keyboard_real_button_press_event (GtkWidget      *self,
                                           GdkEventButton *event)
 {
     if (event->type == GDK_BUTTON_PRESS && event->button == 1) {
-        depress(EEK_GTK_KEYBOARD(self), event->x, event->y, event->time);
+        depress(EEK_GTK_KEYBOARD(self), MOUSE_POINT,
+                event->x, event->y, event->time);
     }
     return TRUE;
 }
@@ -217,7 +313,7 @@ eek_gtk_keyboard_real_button_release_event (GtkWidget      *self,
 {
     if (event->type == GDK_BUTTON_RELEASE && event->button == 1) {
         // TODO: can the event have different coords than the previous move event?
-        release(EEK_GTK_KEYBOARD(self), event->time);
+        release(EEK_GTK_KEYBOARD(self), MOUSE_POINT, event->time);
     }
     return TRUE;
 }
@@ -228,7 +324,7 @@ eek_gtk_keyboard_leave_event (GtkWidget      *self,
 {
     if (event->type == GDK_LEAVE_NOTIFY) {
         // TODO: can the event have different coords than the previous move event?
-        release(EEK_GTK_KEYBOARD(self), event->time);
+        release(EEK_GTK_KEYBOARD(self), MOUSE_POINT, event->time);
     }
     return TRUE;
 }
@@ -239,40 +335,35 @@ eek_gtk_keyboard_real_motion_notify_event (GtkWidget      *self,
                                            GdkEventMotion *event)
 {
     if (event->state & GDK_BUTTON1_MASK) {
-        drag(EEK_GTK_KEYBOARD(self), event->x, event->y, event->time);
+        queue_drag(EEK_GTK_KEYBOARD(self), MOUSE_POINT,
+                   event->x, event->y, event->time);
     }
     return TRUE;
 }
 
-// Only one touch stream at a time allowed. Others will be completely ignored.
+// Every touch sequence presses, drags and releases keys on its own,
+// so that a key pressed while another is still held isn't lost.
 static gboolean
 handle_touch_event (GtkWidget     *widget,
                     GdkEventTouch *event)
 {
-    EekGtkKeyboard        *self = EEK_GTK_KEYBOARD (widget);
-    EekGtkKeyboardPrivate *priv = eek_gtk_keyboard_get_instance_private (self);
-
-    /* For each new touch, release the previous one and record the new event
-       sequence. */
-    if (event->type == GDK_TOUCH_BEGIN) {
-        release(self, event->time);
-        priv->sequence = event->sequence;
-        depress(self, event->x, event->y, event->time);
-        return TRUE;
-    }
+    EekGtkKeyboard *self = EEK_GTK_KEYBOARD (widget);
+    uintptr_t point = (uintptr_t)event->sequence;
 
-    /* Only allow the latest touch point to be dragged. */
-    if (event->type == GDK_TOUCH_UPDATE && event->sequence == priv->sequence) {
-        drag(self, event->x, event->y, event->time);
-    }
-    else if (event->type == GDK_TOUCH_END || event->type == GDK_TOUCH_CANCEL) {
+    switch (event->type) {
+    case GDK_TOUCH_BEGIN:
+        depress(self, point, event->x, event->y, event->time);
+        break;
+    case GDK_TOUCH_UPDATE:
+        queue_drag(self, point, event->x, event->y, event->time);
+        break;
+    case GDK_TOUCH_END:
+    case GDK_TOUCH_CANCEL:
         // TODO: can the event have different coords than the previous update event?
-        /* Only respond to the release of the latest touch point. Previous
-           touches have already been released. */
-        if (event->sequence == priv->sequence) {
-            release(self, event->time);
-            priv->sequence = NULL;
-        }
+        release(self, point, event->time);
+        break;
+    default:
+        break;
     }
     return TRUE;
 }
@@ -283,6 +374,9 @@ eek_gtk_keyboard_real_unmap (GtkWidget *self)
     EekGtkKeyboardPrivate *priv =
         eek_gtk_keyboard_get_instance_private (EEK_GTK_KEYBOARD (self));
 
+    // Everything gets released anyway
+    cancel_drags(EEK_GTK_KEYBOARD (self));
+
     if (priv->keyboard) {
         squeek_layout_release_all_only(
             priv->keyboard->layout,
@@ -313,6 +407,9 @@ eek_gtk_keyboard_dispose (GObject *object)
     EekGtkKeyboard        *self = EEK_GTK_KEYBOARD (object);
     EekGtkKeyboardPrivate *priv = eek_gtk_keyboard_get_instance_private (self);
 
+    cancel_drags(self);
+    g_clear_pointer (&priv->drags, g_array_unref);
+
     if (priv->renderer) {
         eek_renderer_free(priv->renderer);
         priv->renderer = NULL;
@@ -366,6 +463,8 @@ eek_gtk_keyboard_init (EekGtkKeyboard *self)
     EekGtkKeyboardPrivate *priv = eek_gtk_keyboard_get_instance_private (EEK_GTK_KEYBOARD (self));
     g_autoptr(GError) err = NULL;
 
+    priv->drags = g_array_new (FALSE, FALSE, sizeof (struct pending_drag));
+
     if (lfb_init(SQUEEKBOARD_APP_ID, &err)) {
         priv->event = lfb_event_new ("button-pressed");
     } else {
@@ -375,6 +474,9 @@ eek_gtk_keyboard_init (EekGtkKeyboard *self)
     GtkIconTheme *theme = gtk_icon_theme_get_default ();
 
     gtk_icon_theme_add_resource_path (theme, "/sm/puri/squeekboard/icons");
+    // The renderer drops everything drawn with the old icons
+    g_signal_connect_object (theme, "changed",
+        G_CALLBACK (gtk_widget_queue_draw), self, G_CONNECT_SWAPPED);
 }
 
 static void
@@ -384,10 +486,14 @@ on_notify_keyboard (GObject              *object,
     (void)spec;
     EekGtkKeyboardPrivate *priv = (EekGtkKeyboardPrivate*)eek_gtk_keyboard_get_instance_private (self);
     priv->keyboard = eekboard_context_service_get_keyboard(EEKBOARD_CONTEXT_SERVICE(object));
-    if (priv->renderer) {
-        eek_renderer_free(priv->renderer);
+    // The renderer stays, to avoid loading the style again
+    if (priv->renderer && priv->keyboard) {
+        eek_renderer_set_keyboard(priv->renderer, priv->keyboard);
+        GtkAllocation allocation;
+        gtk_widget_get_allocation (GTK_WIDGET(self), &allocation);
+        set_allocation_size (self, priv->keyboard->layout,
+            allocation.width, allocation.height);
     }
-    priv->renderer = NULL;
     gtk_widget_queue_draw(GTK_WIDGET(self));
 }
 
@@ -416,6 +522,7 @@ eek_gtk_keyboard_new (EekboardContextService *eekservice,
         // e.g. on zero division.
         .allocation_width = 100,
         .allocation_height = 100,
+        .scale_factor = 1,
         .widget_to_layout = {
             .origin_x = 0,
             .origin_y = 0,
@@ -20,20 +20,21 @@
 
 #include "config.h"
 
-#define _XOPEN_SOURCE 500
+#define _GNU_SOURCE
 #include <errno.h>
 #include <fcntl.h>
 #include <string.h>
-#include <sys/mman.h>
-#include <sys/random.h> // TODO: this is Linux-specific
+#include <sys/mman.h> // TODO: memfd_create is Linux-specific
+#include <unistd.h>
 #include <xkbcommon/xkbcommon.h>
 
 
 #include "eek-keyboard.h"
 
 /// External linkage for Rust.
-/// The corresponding deinit is implemented in vkeyboard::KeyMap::drop
-struct keymap squeek_key_map_from_str(const char *keymap_str) {
+/// Returns the keymap in the form xkbcommon writes it out,
+/// to be released with `free`.
+char *squeek_key_map_compile(const char *keymap_str) {
     struct xkb_context *context = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
     if (!context) {
         g_error("No context created");
@@ -49,35 +50,45 @@ struct keymap squeek_key_map_from_str(const char *keymap_str) {
     xkb_context_unref(context);
 
     char *xkb_keymap_str = xkb_keymap_get_as_string(keymap, XKB_KEYMAP_FORMAT_TEXT_V1);
+    xkb_keymap_unref(keymap);
+    return xkb_keymap_str;
+}
+
+/// External linkage for Rust.
+/// Places a compiled keymap in a file which can be shared with the compositor.
+/// The file is sealed against changes,
+/// so the same one can be sent again on every keymap switch.
+/// vkeyboard::KeyMapCache keeps it open past the layout which created it.
+/// The corresponding deinit is implemented in vkeyboard::KeyMap::drop
+struct keymap squeek_key_map_from_compiled(const char *xkb_keymap_str) {
     size_t keymap_len = strlen(xkb_keymap_str) + 1;
 
-    g_autofree char *path = strdup("/eek_keymap-XXXXXX");
-    char *r = &path[strlen(path) - 6];
-    if (getrandom(r, 6, GRND_NONBLOCK) < 0) {
-        g_error("Failed to get random numbers: %s", strerror(errno));
-    }
-    for (unsigned i = 0; i < 6; i++) {
-        r[i] = (r[i] & 0b1111111) | 0b1000000; // A-z
-        r[i] = r[i] > 'z' ? '?' : r[i]; // The randomizer doesn't need to be good...
-    }
-    int keymap_fd = shm_open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+    int keymap_fd = memfd_create("squeekboard-keymap",
+                                 MFD_CLOEXEC | MFD_ALLOW_SEALING);
     if (keymap_fd < 0) {
-        g_error("Failed to set up keymap fd");
+        g_error("Failed to set up keymap fd: %s", strerror(errno));
     }
 
-    shm_unlink(path);
-    if (ftruncate(keymap_fd, (off_t)keymap_len)) {
-        g_error("Failed to increase keymap fd size");
+    // Writing directly leaves no writable mappings behind,
+    // which would prevent sealing.
+    size_t written = 0;
+    while (written < keymap_len) {
+        ssize_t ret = write(keymap_fd, xkb_keymap_str + written,
+                            keymap_len - written);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            g_error("Failed to write keymap: %s", strerror(errno));
+        }
+        written += (size_t)ret;
     }
-    char *ptr = mmap(NULL, keymap_len, PROT_WRITE, MAP_SHARED,
-        keymap_fd, 0);
-    if ((void*)ptr == (void*)-1) {
-        g_error("Failed to set up mmap");
+
+    if (fcntl(keymap_fd, F_ADD_SEALS,
+              F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0) {
+        g_error("Failed to seal keymap fd: %s", strerror(errno));
     }
-    strncpy(ptr, xkb_keymap_str, keymap_len);
-    munmap(ptr, keymap_len);
-    free(xkb_keymap_str);
-    xkb_keymap_unref(keymap);
+
     struct keymap km = {
         .fd = keymap_fd,
         .fd_len = keymap_len,
@@ -27,18 +27,42 @@
 #include "src/style.h"
 
 
+/// Style of a button in one state, resolved when first needed.
+/// Resolving the CSS cascade is expensive, so it's not done on every draw.
+struct button_style {
+    /// Still needed to draw backgrounds and frames.
+    GtkStyleContext *ctx; // owned
+    GtkBorder margin;
+    GtkBorder border;
+    GdkRGBA color;
+    PangoFontDescription *font; // owned
+    /// Serialized font, for looking up text shaped with it.
+    gchar *font_key; // owned
+};
+
+/// Text shaped for a label, and its measurements.
+struct label_layout {
+    PangoLayout *layout; // owned
+    PangoRectangle extents;
+    GList *link; // owned by EekRenderer.label_layout_order
+};
+
+/// Enough for every label of the biggest layouts in a few states,
+/// while not letting switching between many sizes grow the cache forever.
+#define LABEL_LAYOUTS_MAX_ENTRIES 1024
+
 /* eek-keyboard-drawing.c */
-static void render_button_label (cairo_t *cr, GtkStyleContext *ctx,
-                                                const gchar *label, EekBounds bounds);
+static void render_button_label (EekRenderer *self, cairo_t *cr,
+                                 const struct button_style *style,
+                                 const gchar *label, EekBounds bounds);
 
 static void
 render_outline (cairo_t     *cr,
-                GtkStyleContext *ctx,
+                const struct button_style *style,
                 EekBounds bounds)
 {
-    GtkBorder margin, border;
-    gtk_style_context_get_margin(ctx, GTK_STATE_FLAG_NORMAL, &margin);
-    gtk_style_context_get_border(ctx, GTK_STATE_FLAG_NORMAL, &border);
+    GtkBorder margin = style->margin;
+    GtkBorder border = style->border;
 
     gdouble x = margin.left + border.left;
     gdouble y = margin.top + border.top;
@@ -48,24 +72,25 @@ render_outline (cairo_t     *cr,
         .width = bounds.width - x - (margin.right + border.right),
         .height = bounds.height - y - (margin.bottom + border.bottom),
     };
-    gtk_render_background (ctx, cr,
+    gtk_render_background (style->ctx, cr,
         position.x, position.y, position.width, position.height);
-    gtk_render_frame (ctx, cr,
+    gtk_render_frame (style->ctx, cr,
         position.x, position.y, position.width, position.height);
 }
 
 /// Rust interface
-void eek_render_button_in_context(uint32_t scale_factor,
+void eek_render_button_in_context(EekRenderer *self,
                                      cairo_t     *cr,
-                                     GtkStyleContext *ctx,
+                                     const struct button_style *style,
                                      EekBounds bounds,
                                      const char *icon_name,
                                      const gchar *label) {
+    gint scale_factor = self->scale_factor;
     /* blank background */
     cairo_set_source_rgba (cr, 0.0, 0.0, 0.0, 0.0);
     cairo_paint (cr);
 
-    render_outline (cr, ctx, bounds);
+    render_outline (cr, style, bounds);
     cairo_paint (cr);
 
     /* render icon (if any) */
@@ -83,8 +108,7 @@ void eek_render_button_in_context(uint32_t scale_factor,
             cairo_rectangle (cr, 0, 0, width, height);
             cairo_clip (cr);
             /* Draw the shape of the icon using the foreground color */
-            GdkRGBA color = {0};
-            gtk_style_context_get_color (ctx, GTK_STATE_FLAG_NORMAL, &color);
+            GdkRGBA color = style->color;
 
             cairo_set_source_rgba (cr, color.red,
                                        color.green,
@@ -99,30 +123,39 @@ void eek_render_button_in_context(uint32_t scale_factor,
     }
 
     if (label) {
-        render_button_label (cr, ctx, label, bounds);
+        render_button_label (self, cr, style, label, bounds);
     }
 }
 
-/// Prepare context for drawing the button.
-/// The context MUST be released using the corresponing "put" procedure
-/// before drawing the next button.
-/// Interface for Rust.
-GtkStyleContext *
-eek_get_style_context_for_button (EekRenderer *self,
-                                  const char *name,
-                                  const char *outline_name,
-                                  const char *locked_class,
-               uint64_t     pressed)
+static void
+button_style_free (struct button_style *style)
 {
-    GtkStyleContext *ctx = self->button_context;
+    g_object_unref (style->ctx);
+    pango_font_description_free (style->font);
+    g_free (style->font_key);
+    g_free (style);
+}
+
+static struct button_style *
+button_style_new (EekRenderer *self,
+                  const char *name,
+                  const char *outline_name,
+                  const char *locked_class,
+                  uint64_t pressed)
+{
+    struct button_style *style = g_new0 (struct button_style, 1);
     /* Set the name of the button on the widget path, using the name obtained
        from the button's symbol. */
     g_autoptr (GtkWidgetPath) path = NULL;
-    path = gtk_widget_path_copy (gtk_style_context_get_path (ctx));
+    path = gtk_widget_path_copy (gtk_style_context_get_path (self->button_context));
     gtk_widget_path_iter_set_name (path, -1, name);
 
-    /* Update the style context with the updated widget path. */
+    GtkStyleContext *ctx = gtk_style_context_new ();
     gtk_style_context_set_path (ctx, path);
+    gtk_style_context_set_parent (ctx, self->view_context);
+    gtk_style_context_add_provider (ctx,
+        GTK_STYLE_PROVIDER(self->css_provider),
+        GTK_STYLE_PROVIDER_PRIORITY_APPLICATION);
     /* Set the state to take into account whether the button is active
        (pressed) or normal. */
     gtk_style_context_set_state(ctx,
@@ -131,45 +164,121 @@ eek_get_style_context_for_button (EekRenderer *self,
         gtk_style_context_add_class(ctx, locked_class);
     }
     gtk_style_context_add_class(ctx, outline_name);
-    return ctx;
+
+    gtk_style_context_get_margin(ctx, GTK_STATE_FLAG_NORMAL, &style->margin);
+    gtk_style_context_get_border(ctx, GTK_STATE_FLAG_NORMAL, &style->border);
+    gtk_style_context_get_color(ctx, GTK_STATE_FLAG_NORMAL, &style->color);
+    gtk_style_context_get(ctx,
+                          gtk_style_context_get_state(ctx),
+                          "font", &style->font,
+                          NULL);
+    style->font_key = pango_font_description_to_string (style->font);
+    style->ctx = ctx;
+    return style;
 }
 
+/// Returns the style for drawing the button, resolving it if needed.
+/// The style remains owned by the renderer.
 /// Interface for Rust.
-void eek_put_style_context_for_button(GtkStyleContext *ctx,
-                                      const char *outline_name,
-                                      const char *locked_class) {
-    // Save and restore functions don't work if gtk_render_* was used in between
-    gtk_style_context_set_state(ctx, GTK_STATE_FLAG_NORMAL);
-    gtk_style_context_remove_class(ctx, outline_name);
-    if (locked_class) {
-        gtk_style_context_remove_class(ctx, locked_class);
+const struct button_style *
+eek_get_style_for_button (EekRenderer *self,
+                          const char *name,
+                          const char *outline_name,
+                          const char *locked_class,
+                          uint64_t     pressed)
+{
+    g_string_printf (self->button_style_key, "%s\n%s\n%s\n%d",
+        name, outline_name, locked_class ? locked_class : "", pressed != 0);
+    struct button_style *style = g_hash_table_lookup (self->button_styles,
+        self->button_style_key->str);
+    if (!style) {
+        style = button_style_new (self, name, outline_name, locked_class,
+            pressed);
+        g_hash_table_insert (self->button_styles,
+            g_strdup (self->button_style_key->str), style);
     }
+    return style;
 }
 
 static void
-render_button_label (cairo_t     *cr,
-                     GtkStyleContext *ctx,
-                     const gchar *label,
-                     EekBounds bounds)
+label_layout_free (struct label_layout *label_layout)
 {
-    PangoFontDescription *font;
-    gtk_style_context_get(ctx,
-                          gtk_style_context_get_state(ctx),
-                          "font", &font,
-                          NULL);
+    g_object_unref (label_layout->layout);
+    g_free (label_layout);
+}
+
+/// Returns device pixels per user unit of the context.
+/// Hinting and text metrics depend on it.
+static gdouble
+get_device_scale (cairo_t *cr)
+{
+    gdouble x = 1.0;
+    gdouble y = 0.0;
+    cairo_user_to_device_distance (cr, &x, &y);
+    gdouble x_scale = 1.0;
+    gdouble y_scale = 1.0;
+    cairo_surface_get_device_scale (cairo_get_target (cr), &x_scale, &y_scale);
+    return hypot (x, y) * x_scale;
+}
+
+/// Returns the label shaped to fit the width, shaping it if needed.
+/// The text is shaped for the transformation and target of the context.
+/// The layout remains owned by the renderer.
+static const struct label_layout *
+get_label_layout (EekRenderer *self,
+                  cairo_t *cr,
+                  const struct button_style *style,
+                  const gchar *label,
+                  gint width)
+{
+    g_string_printf (self->label_layout_key, "%s\n%s\n%d\n%.4f",
+        label, style->font_key, width, get_device_scale (cr));
+    struct label_layout *label_layout = g_hash_table_lookup (
+        self->label_layouts, self->label_layout_key->str);
+    if (label_layout) {
+        g_queue_unlink (&self->label_layout_order, label_layout->link);
+        g_queue_push_tail_link (&self->label_layout_order, label_layout->link);
+        return label_layout;
+    }
+
     PangoLayout *layout = pango_cairo_create_layout (cr);
-    pango_layout_set_font_description (layout, font);
-    pango_font_description_free (font);
+    pango_layout_set_font_description (layout, style->font);
 
     pango_layout_set_text (layout, label, -1);
     PangoLayoutLine *line = pango_layout_get_line_readonly(layout, 0);
     if (line->resolved_dir == PANGO_DIRECTION_RTL) {
         pango_layout_set_alignment (layout, PANGO_ALIGN_RIGHT);
     }
-    pango_layout_set_width (layout, PANGO_SCALE * bounds.width);
+    pango_layout_set_width (layout, width);
+
+    label_layout = g_new0 (struct label_layout, 1);
+    label_layout->layout = layout;
+    pango_layout_get_extents (layout, NULL, &label_layout->extents);
 
-    PangoRectangle extents = { 0, };
-    pango_layout_get_extents (layout, NULL, &extents);
+    if (g_queue_get_length (&self->label_layout_order)
+            >= LABEL_LAYOUTS_MAX_ENTRIES) {
+        // The key is owned by the table, so it must stop being used first
+        gchar *oldest = g_queue_pop_head (&self->label_layout_order);
+        g_hash_table_remove (self->label_layouts, oldest);
+    }
+
+    gchar *key = g_strdup (self->label_layout_key->str);
+    g_queue_push_tail (&self->label_layout_order, key);
+    label_layout->link = g_queue_peek_tail_link (&self->label_layout_order);
+    g_hash_table_insert (self->label_layouts, key, label_layout);
+    return label_layout;
+}
+
+static void
+render_button_label (EekRenderer *self,
+                     cairo_t     *cr,
+                     const struct button_style *style,
+                     const gchar *label,
+                     EekBounds bounds)
+{
+    const struct label_layout *label_layout = get_label_layout (self, cr,
+        style, label, PANGO_SCALE * bounds.width);
+    PangoRectangle extents = label_layout->extents;
 
     cairo_save (cr);
     cairo_move_to
@@ -177,17 +286,163 @@ render_button_label (cairo_t     *cr,
          (bounds.width - (double)extents.width / PANGO_SCALE) / 2,
          (bounds.height - (double)extents.height / PANGO_SCALE) / 2);
 
-    GdkRGBA color = {0};
-    gtk_style_context_get_color (ctx, GTK_STATE_FLAG_NORMAL, &color);
+    GdkRGBA color = style->color;
 
     cairo_set_source_rgba (cr,
                            color.red,
                            color.green,
                            color.blue,
                            color.alpha);
-    pango_cairo_show_layout (cr, layout);
+    pango_cairo_show_layout (cr, label_layout->layout);
     cairo_restore (cr);
-    g_object_unref (layout);
+}
+
+/// Renders the background and all buttons of the view released.
+/// The surface doesn't depend on the window's,
+/// which may already be finished when this runs in idle time.
+static cairo_surface_t *
+render_base_view (EekRenderer *self,
+                  struct render_geometry geometry,
+                  struct squeek_layout *layout,
+                  const struct squeek_view *view,
+                  const struct squeek_atlas *atlas)
+{
+    cairo_surface_t *surface = cairo_image_surface_create (
+        CAIRO_FORMAT_ARGB32,
+        (int)ceil (geometry.allocation_width * self->scale_factor),
+        (int)ceil (geometry.allocation_height * self->scale_factor));
+    cairo_surface_set_device_scale (surface,
+        self->scale_factor, self->scale_factor);
+
+    cairo_t *cr = cairo_create (surface);
+    /* Paint the background covering the entire widget area */
+    gtk_render_background (self->view_context,
+                           cr,
+                           0, 0,
+                           geometry.allocation_width, geometry.allocation_height);
+
+    cairo_translate (cr, geometry.widget_to_layout.origin_x, geometry.widget_to_layout.origin_y);
+    cairo_scale (cr, geometry.widget_to_layout.scale, geometry.widget_to_layout.scale);
+
+    squeek_draw_layout_base_view(layout, view, self, atlas, cr);
+    cairo_destroy (cr);
+    return surface;
+}
+
+static void cancel_prerender (EekRenderer *self);
+
+/// Drops everything rendered for a different size or scale factor.
+static void
+update_geometry (EekRenderer *self, struct render_geometry geometry)
+{
+    if (self->base_views_width != geometry.allocation_width
+            || self->base_views_height != geometry.allocation_height
+            || self->base_views_scale_factor != self->scale_factor) {
+        cancel_prerender (self);
+        g_hash_table_remove_all (self->base_views);
+        g_clear_pointer (&self->atlas, squeek_atlas_free);
+        self->base_views_width = geometry.allocation_width;
+        self->base_views_height = geometry.allocation_height;
+        self->base_views_scale_factor = self->scale_factor;
+    }
+}
+
+/// Returns the cached base rendering of the current view,
+/// creating it if there's none for the current geometry.
+static cairo_surface_t *
+get_base_view (EekRenderer *self,
+               struct render_geometry geometry,
+               struct squeek_layout *layout,
+               const struct squeek_atlas *atlas)
+{
+    const struct squeek_view *view = squeek_layout_get_current_view (layout);
+    cairo_surface_t *surface = g_hash_table_lookup (self->base_views, view);
+    if (!surface) {
+        surface = render_base_view (self, geometry, layout, view, atlas);
+        g_hash_table_insert (self->base_views, (gpointer)view, surface);
+    }
+    return surface;
+}
+
+/// Forgets the views to prerender,
+/// so that they get found again on the next draw.
+static void
+cancel_prerender (EekRenderer *self)
+{
+    if (self->prerender_id) {
+        g_source_remove (self->prerender_id);
+        self->prerender_id = 0;
+    }
+    g_ptr_array_set_size (self->prerender_views, 0);
+    self->prerender_view = NULL;
+}
+
+/// Fills the atlas with the buttons of one view,
+/// starting with the current one,
+/// and renders the view if it can be switched to and isn't cached yet.
+/// Does only one view per call to keep the UI responsive.
+static gboolean
+prerender_next_view (gpointer user_data)
+{
+    EekRenderer *self = user_data;
+    struct squeek_layout *layout = self->prerender_keyboard->layout;
+    while (self->prerender_views->len > 0) {
+        const struct squeek_view *view = g_ptr_array_remove_index (
+            self->prerender_views, self->prerender_views->len - 1);
+        gboolean busy = self->atlas
+            && squeek_atlas_render_view (self->atlas, layout, view, self);
+        if (!g_hash_table_contains (self->base_views, view)) {
+            cairo_surface_t *surface = render_base_view (self,
+                self->prerender_geometry, layout, view, self->atlas);
+            g_hash_table_insert (self->base_views, (gpointer)view, surface);
+            busy = TRUE;
+        }
+        if (busy) {
+            return G_SOURCE_CONTINUE;
+        }
+    }
+    self->prerender_id = 0;
+    return G_SOURCE_REMOVE;
+}
+
+static void
+add_reachable_view (const struct squeek_view *view, void *data)
+{
+    g_ptr_array_add (data, (gpointer)view);
+}
+
+/// Prepares the atlas, and the views the user is likely to switch to next,
+/// once there's nothing more important to do.
+/// Style contexts can't be used outside of the main thread,
+/// so this happens in idle time rather than on a worker.
+/// The views are found only once per view,
+/// until the keyboard or the geometry changes.
+static void
+schedule_prerender (EekRenderer *self,
+                    struct render_geometry geometry,
+                    LevelKeyboard *keyboard)
+{
+    const struct squeek_view *view =
+        squeek_layout_get_current_view (keyboard->layout);
+    // Already being rendered, or done
+    if (view == self->prerender_view) {
+        return;
+    }
+    cancel_prerender (self);
+    self->prerender_view = view;
+    self->prerender_geometry = geometry;
+    self->prerender_keyboard = keyboard;
+    if (!self->atlas) {
+        // Nothing gets drawn yet, so this is quick
+        self->atlas = squeek_atlas_new (keyboard->layout,
+            geometry.widget_to_layout.scale * self->scale_factor);
+    }
+    squeek_layout_foreach_reachable_view (keyboard->layout,
+        add_reachable_view, self->prerender_views);
+    // The current view's buttons get pressed first, so they go first
+    g_ptr_array_add (self->prerender_views, (gpointer)view);
+    self->prerender_id = g_idle_add_full (G_PRIORITY_LOW,
+        prerender_next_view, self, NULL);
 }
 
 // FIXME: Pass just the active modifiers instead of entire submission
@@ -201,24 +456,105 @@ eek_renderer_render_keyboard (EekRenderer *self,
     g_return_if_fail (geometry.allocation_width > 0.0);
     g_return_if_fail (geometry.allocation_height > 0.0);
 
-    /* Paint the background covering the entire widget area */
-    gtk_render_background (self->view_context,
-                           cr,
-                           0, 0,
-                           geometry.allocation_width, geometry.allocation_height);
+    update_geometry (self, geometry);
+    /* Every button state is rasterized once per geometry,
+       so frames only need to copy pixels.
+       Until that's done in idle time, buttons get drawn directly. */
+    const struct squeek_atlas *atlas = self->atlas;
+    /* Released buttons look the same every frame, so they come from cache.
+       Only buttons in other states get drawn on top of them. */
+    cairo_surface_t *base = get_base_view (self, geometry, keyboard->layout,
+        atlas);
+    cairo_set_source_surface (cr, base, 0, 0);
+    cairo_paint (cr);
 
     cairo_save(cr);
     cairo_translate (cr, geometry.widget_to_layout.origin_x, geometry.widget_to_layout.origin_y);
     cairo_scale (cr, geometry.widget_to_layout.scale, geometry.widget_to_layout.scale);
 
-    squeek_draw_layout_base_view(keyboard->layout, self, cr);
-    squeek_layout_draw_all_changed(keyboard->layout, self, cr, submission);
+    squeek_layout_draw_all_changed(keyboard->layout, self, atlas, cr, submission);
     cairo_restore (cr);
+
+    schedule_prerender (self, geometry, keyboard);
+}
+
+/// Shared by all renderers, so that the style sheet is parsed only once.
+static GtkCssProvider *css_provider = NULL;
+
+/// Returns a new reference.
+static GtkCssProvider *
+get_css_provider (void)
+{
+    if (!css_provider) {
+        css_provider = squeek_load_style ();
+    }
+    return g_object_ref (css_provider);
+}
+
+static void
+set_css_provider (EekRenderer *self, GtkCssProvider *provider)
+{
+    if (self->css_provider) {
+        gtk_style_context_remove_provider (self->view_context,
+            GTK_STYLE_PROVIDER(self->css_provider));
+        gtk_style_context_remove_provider (self->button_context,
+            GTK_STYLE_PROVIDER(self->css_provider));
+        g_object_unref (self->css_provider);
+    }
+    self->css_provider = provider;
+    gtk_style_context_add_provider (self->view_context,
+        GTK_STYLE_PROVIDER(provider),
+        GTK_STYLE_PROVIDER_PRIORITY_APPLICATION);
+    gtk_style_context_add_provider (self->button_context,
+        GTK_STYLE_PROVIDER(provider),
+        GTK_STYLE_PROVIDER_PRIORITY_APPLICATION);
+}
+
+/// The style sheet is chosen based on the theme,
+/// so it and everything rendered with it are outdated.
+static void
+on_theme_changed (GtkSettings *settings, GParamSpec *pspec, gpointer user_data)
+{
+    (void)settings;
+    (void)pspec;
+    EekRenderer *self = user_data;
+    // Only the first renderer to notice reloads the shared sheet
+    if (css_provider == self->css_provider) {
+        g_clear_object (&css_provider);
+    }
+    set_css_provider (self, get_css_provider ());
+
+    cancel_prerender (self);
+    g_queue_clear (&self->label_layout_order);
+    g_hash_table_remove_all (self->label_layouts);
+    g_hash_table_remove_all (self->button_styles);
+    g_hash_table_remove_all (self->base_views);
+    g_clear_pointer (&self->atlas, squeek_atlas_free);
+}
+
+/// Icons are drawn into the cached views and the atlas,
+/// so those are outdated.
+/// The widget queues the redraw.
+static void
+on_icon_theme_changed (GtkIconTheme *theme, gpointer user_data)
+{
+    (void)theme;
+    EekRenderer *self = user_data;
+    cancel_prerender (self);
+    g_hash_table_remove_all (self->base_views);
+    g_clear_pointer (&self->atlas, squeek_atlas_free);
 }
 
 void
 eek_renderer_free (EekRenderer        *self)
 {
+    GtkSettings *settings = gtk_settings_get_default ();
+    if (settings) {
+        g_signal_handlers_disconnect_by_data (settings, self);
+    }
+    g_signal_handlers_disconnect_by_data (gtk_icon_theme_get_default (), self);
+    cancel_prerender (self);
+    g_ptr_array_free (self->prerender_views, TRUE);
     if (self->pcontext) {
         g_object_unref (self->pcontext);
         self->pcontext = NULL;
@@ -226,7 +562,13 @@ eek_renderer_free (EekRenderer        *self)
     g_object_unref(self->css_provider);
     g_object_unref(self->view_context);
     g_object_unref(self->button_context);
-    // this is where renderer-specific surfaces would be released
+    g_hash_table_destroy(self->base_views);
+    g_clear_pointer(&self->atlas, squeek_atlas_free);
+    g_hash_table_destroy(self->button_styles);
+    g_string_free(self->button_style_key, TRUE);
+    g_queue_clear(&self->label_layout_order);
+    g_hash_table_destroy(self->label_layouts);
+    g_string_free(self->label_layout_key, TRUE);
 
     free(self);
 }
@@ -262,8 +604,26 @@ renderer_init (EekRenderer *self)
 {
     self->pcontext = NULL;
     self->scale_factor = 1;
-
-    self->css_provider = squeek_load_style();
+    self->base_views = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+        NULL, (GDestroyNotify)cairo_surface_destroy);
+    self->button_styles = g_hash_table_new_full (g_str_hash, g_str_equal,
+        g_free, (GDestroyNotify)button_style_free);
+    self->button_style_key = g_string_new (NULL);
+    self->label_layouts = g_hash_table_new_full (g_str_hash, g_str_equal,
+        g_free, (GDestroyNotify)label_layout_free);
+    g_queue_init (&self->label_layout_order);
+    self->label_layout_key = g_string_new (NULL);
+    self->prerender_views = g_ptr_array_new ();
+
+    GtkSettings *settings = gtk_settings_get_default ();
+    if (settings) {
+        g_signal_connect (settings, "notify::gtk-theme-name",
+            G_CALLBACK (on_theme_changed), self);
+        g_signal_connect (settings, "notify::gtk-application-prefer-dark-theme",
+            G_CALLBACK (on_theme_changed), self);
+    }
+    g_signal_connect (gtk_icon_theme_get_default (), "changed",
+        G_CALLBACK (on_icon_theme_changed), self);
 }
 
 EekRenderer *
@@ -282,41 +642,65 @@ eek_renderer_new (LevelKeyboard  *keyboard,
     renderer->view_context = gtk_style_context_new();
     gtk_style_context_set_path(renderer->view_context, path);
     gtk_widget_path_unref(path);
-    if (squeek_layout_get_kind(keyboard->layout) == ARRANGEMENT_KIND_WIDE) {
-        gtk_style_context_add_class(renderer->view_context, "wide");
-    }
-    gtk_style_context_add_provider (renderer->view_context,
-        GTK_STYLE_PROVIDER(renderer->css_provider),
-        GTK_STYLE_PROVIDER_PRIORITY_APPLICATION);
 
     /* Create a style context for the buttons */
     path = gtk_widget_path_new();
     gtk_widget_path_append_type(path, view_type());
-    if (squeek_layout_get_kind(keyboard->layout) == ARRANGEMENT_KIND_WIDE) {
-        gtk_widget_path_iter_add_class(path, -1, "wide");
-    }
     gtk_widget_path_append_type(path, button_type());
     renderer->button_context = gtk_style_context_new ();
     gtk_style_context_set_path(renderer->button_context, path);
     gtk_widget_path_unref(path);
     gtk_style_context_set_parent(renderer->button_context, renderer->view_context);
     gtk_style_context_set_state (renderer->button_context, GTK_STATE_FLAG_NORMAL);
-    gtk_style_context_add_provider (renderer->button_context,
-        GTK_STYLE_PROVIDER(renderer->css_provider),
-        GTK_STYLE_PROVIDER_PRIORITY_APPLICATION);
+
+    set_css_provider (renderer, get_css_provider ());
+    eek_renderer_set_keyboard (renderer, keyboard);
     return renderer;
 }
 
+/// Switches to drawing another keyboard.
+/// Only the arrangement class changes,
+/// but anything rendered from the previous layout gets dropped.
+void
+eek_renderer_set_keyboard (EekRenderer *self, LevelKeyboard *keyboard)
+{
+    gboolean wide =
+        squeek_layout_get_kind(keyboard->layout) == ARRANGEMENT_KIND_WIDE;
+    if (wide != self->wide) {
+        self->wide = wide;
+        g_autoptr (GtkWidgetPath) path = NULL;
+        path = gtk_widget_path_copy (
+            gtk_style_context_get_path (self->button_context));
+        // The view is the first element of the button path
+        if (wide) {
+            gtk_style_context_add_class(self->view_context, "wide");
+            gtk_widget_path_iter_add_class(path, 0, "wide");
+        } else {
+            gtk_style_context_remove_class(self->view_context, "wide");
+            gtk_widget_path_iter_remove_class(path, 0, "wide");
+        }
+        gtk_style_context_set_path(self->button_context, path);
+        g_hash_table_remove_all (self->button_styles);
+    }
+
+    // Those refer to views and buttons of the layout
+    cancel_prerender (self);
+    g_hash_table_remove_all (self->base_views);
+    g_clear_pointer (&self->atlas, squeek_atlas_free);
+}
+
 struct render_geometry
 eek_render_geometry_from_allocation_size (struct squeek_layout *layout,
                                   gdouble      width,
-                                  gdouble      height)
+                                  gdouble      height,
+                                  gint         scale_factor)
 {
     struct render_geometry ret = {
         .allocation_width = width,
         .allocation_height = height,
-        .widget_to_layout = squeek_layout_calculate_transformation(
-            layout, width, height),
+        .scale_factor = scale_factor,
+        .widget_to_layout = squeek_layout_calculate_snapped_transformation(
+            layout, width, height, (uint32_t)scale_factor),
     };
     return ret;
 }
@@ -327,18 +711,66 @@ eek_renderer_set_scale_factor (EekRenderer *renderer, gint scale)
     renderer->scale_factor = scale;
 }
 
-/// Rust interface.
-uint32_t eek_renderer_get_scale_factor(EekRenderer *renderer) {
-    return renderer->scale_factor;
+/// Loaded icon surface, and its place in the eviction order.
+struct icon_entry {
+    cairo_surface_t *surface; // owned
+    GList *link; // owned by icon_cache.order
+};
+
+/// Icons loaded from the theme.
+/// Only a handful of icons is used by layouts,
+/// so the bound is there just to prevent unchecked growth.
+static struct {
+    /// Keys are "name\nsize\nscale", values are struct icon_entry
+    GHashTable *entries;
+    /// Keys from entries, most recently used last
+    GQueue order;
+} icon_cache = {0};
+
+#define ICON_CACHE_MAX_ENTRIES 64
+
+static void
+icon_entry_free (struct icon_entry *entry)
+{
+    cairo_surface_destroy (entry->surface);
+    g_free (entry);
 }
 
+static void
+flush_icon_cache (GtkIconTheme *theme, gpointer user_data)
+{
+    (void)theme;
+    (void)user_data;
+    g_queue_clear (&icon_cache.order);
+    g_hash_table_remove_all (icon_cache.entries);
+}
+
+/// Returns a new reference to the surface, or NULL on failure.
 cairo_surface_t *
 eek_renderer_get_icon_surface (const gchar *icon_name,
                                gint size,
                                gint scale)
 {
+    GtkIconTheme *theme = gtk_icon_theme_get_default ();
+    if (!icon_cache.entries) {
+        icon_cache.entries = g_hash_table_new_full (g_str_hash, g_str_equal,
+            g_free, (GDestroyNotify)icon_entry_free);
+        g_queue_init (&icon_cache.order);
+        g_signal_connect (theme, "changed",
+            G_CALLBACK (flush_icon_cache), NULL);
+    }
+
+    g_autofree gchar *key = g_strdup_printf ("%s\n%d\n%d",
+        icon_name, size, scale);
+    struct icon_entry *entry = g_hash_table_lookup (icon_cache.entries, key);
+    if (entry) {
+        g_queue_unlink (&icon_cache.order, entry->link);
+        g_queue_push_tail_link (&icon_cache.order, entry->link);
+        return cairo_surface_reference (entry->surface);
+    }
+
     GError *error = NULL;
-    cairo_surface_t *surface = gtk_icon_theme_load_surface (gtk_icon_theme_get_default (),
+    cairo_surface_t *surface = gtk_icon_theme_load_surface (theme,
                                                             icon_name,
                                                             size,
                                                             scale,
@@ -353,5 +785,17 @@ eek_renderer_get_icon_surface (const gchar *icon_name,
         g_error_free (error);
         return NULL;
     }
+
+    if (g_queue_get_length (&icon_cache.order) >= ICON_CACHE_MAX_ENTRIES) {
+        // The key is owned by the table, so it must stop being used first
+        gchar *oldest = g_queue_pop_head (&icon_cache.order);
+        g_hash_table_remove (icon_cache.entries, oldest);
+    }
+
+    entry = g_new0 (struct icon_entry, 1);
+    entry->surface = cairo_surface_reference (surface);
+    g_queue_push_tail (&icon_cache.order, key);
+    entry->link = g_queue_peek_tail_link (&icon_cache.order);
+    g_hash_table_insert (icon_cache.entries, g_steal_pointer (&key), entry);
     return surface;
 }
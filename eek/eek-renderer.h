@@ -28,39 +28,82 @@
 #include "src/submission.h"
 
 struct squeek_layout;
+struct squeek_atlas;
+struct squeek_view;
 
-/// Renders LevelKayboards
-/// It cannot adjust styles at runtime.
+/// Mutable part of the renderer state.
+struct render_geometry {
+    /// Background extents
+    gdouble allocation_width;
+    gdouble allocation_height;
+    /// Device pixels per widget pixel, which the transformation is snapped to
+    gint scale_factor;
+    /// Coords transformation
+    struct transformation widget_to_layout;
+};
+
+/// Renders LevelKayboards.
+/// Meant to live as long as the widget, across keyboard changes.
 typedef struct EekRenderer
 {
     PangoContext *pcontext; // owned
-    GtkCssProvider *css_provider; // owned
+    GtkCssProvider *css_provider; // owned, shared with other renderers
     GtkStyleContext *view_context; // owned
-    GtkStyleContext *button_context; // TODO: maybe move a copy to each button
+    /// Template for the contexts of resolved button styles
+    GtkStyleContext *button_context; // owned
     /// Style class for rendering the view and button CSS.
     gchar *extra_style; // owned
 
     // Mutable state
     gint scale_factor; /* the outputs scale factor */
-} EekRenderer;
+    /// Whether the current keyboard has the wide arrangement
+    gboolean wide;
 
+    /// Views rendered with all buttons released, background included.
+    /// Keys are views, values are owned cairo_surface_t.
+    /// All share the size and scale factor below.
+    GHashTable *base_views; // owned
+    gdouble base_views_width;
+    gdouble base_views_height;
+    gint base_views_scale_factor;
+    /// Buttons in all states, for the same size and scale factor.
+    /// Filled a view at a time while prerendering.
+    /// NULL until then, or if it couldn't be created.
+    struct squeek_atlas *atlas; // owned
+    /// Resolved button styles, keyed by name, outline, locked class
+    /// and pressed state. Values are owned struct button_style.
+    GHashTable *button_styles; // owned
+    /// Scratch space for building keys into button_styles.
+    GString *button_style_key; // owned
+    /// Shaped label text, keyed by label, font, width and device scale.
+    /// Values are owned struct label_layout.
+    GHashTable *label_layouts; // owned
+    /// Keys from label_layouts, most recently used last
+    GQueue label_layout_order;
+    /// Scratch space for building keys into label_layouts.
+    GString *label_layout_key; // owned
 
-/// Mutable part of the renderer state.
-/// TODO: Possibly should include scale factor.
-struct render_geometry {
-    /// Background extents
-    gdouble allocation_width;
-    gdouble allocation_height;
-    /// Coords transformation
-    struct transformation widget_to_layout;
-};
+    /// Idle source rendering views reachable from the current one
+    guint prerender_id;
+    /// Current view when the reachable views were found, NULL before.
+    const struct squeek_view *prerender_view;
+    /// Reachable views still to be checked by the idle source
+    GPtrArray *prerender_views; // owned
+    /// What the views get rendered with
+    struct render_geometry prerender_geometry;
+    LevelKeyboard *prerender_keyboard;
+} EekRenderer;
 
 GType            eek_renderer_get_type         (void) G_GNUC_CONST;
 EekRenderer     *eek_renderer_new              (LevelKeyboard     *keyboard,
                                                 PangoContext    *pcontext);
 void             eek_renderer_set_scale_factor (EekRenderer     *renderer,
                                                 gint             scale);
+void             eek_renderer_set_keyboard     (EekRenderer     *renderer,
+                                                LevelKeyboard   *keyboard);
 
+/// Loads the icon from the default theme, or returns a cached copy.
+/// The returned reference must be released.
 cairo_surface_t *eek_renderer_get_icon_surface(const gchar     *icon_name,
                                                 gint             size,
                                                 gint             scale);
@@ -72,7 +115,7 @@ eek_renderer_free (EekRenderer        *self);
 
 struct render_geometry
 eek_render_geometry_from_allocation_size (struct squeek_layout *layout,
-    gdouble      width, gdouble      height);
+    gdouble      width, gdouble      height, gint scale_factor);
 
 G_END_DECLS
 #endif  /* EEK_RENDERER_H */
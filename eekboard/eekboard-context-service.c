@@ -344,3 +344,9 @@ void eekboard_context_service_set_submission(EekboardContextService *context, st
 void eekboard_context_service_set_ui(EekboardContextService *context, ServerContextService *ui) {
     context->ui = ui;
 }
+
+void eekboard_context_service_set_suggestions(EekboardContextService *context, const char *const *words) {
+    if (context->ui) {
+        server_context_service_set_suggestions(context->ui, words);
+    }
+}
@@ -49,6 +49,10 @@ void eekboard_context_service_set_keymap(EekboardContextService *context,
 void eekboard_context_service_set_hint_purpose(EekboardContextService *context,
                                                uint32_t hint,
                                                uint32_t purpose);
+/// Shows completions of the current word. `words` is NULL-terminated,
+/// or NULL when the text field doesn't want completions.
+void eekboard_context_service_set_suggestions(EekboardContextService *context,
+                                              const char *const *words);
 void
 eekboard_context_service_use_layout(EekboardContextService *context, struct squeek_layout_state *layout, uint32_t timestamp);
 G_END_DECLS
@@ -6,8 +6,13 @@ use std::ffi::CString;
 #[derive(Debug, Clone, PartialEq)]
 pub struct KeySym(pub String);
 
-/// Use to switch views
-type View = String;
+/// Use to switch views.
+/// It's the index of the view in the layout's table of views,
+/// resolved from the name when the layout is built.
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash, PartialOrd, Ord)]
+pub struct ViewId(pub usize);
+
+type View = ViewId;
 
 /// Use to send modified keypresses
 #[derive(Debug, Clone, Copy, PartialEq, Eq, Hash)]
@@ -52,26 +57,24 @@ pub enum Action {
 }
 
 impl Action {
-    pub fn is_locked(&self, view_name: &str) -> bool {
+    pub fn is_locked(&self, view: View) -> bool {
         match self {
-            Action::LockView { lock, unlock: _, latches: _, looks_locked_from: _ } => lock == view_name,
+            Action::LockView { lock, unlock: _, latches: _, looks_locked_from: _ } => *lock == view,
             _ => false,
         }
     }
-    pub fn has_locked_appearance_from(&self, locked_view_name: &str) -> bool {
+    pub fn has_locked_appearance_from(&self, locked_view: View) -> bool {
         match self {
             Action::LockView { lock: _, unlock: _, latches: _, looks_locked_from } => {
-                looks_locked_from.iter()
-                    .find(|view| locked_view_name == view.as_str())
-                    .is_some()
+                looks_locked_from.contains(&locked_view)
             },
             _ => false,
         }
     }
-    pub fn is_active(&self, view_name: &str) -> bool {
+    pub fn is_active(&self, view: View) -> bool {
         match self {
-            Action::SetView(view) => view == view_name,
-            Action::LockView { lock, unlock: _, latches: _, looks_locked_from: _ } => lock == view_name,
+            Action::SetView(v) => *v == view,
+            Action::LockView { lock, unlock: _, latches: _, looks_locked_from: _ } => *lock == view,
             _ => false,
         }
     }
@@ -0,0 +1,240 @@
+/*! Correcting mistyped words.
+ *
+ * Finds dictionary words within a small edit distance
+ * by walking the trie and computing one row of the distance matrix per node.
+ * A branch where the whole row exceeds the limit can't lead to a match,
+ * so only a small part of even a large dictionary gets visited.
+ *
+ * Substituting letters on neighbouring keys costs less than other edits,
+ * because those are the most common typos.
+ *
+ * Library module.
+ */
+
+use ::prediction::Dictionary;
+use ::swipe::{ KeyCenters, lowercase };
+
+/// How many dictionary nodes a correction may visit
+const BUDGET: usize = 20000;
+/// Longer words are left alone
+const MAX_LENGTH: usize = 24;
+/// How much word frequency weighs against the edit distance
+const FREQUENCY_WEIGHT: f32 = 0.3;
+
+/// How far a candidate may be from a typed word of this length
+fn max_distance(length: usize) -> f32 {
+    if length < 3 {
+        0.0
+    } else if length < 5 {
+        1.0
+    } else {
+        2.0
+    }
+}
+
+fn substitution_cost(keys: &KeyCenters, typed: char, candidate: char) -> f32 {
+    if typed == candidate {
+        return 0.0;
+    }
+    match keys.get_distance(typed, candidate) {
+        // Neighbouring keys are about 1 apart
+        Some(distance) => (0.4 + 0.3 * distance as f32).min(1.0),
+        None => 1.0,
+    }
+}
+
+/// The last rows of the distance matrix between the typed word
+/// and the candidate prefix
+#[derive(Clone)]
+struct Rows {
+    previous: Vec<f32>,
+    current: Vec<f32>,
+    /// The last letter of the candidate prefix
+    letter: Option<char>,
+}
+
+impl Rows {
+    /// Extends the candidate prefix by a letter
+    fn step(&self, keys: &KeyCenters, typed: &[char], letter: char) -> Rows {
+        let mut next = Vec::with_capacity(self.current.len());
+        next.push(self.current[0] + 1.0);
+        for j in 1..self.current.len() {
+            let t = typed[j - 1];
+            let mut cost = (self.current[j] + 1.0)
+                .min(next[j - 1] + 1.0)
+                .min(self.current[j - 1] + substitution_cost(keys, t, letter));
+            // Neighbouring letters typed in the wrong order
+            if j > 1 && Some(t) == self.letter && typed[j - 2] == letter {
+                cost = cost.min(self.previous[j - 2] + 1.0);
+            }
+            next.push(cost);
+        }
+        Rows {
+            previous: self.current.clone(),
+            current: next,
+            letter: Some(letter),
+        }
+    }
+
+    fn get_min(&self) -> f32 {
+        self.current.iter().cloned().fold(::std::f32::INFINITY, f32::min)
+    }
+}
+
+/// Returns the word the user most likely meant,
+/// or None if the typed word is known, or nothing is close.
+/// The case of the first letter is preserved.
+pub fn correct(dict: &Dictionary, keys: &KeyCenters, word: &str)
+    -> Option<String>
+{
+    let typed: Vec<char> = word.chars().map(lowercase).collect();
+    if typed.len() > MAX_LENGTH {
+        return None;
+    }
+    let limit = max_distance(typed.len());
+    if limit == 0.0 {
+        return None;
+    }
+    // The walk may run out of budget before reaching the word
+    let lowered: String = typed.iter().collect();
+    if dict.contains(word) || dict.contains(&lowered) {
+        return None;
+    }
+
+    let initial: Vec<f32> = (0..typed.len() + 1).map(|i| i as f32).collect();
+    let mut best: Option<(f32, String)> = None;
+    let mut known = false;
+    let finished = dict.walk(
+        Rows { previous: initial.clone(), current: initial, letter: None },
+        BUDGET,
+        |rows, c| {
+            let rows = rows.step(keys, &typed, lowercase(c));
+            match rows.get_min() <= limit {
+                true => Some(rows),
+                false => None,
+            }
+        },
+        |candidate, weight, rows| {
+            let distance = rows.current[typed.len()];
+            if distance == 0.0 {
+                known = true;
+            } else if distance <= limit {
+                let score = distance - FREQUENCY_WEIGHT * weight as f32 / 255.0;
+                if best.as_ref().map(|&(best, _)| score < best).unwrap_or(true) {
+                    best = Some((score, candidate.to_owned()));
+                }
+            }
+        },
+    );
+    // The best candidate may be among the words not visited
+    if known || !finished {
+        return None;
+    }
+    best.map(|(_, candidate)| {
+        let mut chars = candidate.chars();
+        match (word.chars().next(), chars.next()) {
+            (Some(typed), Some(first)) if typed.is_uppercase() => {
+                first.to_uppercase().chain(chars).collect()
+            },
+            _ => candidate.clone(),
+        }
+    })
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use std::iter;
+    use ::prediction::compile;
+    use ::swipe::test::qwerty;
+
+    fn dictionary() -> Vec<u8> {
+        compile(vec![
+            ("the", 1000), ("then", 100), ("they", 300),
+            ("hello", 50), ("world", 50), ("car", 10), ("cat", 10),
+        ])
+    }
+
+    #[test]
+    fn correct_typos() {
+        let data = dictionary();
+        let dict = Dictionary::new(&data).unwrap();
+        let keys = qwerty();
+        // Swapped letters
+        assert_eq!(correct(&dict, &keys, "teh"), Some("the".into()));
+        // Neighbouring key
+        assert_eq!(correct(&dict, &keys, "wprld"), Some("world".into()));
+        // Missing letter
+        assert_eq!(correct(&dict, &keys, "helo"), Some("hello".into()));
+        assert_eq!(correct(&dict, &keys, "Hrllo"), Some("Hello".into()));
+    }
+
+    #[test]
+    fn correct_nearest_key() {
+        let data = dictionary();
+        let dict = Dictionary::new(&data).unwrap();
+        // "t" is next to "y", "r" is not
+        assert_eq!(correct(&dict, &qwerty(), "cay"), Some("cat".into()));
+    }
+
+    #[test]
+    fn keep_words() {
+        let data = dictionary();
+        let dict = Dictionary::new(&data).unwrap();
+        let keys = qwerty();
+        assert_eq!(correct(&dict, &keys, "then"), None);
+        assert_eq!(correct(&dict, &keys, "They"), None);
+        // Too short to guess
+        assert_eq!(correct(&dict, &keys, "tg"), None);
+        // Too far from anything
+        assert_eq!(correct(&dict, &keys, "xyzzy"), None);
+    }
+
+    /// "abcdefghij" with any 2 letters replaced.
+    /// So many words are close to each other
+    /// that a correction can't visit all the candidates.
+    fn large_dictionary() -> Vec<u8> {
+        let base: Vec<char> = "abcdefghij".chars().collect();
+        let letters: Vec<char> = (b'a'..b'z' + 1).map(char::from).collect();
+        let mut words = Vec::new();
+        for i in 0..base.len() {
+            for j in (i + 1)..base.len() {
+                for a in letters.iter() {
+                    for b in letters.iter() {
+                        let mut word = base.clone();
+                        word[i] = *a;
+                        word[j] = *b;
+                        words.push(word.into_iter().collect::<String>());
+                    }
+                }
+            }
+        }
+        compile(words.iter().map(|word| (word.as_str(), 1)))
+    }
+
+    #[test]
+    fn over_budget() {
+        let data = large_dictionary();
+        let dict = Dictionary::new(&data).unwrap();
+        let keys = qwerty();
+        // Visited last, after the budget runs out
+        assert_eq!(correct(&dict, &keys, "abcdefghij"), None);
+        assert_eq!(correct(&dict, &keys, "Abcdefghij"), None);
+        // Candidates get found, but maybe not the best one
+        assert_eq!(correct(&dict, &keys, "abcdefgxyz"), None);
+    }
+
+    #[test]
+    fn length_limit() {
+        let word: String = iter::repeat('a').take(MAX_LENGTH).collect();
+        let longer = format!("{}a", word);
+        let data = compile(vec![(word.as_str(), 1), (longer.as_str(), 1)]);
+        let dict = Dictionary::new(&data).unwrap();
+        let keys = qwerty();
+        assert_eq!(
+            correct(&dict, &keys, &format!("{}s", &word[1..])),
+            Some(word.clone()),
+        );
+        assert_eq!(correct(&dict, &keys, &format!("{}s", word)), None);
+    }
+}
@@ -0,0 +1,52 @@
+#[macro_use]
+extern crate clap;
+extern crate rs;
+
+use rs::prediction::compile;
+use std::fs;
+use std::io::{ self, BufRead, Write };
+use std::process;
+
+fn main() -> () {
+    let matches = clap_app!(compile_dictionary =>
+        (name: "squeekboard-compile-dictionary")
+        (about: "Compile a word list for completion. Each line of the input contains a word, optionally followed by a tab and its frequency.")
+        (@arg INPUT: +required "Word list file")
+        (@arg OUTPUT: +required "Compiled dictionary file")
+    ).get_matches();
+
+    let input = fs::File::open(matches.value_of("INPUT").unwrap())
+        .unwrap_or_else(|e| {
+            eprintln!("Can't open input: {}", e);
+            process::exit(1);
+        });
+    let entries: Vec<(String, u64)> = io::BufReader::new(input).lines()
+        .map(|line| line.unwrap_or_else(|e| {
+            eprintln!("Can't read input: {}", e);
+            process::exit(1);
+        }))
+        .filter_map(|line| {
+            let mut fields = line.trim_end().splitn(2, '\t');
+            let word = fields.next().unwrap().to_owned();
+            let count = fields.next()
+                .map(|c| c.trim().parse().unwrap_or_else(|_| {
+                    eprintln!("Bad frequency for {}", word);
+                    process::exit(1);
+                }))
+                .unwrap_or(1);
+            match word.is_empty() {
+                true => None,
+                false => Some((word, count)),
+            }
+        })
+        .collect();
+
+    let data = compile(entries.iter().map(|(w, c)| (w.as_str(), *c)));
+    fs::File::create(matches.value_of("OUTPUT").unwrap())
+        .and_then(|mut f| f.write_all(&data))
+        .unwrap_or_else(|e| {
+            eprintln!("Can't write output: {}", e);
+            process::exit(1);
+        });
+    println!("{} words, {} bytes", entries.len(), data.len());
+}
@@ -0,0 +1,28 @@
+#[macro_use]
+extern crate clap;
+extern crate rs;
+
+use rs::data::compiled::compile_builtin;
+use std::fs;
+use std::io::Write;
+use std::process;
+
+fn main() -> () {
+    let matches = clap_app!(compile_layouts =>
+        (name: "squeekboard-compile-layouts")
+        (about: "Check the builtin layouts for errors, and compile them for faster loading.")
+        (@arg OUTPUT: +required "Compiled layouts file")
+    ).get_matches();
+
+    let data = compile_builtin().unwrap_or_else(|e| {
+        eprintln!("{}", e);
+        process::exit(1);
+    });
+    fs::File::create(matches.value_of("OUTPUT").unwrap())
+        .and_then(|mut f| f.write_all(&data))
+        .unwrap_or_else(|e| {
+            eprintln!("Can't write output: {}", e);
+            process::exit(1);
+        });
+    println!("{} bytes", data.len());
+}
@@ -0,0 +1,582 @@
+/* Copyright (C) 2020-2021 Purism SPC
+ * SPDX-License-Identifier: GPL-3.0+
+ */
+
+/*! Builtin layouts, parsed ahead of time.
+ *
+ * Parsing YAML takes the biggest part of loading a layout.
+ * The build validates the builtin layouts
+ * (see the `compile_layouts` tool)
+ * and stores them in a compact binary file,
+ * which gets memory-mapped and read directly.
+ *
+ * File format, all integers little endian:
+ *
+ * ```text
+ * header:  b"SQLY", version: u8, 3 bytes padding,
+ *          string count: u32, layout count: u32
+ * strings: string count × (offset: u32, length: u32)
+ * index:   layout count × (name: u32, source hash: u64,
+ *                          offset: u32, length: u32)
+ * data:    string contents and layout records
+ * ```
+ *
+ * Offsets count from the start of the file.
+ * Strings are interned, and referred to by their number in the table.
+ * Within records, `f64`s take 8 bytes, `bool`s and enum tags 1 byte,
+ * and sequences start with a `u32` length.
+ *
+ * The source hash is taken from the YAML embedded in the program.
+ * Records which don't match it are ignored,
+ * so a file left over from another version can't cause wrong layouts.
+ */
+
+use std::collections::HashMap;
+use std::collections::hash_map::DefaultHasher;
+use std::fmt;
+use std::path::PathBuf;
+use std::env;
+use std::str;
+
+use super::parsing;
+use ::logging;
+use ::resources;
+use ::util::MappedFile;
+use ::xdg;
+
+// Traits
+use std::hash::Hasher;
+use ::logging::Warn;
+
+
+const MAGIC: &[u8] = b"SQLY";
+const VERSION: u8 = 1;
+const HEADER_SIZE: usize = 16;
+const STRING_SIZE: usize = 8;
+const INDEX_SIZE: usize = 20;
+
+/// Name of the file in the data dirs
+const FILE_NAME: &str = "squeekboard/layouts.bin";
+
+#[derive(Debug, Clone, PartialEq)]
+pub enum Error {
+    BadMagic,
+    UnsupportedVersion(u8),
+    /// Some data points outside of the file, or is invalid
+    Corrupted,
+}
+
+impl fmt::Display for Error {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        match self {
+            Error::BadMagic => write!(f, "Not a compiled layout file"),
+            Error::UnsupportedVersion(v) => write!(f, "Unsupported version {}", v),
+            Error::Corrupted => write!(f, "Corrupted"),
+        }
+    }
+}
+
+fn hash_source(source: &str) -> u64 {
+    let mut hasher = DefaultHasher::new();
+    hasher.write(source.as_bytes());
+    hasher.finish()
+}
+
+fn read_u32(data: &[u8], offset: usize) -> Result<u32, Error> {
+    let bytes = data.get(offset..offset + 4).ok_or(Error::Corrupted)?;
+    let mut value = 0;
+    for (i, b) in bytes.iter().enumerate() {
+        value |= (*b as u32) << (8 * i);
+    }
+    Ok(value)
+}
+
+fn read_u64(data: &[u8], offset: usize) -> Result<u64, Error> {
+    let low = read_u32(data, offset)? as u64;
+    let high = read_u32(data, offset + 4)? as u64;
+    Ok(low | high << 32)
+}
+
+fn push_u32(data: &mut Vec<u8>, value: u32) {
+    for i in 0..4 {
+        data.push((value >> (8 * i)) as u8);
+    }
+}
+
+fn push_u64(data: &mut Vec<u8>, value: u64) {
+    push_u32(data, value as u32);
+    push_u32(data, (value >> 32) as u32);
+}
+
+/// Encodes values into records, interning strings
+pub struct Writer {
+    data: Vec<u8>,
+    strings: Vec<String>,
+    string_ids: HashMap<String, u32>,
+}
+
+impl Writer {
+    fn new() -> Writer {
+        Writer {
+            data: Vec::new(),
+            strings: Vec::new(),
+            string_ids: HashMap::new(),
+        }
+    }
+
+    pub fn write_u8(&mut self, value: u8) {
+        self.data.push(value);
+    }
+
+    pub fn write_u32(&mut self, value: u32) {
+        push_u32(&mut self.data, value);
+    }
+
+    /// Returns the number of the string in the table
+    fn intern(&mut self, value: &str) -> u32 {
+        match self.string_ids.get(value) {
+            Some(id) => *id,
+            None => {
+                let id = self.strings.len() as u32;
+                self.strings.push(value.into());
+                self.string_ids.insert(value.into(), id);
+                id
+            },
+        }
+    }
+
+    pub fn write_str(&mut self, value: &str) {
+        let id = self.intern(value);
+        self.write_u32(id);
+    }
+}
+
+/// The string table of a file
+#[derive(Clone, Copy)]
+struct Strings<'a> {
+    data: &'a [u8],
+    count: usize,
+}
+
+impl<'a> Strings<'a> {
+    fn get(&self, id: u32) -> Result<&'a str, Error> {
+        let id = id as usize;
+        if id >= self.count {
+            return Err(Error::Corrupted);
+        }
+        let entry = HEADER_SIZE + id * STRING_SIZE;
+        let offset = read_u32(self.data, entry)? as usize;
+        let length = read_u32(self.data, entry + 4)? as usize;
+        let bytes = self.data.get(offset..offset + length)
+            .ok_or(Error::Corrupted)?;
+        str::from_utf8(bytes).map_err(|_| Error::Corrupted)
+    }
+}
+
+/// Decodes values from a record
+pub struct Reader<'a> {
+    strings: Strings<'a>,
+    data: &'a [u8],
+}
+
+impl<'a> Reader<'a> {
+    pub fn read_u8(&mut self) -> Result<u8, Error> {
+        let (first, rest) = self.data.split_first().ok_or(Error::Corrupted)?;
+        self.data = rest;
+        Ok(*first)
+    }
+
+    pub fn read_u32(&mut self) -> Result<u32, Error> {
+        let value = read_u32(self.data, 0)?;
+        self.data = &self.data[4..];
+        Ok(value)
+    }
+
+    pub fn read_str(&mut self) -> Result<&'a str, Error> {
+        let id = self.read_u32()?;
+        self.strings.get(id)
+    }
+
+    /// Reads the length of a sequence.
+    /// Every item takes at least a byte,
+    /// so a corrupted length can't cause a huge allocation.
+    fn read_count(&mut self) -> Result<usize, Error> {
+        let count = self.read_u32()? as usize;
+        match count <= self.data.len() {
+            true => Ok(count),
+            false => Err(Error::Corrupted),
+        }
+    }
+}
+
+/// A type which can be stored in a compiled layout
+pub trait Compiled: Sized {
+    fn write(&self, writer: &mut Writer);
+    fn read(reader: &mut Reader) -> Result<Self, Error>;
+}
+
+impl Compiled for bool {
+    fn write(&self, writer: &mut Writer) {
+        writer.write_u8(*self as u8);
+    }
+    fn read(reader: &mut Reader) -> Result<Self, Error> {
+        match reader.read_u8()? {
+            0 => Ok(false),
+            1 => Ok(true),
+            _ => Err(Error::Corrupted),
+        }
+    }
+}
+
+impl Compiled for f64 {
+    fn write(&self, writer: &mut Writer) {
+        push_u64(&mut writer.data, self.to_bits());
+    }
+    fn read(reader: &mut Reader) -> Result<Self, Error> {
+        let bits = read_u64(reader.data, 0)?;
+        reader.data = &reader.data[8..];
+        Ok(f64::from_bits(bits))
+    }
+}
+
+impl Compiled for String {
+    fn write(&self, writer: &mut Writer) {
+        writer.write_str(self);
+    }
+    fn read(reader: &mut Reader) -> Result<Self, Error> {
+        reader.read_str().map(String::from)
+    }
+}
+
+impl<T: Compiled> Compiled for Option<T> {
+    fn write(&self, writer: &mut Writer) {
+        match self {
+            None => writer.write_u8(0),
+            Some(value) => {
+                writer.write_u8(1);
+                value.write(writer);
+            },
+        }
+    }
+    fn read(reader: &mut Reader) -> Result<Self, Error> {
+        match reader.read_u8()? {
+            0 => Ok(None),
+            1 => T::read(reader).map(Some),
+            _ => Err(Error::Corrupted),
+        }
+    }
+}
+
+impl<T: Compiled> Compiled for Vec<T> {
+    fn write(&self, writer: &mut Writer) {
+        writer.write_u32(self.len() as u32);
+        for item in self {
+            item.write(writer);
+        }
+    }
+    fn read(reader: &mut Reader) -> Result<Self, Error> {
+        let count = reader.read_count()?;
+        (0..count).map(|_| T::read(reader)).collect()
+    }
+}
+
+impl<T: Compiled> Compiled for HashMap<String, T> {
+    fn write(&self, writer: &mut Writer) {
+        // Sorted, so that the same layout always gives the same file
+        let mut keys: Vec<&String> = self.keys().collect();
+        keys.sort();
+        writer.write_u32(keys.len() as u32);
+        for key in keys {
+            writer.write_str(key);
+            self[key].write(writer);
+        }
+    }
+    fn read(reader: &mut Reader) -> Result<Self, Error> {
+        let count = reader.read_count()?;
+        (0..count)
+            .map(|_| {
+                let key = String::read(reader)?;
+                T::read(reader).map(|value| (key, value))
+            })
+            .collect()
+    }
+}
+
+/// A view into a compiled layout file
+pub struct Layouts<'a> {
+    data: &'a [u8],
+    strings: Strings<'a>,
+    count: usize,
+}
+
+impl<'a> Layouts<'a> {
+    pub fn new(data: &'a [u8]) -> Result<Layouts<'a>, Error> {
+        if data.len() < HEADER_SIZE || &data[..MAGIC.len()] != MAGIC {
+            return Err(Error::BadMagic);
+        }
+        let version = data[MAGIC.len()];
+        if version != VERSION {
+            return Err(Error::UnsupportedVersion(version));
+        }
+        let string_count = read_u32(data, 8)? as usize;
+        let count = read_u32(data, 12)? as usize;
+        let tables_size = string_count.checked_mul(STRING_SIZE)
+            .and_then(|size| {
+                count.checked_mul(INDEX_SIZE)
+                    .and_then(|index| index.checked_add(size))
+            })
+            .and_then(|size| size.checked_add(HEADER_SIZE))
+            .ok_or(Error::Corrupted)?;
+        if tables_size > data.len() {
+            return Err(Error::Corrupted);
+        }
+        Ok(Layouts {
+            data,
+            strings: Strings { data, count: string_count },
+            count,
+        })
+    }
+
+    fn get_entry_offset(&self, idx: usize) -> usize {
+        HEADER_SIZE + self.strings.count * STRING_SIZE + idx * INDEX_SIZE
+    }
+
+    /// Returns the layout of the given name,
+    /// if it was compiled from the given YAML source.
+    pub fn get(&self, name: &str, source: &str)
+        -> Result<Option<parsing::Layout>, Error>
+    {
+        for idx in 0..self.count {
+            let entry = self.get_entry_offset(idx);
+            if self.strings.get(read_u32(self.data, entry)?)? != name {
+                continue;
+            }
+            if read_u64(self.data, entry + 4)? != hash_source(source) {
+                return Ok(None);
+            }
+            let offset = read_u32(self.data, entry + 12)? as usize;
+            let length = read_u32(self.data, entry + 16)? as usize;
+            let mut reader = Reader {
+                strings: self.strings,
+                data: self.data.get(offset..offset + length)
+                    .ok_or(Error::Corrupted)?,
+            };
+            return parsing::Layout::read(&mut reader).map(Some);
+        }
+        Ok(None)
+    }
+}
+
+/// Stores layouts, given with their names and their YAML sources
+pub fn compile<'a, I>(layouts: I) -> Vec<u8>
+    where I: IntoIterator<Item=(&'a str, &'a str, &'a parsing::Layout)>
+{
+    let mut writer = Writer::new();
+    // Name, source hash, and the range in writer.data
+    let mut entries = Vec::new();
+    for (name, source, layout) in layouts {
+        let name_id = writer.intern(name);
+        let start = writer.data.len();
+        layout.write(&mut writer);
+        entries.push((name_id, hash_source(source), start, writer.data.len()));
+    }
+
+    let Writer { data: records, strings, .. } = writer;
+    let mut data = Vec::new();
+    data.extend_from_slice(MAGIC);
+    data.extend_from_slice(&[VERSION, 0, 0, 0]);
+    push_u32(&mut data, strings.len() as u32);
+    push_u32(&mut data, entries.len() as u32);
+
+    let mut offset = HEADER_SIZE
+        + strings.len() * STRING_SIZE
+        + entries.len() * INDEX_SIZE;
+    for string in &strings {
+        push_u32(&mut data, offset as u32);
+        push_u32(&mut data, string.len() as u32);
+        offset += string.len();
+    }
+    for (name_id, hash, start, end) in entries {
+        push_u32(&mut data, name_id);
+        push_u64(&mut data, hash);
+        push_u32(&mut data, (offset + start) as u32);
+        push_u32(&mut data, (end - start) as u32);
+    }
+    for string in &strings {
+        data.extend_from_slice(string.as_bytes());
+    }
+    data.extend_from_slice(&records);
+    data
+}
+
+/// Counts anything worse than information
+struct CountProblems(u32);
+
+impl logging::Handler for CountProblems {
+    fn handle(&mut self, level: logging::Level, message: &str) {
+        use logging::Level::*;
+        match level {
+            Info | Debug => {},
+            _ => self.0 += 1,
+        }
+        logging::Print{}.handle(level, message)
+    }
+}
+
+/// Checks all builtin layouts for mistakes, and compiles them
+pub fn compile_builtin() -> Result<Vec<u8>, String> {
+    let keyboards = resources::get_keyboards();
+    let mut layouts = Vec::new();
+    for &(name, source) in keyboards {
+        let check = |layout: Result<parsing::Layout, _>| {
+            layout.map_err(|e| format!("Layout {}: {}", name, e))
+        };
+        let (built, problems) = check(parsing::Layout::from_resource(name))?
+            .build(CountProblems(0));
+        built.map_err(|e| format!("Layout {}: {}", name, e))?;
+        if problems.0 > 0 {
+            return Err(format!("Layout {} contains mistakes", name));
+        }
+        // Building consumed the first copy
+        let layout = check(parsing::Layout::from_resource(name))?;
+        layouts.push((name, source, layout));
+    }
+    Ok(compile(
+        layouts.iter().map(|&(name, source, ref layout)| (name, source, layout))
+    ))
+}
+
+fn open_builtin() -> Option<MappedFile> {
+    let paths = env::var_os("SQUEEKBOARD_LAYOUTSFILE")
+        .map(|path| vec![PathBuf::from(path)])
+        .unwrap_or_else(|| xdg::data_paths(FILE_NAME));
+    for path in paths {
+        if !path.exists() {
+            continue;
+        }
+        let file = MappedFile::open(&path)
+            .or_print(logging::Problem::Warning, "Can't open compiled layouts");
+        if let Some(file) = file {
+            let valid = Layouts::new(file.as_bytes())
+                .or_print(
+                    logging::Problem::Warning,
+                    &format!("Bad compiled layouts in {:?}", path),
+                )
+                .is_some();
+            if valid {
+                log_print!(
+                    logging::Level::Debug,
+                    "Using compiled layouts from {:?}", path,
+                );
+                return Some(file);
+            }
+        }
+    }
+    None
+}
+
+thread_local! {
+    /// Opened on first use, and kept mapped
+    static BUILTIN: Option<MappedFile> = open_builtin();
+}
+
+/// Returns the precompiled builtin layout,
+/// if it was compiled from the source the program contains.
+pub fn load_builtin(name: &str) -> Option<parsing::Layout> {
+    let source = resources::get_keyboard(name)?;
+    BUILTIN.with(|file| {
+        // Checked when opening
+        let layouts = Layouts::new(file.as_ref()?.as_bytes()).ok()?;
+        layouts.get(name, source)
+            .or_print(
+                logging::Problem::Warning,
+                &format!("Can't read compiled layout {}", name),
+            )
+            .and_then(|layout| layout)
+    })
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn roundtrip_values() {
+        let mut map = HashMap::new();
+        map.insert("b".to_string(), vec![Some(1.5), None]);
+        map.insert("a".to_string(), vec![]);
+
+        let mut writer = Writer::new();
+        map.write(&mut writer);
+        true.write(&mut writer);
+        "a".to_string().write(&mut writer);
+        // "a" got interned
+        assert_eq!(writer.strings, vec!["a".to_string(), "b".to_string()]);
+
+        let mut table = Vec::new();
+        let mut offset = HEADER_SIZE + STRING_SIZE * writer.strings.len();
+        for string in &writer.strings {
+            push_u32(&mut table, offset as u32);
+            push_u32(&mut table, string.len() as u32);
+            offset += string.len();
+        }
+        let mut file = vec![0; HEADER_SIZE];
+        file.extend(table);
+        file.extend(b"ab");
+
+        let mut reader = Reader {
+            strings: Strings { data: &file, count: 2 },
+            data: &writer.data,
+        };
+        assert_eq!(HashMap::read(&mut reader), Ok(map));
+        assert_eq!(bool::read(&mut reader), Ok(true));
+        assert_eq!(String::read(&mut reader), Ok("a".to_string()));
+        assert_eq!(reader.read_u8(), Err(Error::Corrupted));
+    }
+
+    #[test]
+    fn roundtrip_layout() {
+        let source = resources::get_keyboard("us").unwrap();
+        let layout = parsing::Layout::from_resource("us").unwrap();
+        let data = compile(vec![("us", source, &layout)]);
+        let layouts = Layouts::new(&data).unwrap();
+        assert_eq!(layouts.get("us", source), Ok(Some(layout)));
+        assert_eq!(layouts.get("de", source), Ok(None));
+        // Compiled from a different version
+        assert_eq!(layouts.get("us", "views: {}"), Ok(None));
+    }
+
+    #[test]
+    fn builtin_valid() {
+        let data = compile_builtin().unwrap();
+        let layouts = Layouts::new(&data).unwrap();
+        for &(name, source) in resources::get_keyboards() {
+            assert!(layouts.get(name, source).unwrap().is_some());
+        }
+    }
+
+    #[test]
+    fn reject_bad() {
+        assert_eq!(Layouts::new(b"SQLY").err(), Some(Error::BadMagic));
+        let mut data = compile(vec![]);
+        data[4] = 9;
+        assert_eq!(Layouts::new(&data).err(), Some(Error::UnsupportedVersion(9)));
+        data[4] = VERSION;
+        // Claims a string which isn't there
+        data[8] = 1;
+        assert_eq!(Layouts::new(&data).err(), Some(Error::Corrupted));
+    }
+
+    #[test]
+    fn reject_long_sequence() {
+        let mut writer = Writer::new();
+        writer.write_u32(1000);
+        writer.write_u8(0);
+        let data = compile(vec![]);
+        let mut reader = Reader {
+            strings: Layouts::new(&data).unwrap().strings,
+            data: &writer.data,
+        };
+        assert_eq!(Vec::<bool>::read(&mut reader), Err(Error::Corrupted));
+    }
+}
@@ -4,12 +4,14 @@
 
 /*! Loading layout files */
 
+use std::cell::RefCell;
 use std::env;
 use std::fmt;
 use std::path::PathBuf;
 use std::convert::TryFrom;
 
 use super::{ Error, LoadError };
+use super::compiled;
 use super::parsing;
 
 use ::layout::ArrangementKind;
@@ -26,6 +28,7 @@ use ::logging::Warn;
 pub mod c {
     use super::*;
     use std::os::raw::c_char;
+    use std::ptr;
 
     #[no_mangle]
     pub extern "C"
@@ -64,6 +67,33 @@ pub mod c {
         let layout = ::layout::Layout::new(layout, kind);
         Box::into_raw(Box::new(layout))
     }
+
+    /// Loads exactly the builtin layout of the name,
+    /// as listed in `resources`, without falling back to others.
+    /// Returns null on failure.
+    /// For benchmarks.
+    #[no_mangle]
+    pub extern "C"
+    fn squeek_load_builtin_layout(name: *const c_char)
+        -> *mut ::layout::Layout
+    {
+        let name = as_str(&name)
+            .expect("Bad layout name")
+            .expect("Empty layout name");
+        let kind = match name.ends_with("_wide") {
+            true => ArrangementKind::Wide,
+            false => ArrangementKind::Base,
+        };
+        load_layout_data(DataSource::Resource(name.into()))
+            .or_print(
+                logging::Problem::Warning,
+                &format!("Failed to load builtin layout {}", name),
+            )
+            .map(|layout| {
+                Box::into_raw(Box::new(::layout::Layout::new(layout, kind)))
+            })
+            .unwrap_or(ptr::null_mut())
+    }
 }
 
 const FALLBACK_LAYOUT_NAME: &str = "us";
@@ -236,6 +266,38 @@ fn iter_layout_sources(
     to_layout_sources(paths, layout_storage)
 }
 
+/// How many builtin layouts stay built after switching away from them
+const BUILT_MAX: usize = 8;
+
+thread_local! {
+    /// Builtin layouts already built, by name, the least recently used first.
+    /// Builtin layouts never change, and building one takes a while,
+    /// so switching back to one only copies it.
+    static BUILT: RefCell<Vec<(String, ::layout::LayoutData)>>
+        = RefCell::new(Vec::new());
+}
+
+fn get_built(name: &str) -> Option<::layout::LayoutData> {
+    BUILT.with(|built| {
+        let mut built = built.borrow_mut();
+        let idx = built.iter().position(|(n, _)| n == name)?;
+        let entry = built.remove(idx);
+        let data = entry.1.clone();
+        built.push(entry);
+        Some(data)
+    })
+}
+
+fn store_built(name: &str, data: &::layout::LayoutData) {
+    BUILT.with(|built| {
+        let mut built = built.borrow_mut();
+        if built.len() == BUILT_MAX {
+            built.remove(0);
+        }
+        built.push((name.into(), data.clone()));
+    })
+}
+
 fn load_layout_data(source: DataSource)
     -> Result<::layout::LayoutData, LoadError>
 {
@@ -249,10 +311,17 @@ fn load_layout_data(source: DataSource)
                 )
         },
         DataSource::Resource(name) => {
-            parsing::Layout::from_resource(&name)
+            if let Some(data) = get_built(&name) {
+                return Ok(data);
+            }
+            let data = compiled::load_builtin(&name)
+                .map(Ok)
+                .unwrap_or_else(|| parsing::Layout::from_resource(&name))
                 .and_then(|layout|
                     layout.build(handler).0.map_err(LoadError::BadKeyMap)
-                )
+                )?;
+            store_built(&name, &data);
+            Ok(data)
         },
     }
 }
@@ -312,6 +381,16 @@ mod tests {
         );
     }
     
+    #[test]
+    fn reuse_built() {
+        let source = DataSource::Resource(FALLBACK_LAYOUT_NAME.into());
+        let first = load_layout_data(source.clone()).unwrap();
+        assert!(get_built(FALLBACK_LAYOUT_NAME).is_some());
+        let second = load_layout_data(source).unwrap();
+        assert_eq!(second.keymaps, first.keymaps);
+        assert_eq!(second.views.len(), first.views.len());
+    }
+
     /// First fallback should be to builtin, not to FALLBACK_LAYOUT_NAME
     #[test]
     fn test_fallback_basic_builtin() {
@@ -4,6 +4,7 @@
 
 /*! Combined module for dealing with layout files */
 
+pub mod compiled;
 mod loading;
 pub mod parsing;
 
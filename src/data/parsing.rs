@@ -9,21 +9,22 @@ use std::collections::{ HashMap, HashSet };
 use std::ffi::CString;
 use std::fs;
 use std::path::PathBuf;
-use std::rc::Rc;
 use std::vec::Vec;
 
 use xkbcommon::xkb;
 
 use super::{ Error, LoadError };
+use super::compiled;
+use super::compiled::{ Compiled, Reader, Writer };
 
 use ::action;
+use ::action::ViewId;
 use ::keyboard::{
-    KeyState, PressType,
-    generate_keymaps, generate_keycodes, KeyCode, FormattingError
+    KeyState, KeyStateId, PressType, SymbolGroup,
+    KeycodeTable, KeyCode, FormattingError
 };
 use ::layout;
 use ::logging;
-use ::util::hash_map_map;
 use ::resources;
 
 // traits, derives
@@ -34,12 +35,48 @@ use ::logging::Warn;
 
 // TODO: find a nice way to make sure non-positive sizes don't break layouts
 
+/// How much more typing happens on the base view than on any other
+const BASE_VIEW_WEIGHT: f64 = 4.0;
+
+thread_local! {
+    /// Shared by all layouts built on the same thread
+    static KEYCODES: RefCell<KeycodeTable>
+        = RefCell::new(make_keycode_table());
+}
+
+/// Gives codes to the symbols of all builtin layouts up front.
+/// Otherwise, every layout loaded for the first time would add symbols
+/// to pages used by others, changing their keymaps,
+/// and leaving the old ones behind in the compiled keymap cache.
+/// Only layouts from elsewhere can still add symbols.
+fn make_keycode_table() -> KeycodeTable {
+    let mut table = KeycodeTable::new();
+    // Parsing the YAML of every layout would slow down the start,
+    // so without the compiled layouts, codes get assigned as needed.
+    for &(name, _source) in resources::get_keyboards() {
+        if let Some(layout) = compiled::load_builtin(name) {
+            let view_names = layout.get_view_names();
+            let actions = layout.get_button_actions(
+                &view_names,
+                &mut logging::Print {},
+            );
+            table.assign(&layout.get_symbol_groups(&view_names, &actions));
+        }
+    }
+    table
+}
+
 /// The root element describing an entire keyboard
 #[derive(Debug, Deserialize, PartialEq)]
 #[serde(deny_unknown_fields)]
 pub struct Layout {
     #[serde(default)]
     margins: Margins,
+    /// How far away from the nearest button a touch still activates it,
+    /// in the same units as outlines.
+    /// When missing, touches anywhere within the view count.
+    #[serde(default)]
+    touch_margin: Option<f64>,
     views: HashMap<String, Vec<ButtonIds>>,
     #[serde(default)] 
     buttons: HashMap<String, ButtonMeta>,
@@ -125,6 +162,142 @@ struct Outline {
     height: f64,
 }
 
+// Storage in compiled layouts. Fields are stored in the order of declaration.
+
+impl Compiled for Layout {
+    fn write(&self, writer: &mut Writer) {
+        self.margins.write(writer);
+        self.touch_margin.write(writer);
+        self.views.write(writer);
+        self.buttons.write(writer);
+        self.outlines.write(writer);
+    }
+    fn read(reader: &mut Reader) -> Result<Self, compiled::Error> {
+        Ok(Layout {
+            margins: Compiled::read(reader)?,
+            touch_margin: Compiled::read(reader)?,
+            views: Compiled::read(reader)?,
+            buttons: Compiled::read(reader)?,
+            outlines: Compiled::read(reader)?,
+        })
+    }
+}
+
+impl Compiled for Margins {
+    fn write(&self, writer: &mut Writer) {
+        self.top.write(writer);
+        self.bottom.write(writer);
+        self.side.write(writer);
+    }
+    fn read(reader: &mut Reader) -> Result<Self, compiled::Error> {
+        Ok(Margins {
+            top: Compiled::read(reader)?,
+            bottom: Compiled::read(reader)?,
+            side: Compiled::read(reader)?,
+        })
+    }
+}
+
+impl Compiled for ButtonMeta {
+    fn write(&self, writer: &mut Writer) {
+        self.action.write(writer);
+        self.keysym.write(writer);
+        self.text.write(writer);
+        self.modifier.write(writer);
+        self.label.write(writer);
+        self.icon.write(writer);
+        self.outline.write(writer);
+    }
+    fn read(reader: &mut Reader) -> Result<Self, compiled::Error> {
+        Ok(ButtonMeta {
+            action: Compiled::read(reader)?,
+            keysym: Compiled::read(reader)?,
+            text: Compiled::read(reader)?,
+            modifier: Compiled::read(reader)?,
+            label: Compiled::read(reader)?,
+            icon: Compiled::read(reader)?,
+            outline: Compiled::read(reader)?,
+        })
+    }
+}
+
+impl Compiled for Action {
+    fn write(&self, writer: &mut Writer) {
+        match self {
+            Action::Locking {
+                lock_view, unlock_view, pops, looks_locked_from,
+            } => {
+                writer.write_u8(0);
+                lock_view.write(writer);
+                unlock_view.write(writer);
+                pops.write(writer);
+                looks_locked_from.write(writer);
+            },
+            Action::SetView(view) => {
+                writer.write_u8(1);
+                view.write(writer);
+            },
+            Action::ShowPrefs => writer.write_u8(2),
+            Action::Erase => writer.write_u8(3),
+        }
+    }
+    fn read(reader: &mut Reader) -> Result<Self, compiled::Error> {
+        Ok(match reader.read_u8()? {
+            0 => Action::Locking {
+                lock_view: Compiled::read(reader)?,
+                unlock_view: Compiled::read(reader)?,
+                pops: Compiled::read(reader)?,
+                looks_locked_from: Compiled::read(reader)?,
+            },
+            1 => Action::SetView(Compiled::read(reader)?),
+            2 => Action::ShowPrefs,
+            3 => Action::Erase,
+            _ => return Err(compiled::Error::Corrupted),
+        })
+    }
+}
+
+impl Compiled for Modifier {
+    fn write(&self, writer: &mut Writer) {
+        writer.write_u8(match self {
+            Modifier::Control => 0,
+            Modifier::Shift => 1,
+            Modifier::Lock => 2,
+            Modifier::Alt => 3,
+            Modifier::Mod2 => 4,
+            Modifier::Mod3 => 5,
+            Modifier::Mod4 => 6,
+            Modifier::Mod5 => 7,
+        });
+    }
+    fn read(reader: &mut Reader) -> Result<Self, compiled::Error> {
+        Ok(match reader.read_u8()? {
+            0 => Modifier::Control,
+            1 => Modifier::Shift,
+            2 => Modifier::Lock,
+            3 => Modifier::Alt,
+            4 => Modifier::Mod2,
+            5 => Modifier::Mod3,
+            6 => Modifier::Mod4,
+            7 => Modifier::Mod5,
+            _ => return Err(compiled::Error::Corrupted),
+        })
+    }
+}
+
+impl Compiled for Outline {
+    fn write(&self, writer: &mut Writer) {
+        self.width.write(writer);
+        self.height.write(writer);
+    }
+    fn read(reader: &mut Reader) -> Result<Self, compiled::Error> {
+        Ok(Outline {
+            width: Compiled::read(reader)?,
+            height: Compiled::read(reader)?,
+        })
+    }
+}
+
 pub fn add_offsets<'a, I: 'a, T, F: 'a>(iterator: I, get_size: F)
     -> impl Iterator<Item=(f64, T)> + 'a
     where I: Iterator<Item=T>,
@@ -156,9 +329,19 @@ impl Layout {
         serde_yaml::from_reader(infile).map_err(Error::Yaml)
     }
 
-    pub fn build<H: logging::Handler>(self, mut warning_handler: H)
-        -> (Result<::layout::LayoutData, FormattingError>, H)
-    {
+    /// Sorting makes view IDs independent of the hash map.
+    fn get_view_names(&self) -> Vec<&String> {
+        let mut view_names: Vec<&String> = self.views.keys().collect();
+        view_names.sort();
+        view_names
+    }
+
+    /// Actions of all buttons placed in views
+    fn get_button_actions<H: logging::Handler>(
+        &self,
+        view_names: &[&String],
+        warning_handler: &mut H,
+    ) -> Vec<(&str, ::action::Action)> {
         let button_names = self.views.values()
             .flat_map(|rows| {
                 rows.iter()
@@ -168,23 +351,62 @@ impl Layout {
         let button_names: HashSet<&str>
             = HashSet::from_iter(button_names);
 
-        let button_actions: Vec<(&str, ::action::Action)>
-            = button_names.iter().map(|name| {(
-                *name,
-                create_action(
-                    &self.buttons,
-                    name,
-                    self.views.keys().collect(),
-                    &mut warning_handler,
-                )
-            )}).collect();
+        let view_ids: HashMap<&str, ViewId> = view_names.iter()
+            .enumerate()
+            .map(|(index, name)| (name.as_str(), ViewId(index)))
+            .collect();
 
-        let symbolmap: HashMap<String, KeyCode> = generate_keycodes(
-            extract_symbol_names(&button_actions)
-        );
+        button_names.iter().map(|name| {(
+            *name,
+            create_action(
+                &self.buttons,
+                name,
+                &view_ids,
+                warning_handler,
+            )
+        )}).collect()
+    }
+
+    /// Symbols of each view, to be placed on keymaps together
+    fn get_symbol_groups(
+        &self,
+        view_names: &[&String],
+        button_actions: &[(&str, ::action::Action)],
+    ) -> Vec<SymbolGroup> {
+        let actions: HashMap<&str, &::action::Action>
+            = button_actions.iter()
+                .map(|(name, action)| (*name, action))
+                .collect();
+        view_names.iter().map(|name| SymbolGroup {
+            symbols: extract_symbol_names(
+                self.views[*name].iter()
+                    .flat_map(|row| row.split_ascii_whitespace())
+                    .map(|button| actions[button])
+            ).collect(),
+            weight: match name.as_str() {
+                "base" => BASE_VIEW_WEIGHT,
+                _ => 1.0,
+            },
+        }).collect()
+    }
+
+    pub fn build<H: logging::Handler>(self, mut warning_handler: H)
+        -> (Result<::layout::LayoutData, FormattingError>, H)
+    {
+        let view_names = self.get_view_names();
+        let button_actions
+            = self.get_button_actions(&view_names, &mut warning_handler);
+        let symbol_groups
+            = self.get_symbol_groups(&view_names, &button_actions);
+        let (symbolmap, keymaps): (HashMap<String, KeyCode>, _)
+            = KEYCODES.with(|table| {
+                let mut table = table.borrow_mut();
+                let (symbolmap, pages) = table.assign(&symbol_groups);
+                (symbolmap, table.generate_keymaps(&pages))
+            });
 
-        let button_states = HashMap::<String, KeyState>::from_iter(
-            button_actions.into_iter().map(|(name, action)| {
+        let (key_ids, keys): (HashMap<&str, KeyStateId>, Vec<KeyState>)
+            = button_actions.into_iter().enumerate().map(|(index, (name, action))| {
                 let keycodes = match &action {
                     ::action::Action::Submit { text: _, keys } => {
                         keys.iter().map(|named_keysym| {
@@ -207,41 +429,31 @@ impl Layout {
                     _ => Vec::new(),
                 };
                 (
-                    name.into(),
+                    (name, KeyStateId(index)),
                     KeyState {
                         pressed: PressType::Released,
                         keycodes,
                         action,
                     }
                 )
-            })
-        );
+            }).unzip();
 
-        let keymaps = match generate_keymaps(symbolmap) {
+        let keymaps = match keymaps {
             Err(e) => { return (Err(e), warning_handler) },
             Ok(v) => v,
         };
 
-        let button_states_cache = hash_map_map(
-            button_states,
-            |name, state| {(
-                name,
-                Rc::new(RefCell::new(state))
-            )}
-        );
-
-        let views: Vec<_> = self.views.iter()
-            .map(|(name, view)| {
-                let rows = view.iter().map(|row| {
+        let views: Vec<_> = view_names.iter()
+            .map(|name| {
+                let rows = self.views[*name].iter().map(|row| {
                     let buttons = row.split_ascii_whitespace()
                         .map(|name| {
                             Box::new(create_button(
                                 &self.buttons,
                                 &self.outlines,
                                 name,
-                                button_states_cache.get(name.into())
-                                    .expect("Button state not created")
-                                    .clone(),
+                                *key_ids.get(name)
+                                    .expect("Button state not created"),
                                 &mut warning_handler,
                             ))
                         });
@@ -255,7 +467,7 @@ impl Layout {
                 let rows = add_offsets(rows, |row| row.get_size().height)
                     .collect();
                 (
-                    name.clone(),
+                    (*name).clone(),
                     layout::View::new(rows)
                 )
             }).collect();
@@ -266,7 +478,7 @@ impl Layout {
                 views.iter().map(|(_name, view)| view).collect()
             );
 
-            HashMap::from_iter(views.into_iter().map(|(name, view)| (
+            views.into_iter().map(|(name, view)| (
                 name,
                 (
                     layout::c::Point {
@@ -275,12 +487,13 @@ impl Layout {
                     },
                     view,
                 ),
-            )))
+            )).collect()
         };
 
         (
             Ok(::layout::LayoutData {
                 views: views,
+                keys: keys,
                 keymaps: keymaps.into_iter().map(|keymap_str|
                     CString::new(keymap_str)
                         .expect("Invalid keymap string generated")
@@ -292,6 +505,8 @@ impl Layout {
                     bottom: self.margins.bottom,
                     right: self.margins.side,
                 },
+                touch_margin: self.touch_margin
+                    .unwrap_or(std::f64::INFINITY),
             }),
             warning_handler,
         )
@@ -301,7 +516,7 @@ impl Layout {
 fn create_action<H: logging::Handler>(
     button_info: &HashMap<String, ButtonMeta>,
     name: &str,
-    view_names: Vec<&String>,
+    view_ids: &HashMap<&str, ViewId>,
     warning_handler: &mut H,
 ) -> ::action::Action {
     let default_meta = ButtonMeta::default();
@@ -346,21 +561,22 @@ fn create_action<H: logging::Handler>(
 
     fn filter_view_name<H: logging::Handler>(
         button_name: &str,
-        view_name: String,
-        view_names: &Vec<&String>,
+        view_name: &str,
+        view_ids: &HashMap<&str, ViewId>,
         warning_handler: &mut H,
-    ) -> String {
-        if view_names.contains(&&view_name) {
-            view_name
-        } else {
-            warning_handler.handle(
-                logging::Level::Warning,
-                &format!("Button {} switches to missing view {}",
-                    button_name,
-                    view_name,
-                ),
-            );
-            "base".into()
+    ) -> ViewId {
+        match view_ids.get(view_name) {
+            Some(id) => *id,
+            None => {
+                warning_handler.handle(
+                    logging::Level::Warning,
+                    &format!("Button {} switches to missing view {}",
+                        button_name,
+                        view_name,
+                    ),
+                );
+                view_ids.get("base").cloned().unwrap_or(ViewId(0))
+            },
         }
     }
 
@@ -369,7 +585,7 @@ fn create_action<H: logging::Handler>(
             Action::SetView(view_name)
         ) => ::action::Action::SetView(
             filter_view_name(
-                name, view_name.clone(), &view_names,
+                name, &view_name, view_ids,
                 warning_handler,
             )
         ),
@@ -380,18 +596,22 @@ fn create_action<H: logging::Handler>(
         }) => ::action::Action::LockView {
             lock: filter_view_name(
                 name,
-                lock_view.clone(),
-                &view_names,
+                &lock_view,
+                view_ids,
                 warning_handler,
             ),
             unlock: filter_view_name(
                 name,
-                unlock_view.clone(),
-                &view_names,
+                &unlock_view,
+                view_ids,
                 warning_handler,
             ),
             latches: pops.unwrap_or(true),
-            looks_locked_from,
+            // Missing views never get locked, so they can be skipped.
+            looks_locked_from: looks_locked_from.iter()
+                .filter_map(|view_name| view_ids.get(view_name.as_str()))
+                .cloned()
+                .collect(),
         },
         SubmitData::Action(
             Action::ShowPrefs
@@ -461,7 +681,7 @@ fn create_button<H: logging::Handler>(
     button_info: &HashMap<String, ButtonMeta>,
     outlines: &HashMap<String, Outline>,
     name: &str,
-    state: Rc<RefCell<KeyState>>,
+    key: KeyStateId,
     warning_handler: &mut H,
 ) -> ::layout::Button {
     let cname = CString::new(name.clone())
@@ -523,15 +743,15 @@ fn create_button<H: logging::Handler>(
             height: outline.height,
         },
         label: label,
-        state: state,
+        key: key,
     }
 }
 
-fn extract_symbol_names<'a>(actions: &'a [(&str, action::Action)])
-    -> impl Iterator<Item=String> + 'a
+fn extract_symbol_names<'a, I>(actions: I) -> impl Iterator<Item=String> + 'a
+    where I: IntoIterator<Item=&'a action::Action>, I::IntoIter: 'a
 {
-    actions.iter()
-        .filter_map(|(_name, act)| {
+    actions.into_iter()
+        .filter_map(|act| {
             match act {
                 action::Action::Submit {
                     text: _, keys,
@@ -553,6 +773,15 @@ mod tests {
     
     use ::logging::ProblemPanic;
 
+    fn get_view<'a>(data: &'a ::layout::LayoutData, name: &str)
+        -> &'a ::layout::View
+    {
+        &data.views.iter()
+            .find(|(view_name, _)| view_name == name)
+            .expect("No such view")
+            .1 .1
+    }
+
     fn path_from_root(file: &'static str) -> PathBuf {
         let source_dir = env::var("SOURCE_DIR")
             .map(PathBuf::from)
@@ -576,6 +805,7 @@ mod tests {
             Layout::from_file(path_from_root("tests/layout.yaml")).unwrap(),
             Layout {
                 margins: Margins { top: 0f64, bottom: 0f64, side: 0f64 },
+                touch_margin: None,
                 views: hashmap!(
                     "base".into() => vec!("test".into()),
                 ),
@@ -643,7 +873,7 @@ mod tests {
             .build(ProblemPanic).0
             .unwrap();
         assert_eq!(
-            out.views["base"].1
+            get_view(&out, "base")
                 .get_rows()[0].1
                 .get_buttons()[0].1
                 .label,
@@ -658,7 +888,7 @@ mod tests {
             .build(ProblemPanic).0
             .unwrap();
         assert_eq!(
-            out.views["base"].1
+            get_view(&out, "base")
                 .get_rows()[0].1
                 .get_buttons()[0].1
                 .label,
@@ -673,14 +903,10 @@ mod tests {
             .unwrap()
             .build(ProblemPanic).0
             .unwrap();
-        assert_eq!(
-            out.views["base"].1
-                .get_rows()[0].1
-                .get_buttons()[0].1
-                .state.borrow()
-                .keycodes.len(),
-            2
-        );
+        let button = &get_view(&out, "base")
+            .get_rows()[0].1
+            .get_buttons()[0].1;
+        assert_eq!(out.keys[button.key.0].keycodes.len(), 2);
     }
 
     /// Test if erase yields a useable keycode
@@ -690,14 +916,10 @@ mod tests {
             .unwrap()
             .build(ProblemPanic).0
             .unwrap();
-        assert_eq!(
-            out.views["base"].1
-                .get_rows()[0].1
-                .get_buttons()[0].1
-                .state.borrow()
-                .keycodes.len(),
-            1
-        );
+        let button = &get_view(&out, "base")
+            .get_rows()[0].1
+            .get_buttons()[0].1;
+        assert_eq!(out.keys[button.key.0].keycodes.len(), 1);
     }
 
     #[test]
@@ -726,7 +948,7 @@ mod tests {
                     }
                 },
                 ".",
-                Vec::new(),
+                &HashMap::new(),
                 &mut ProblemPanic,
             ),
             ::action::Action::Submit {
@@ -766,7 +988,9 @@ mod tests {
             },
         )];
         assert_eq!(
-            extract_symbol_names(&actions[..]).collect::<Vec<_>>(),
+            extract_symbol_names(
+                actions.iter().map(|(_name, action)| action)
+            ).collect::<Vec<_>>(),
             vec!["a", "c"],
         );
     }
@@ -778,7 +1002,9 @@ mod tests {
             action::Action::Erase,
         )];
         assert_eq!(
-            extract_symbol_names(&actions[..]).collect::<Vec<_>>(),
+            extract_symbol_names(
+                actions.iter().map(|(_name, action)| action)
+            ).collect::<Vec<_>>(),
             vec!["BackSpace"],
         );
     }
@@ -1,18 +1,19 @@
 /*! Drawing the UI */
 
 use cairo;
-use std::cell::RefCell;
 
-use ::action::{ Action, Modifier };
+use ::action::{ Action, Modifier, ViewId };
 use ::keyboard;
-use ::layout::{ Button, Label, LatchedState, Layout };
+use ::layout::{ ButtonTable, Label, LatchedState, Layout, ViewSpan };
 use ::layout::c::{ Bounds, EekGtkKeyboard, Point };
+use ::logging;
 use ::submission::Submission;
 
 use glib::translate::FromGlibPtrNone;
 use gtk::WidgetExt;
 
-use std::collections::HashSet;
+use std::cmp;
+use std::collections::{ HashMap, HashSet };
 use std::ffi::CStr;
 use std::ptr;
 
@@ -29,109 +30,178 @@ mod c {
     pub struct EekRenderer(*const c_void);
 
     // This is constructed only in C, no need for warnings
-    /// Just don't clone this for no reason.
+    /// Resolved style of a button in a given state.
+    /// Owned by the renderer.
     #[allow(dead_code)]
     #[repr(transparent)]
     #[derive(Clone, Copy)]
-    pub struct GtkStyleContext(*const c_void);
+    pub struct ButtonStyle(*const c_void);
 
 
     extern "C" {
-        #[allow(improper_ctypes)]
-        pub fn eek_renderer_get_scale_factor(
-            renderer: EekRenderer,
-        ) -> u32;
-
         #[allow(improper_ctypes)]
         pub fn eek_render_button_in_context(
-            scale_factor: u32,
+            renderer: EekRenderer,
             cr: *mut cairo_sys::cairo_t,
-            ctx: GtkStyleContext,
+            style: ButtonStyle,
             bounds: Bounds,
             icon_name: *const c_char,
             label: *const c_char,
         );
 
         #[allow(improper_ctypes)]
-        pub fn eek_get_style_context_for_button(
+        pub fn eek_get_style_for_button(
             renderer: EekRenderer,
             name: *const c_char,
             outline_name: *const c_char,
             locked_class: *const c_char,
             pressed: u64,
-        ) -> GtkStyleContext;
+        ) -> ButtonStyle;
+    }
 
-        #[allow(improper_ctypes)]
-        pub fn eek_put_style_context_for_button(
-            ctx: GtkStyleContext,
-            outline_name: *const c_char,
-            locked_class: *const c_char,
-        );
+    /// Prepares room for all buttons of the layout, without drawing any.
+    /// `scale` is the number of device pixels per layout unit.
+    /// Returns null if the atlas can't be created.
+    #[no_mangle]
+    pub extern "C"
+    fn squeek_atlas_new(
+        layout: *const Layout,
+        scale: f64,
+    ) -> *mut Atlas {
+        let layout = unsafe { &*layout };
+        match Atlas::new(layout, scale) {
+            Ok(atlas) => Box::into_raw(Box::new(atlas)),
+            Err(e) => {
+                log_print!(
+                    logging::Level::Warning,
+                    "Can't create the button atlas: {:?}",
+                    e,
+                );
+                ptr::null_mut()
+            },
+        }
     }
 
-    /// Draws all buttons that are not in the base state
+    #[no_mangle]
+    pub extern "C"
+    fn squeek_atlas_free(atlas: *mut Atlas) {
+        unsafe { Box::from_raw(atlas) };
+    }
+
+    /// Rasterizes the buttons of the view which aren't in the atlas yet.
+    /// Returns whether there were any.
+    #[no_mangle]
+    pub extern "C"
+    fn squeek_atlas_render_view(
+        atlas: *mut Atlas,
+        layout: *const Layout,
+        view: *const ViewSpan,
+        renderer: EekRenderer,
+    ) -> u32 {
+        let atlas = unsafe { &mut *atlas };
+        let layout = unsafe { &*layout };
+        let view = unsafe { &*view };
+        if !layout.has_view(view) {
+            log_print!(
+                logging::Level::Bug,
+                "View doesn't belong to the layout",
+            );
+            return 0;
+        }
+        atlas.render_view(layout, view, renderer) as u32
+    }
+
+    /// Draws all buttons that are not in the base state.
+    /// The atlas is optional.
+    /// Without a submission, no modifiers are considered active.
     #[no_mangle]
     pub extern "C"
     fn squeek_layout_draw_all_changed(
         layout: *mut Layout,
         renderer: EekRenderer,
+        atlas: *const Atlas,
         cr: *mut cairo_sys::cairo_t,
         submission: *const Submission,
     ) {
         let layout = unsafe { &mut *layout };
-        let submission = unsafe { &*submission };
+        let atlas = unsafe { atlas.as_ref() };
+        let submission = unsafe { submission.as_ref() };
         let cr = unsafe { cairo::Context::from_raw_none(cr) };
-        let active_modifiers = submission.get_active_modifiers();
+        let active_modifiers = submission
+            .map(|submission| submission.get_active_modifiers())
+            .unwrap_or_else(HashSet::new);
+        // The clip covers only the damaged area when a partial redraw
+        // was queued, so buttons outside it can be skipped.
+        let (x1, y1, x2, y2) = cr.clip_extents();
+        let damaged = Bounds { x: x1, y: y1, width: x2 - x1, height: y2 - y1 };
 
-        layout.foreach_visible_button(|offset, button| {
-            let state = RefCell::borrow(&button.state).clone();
+        for button in layout.get_current_view().buttons.clone() {
+            let bounds = layout.buttons.get_bounds(button);
+            if !damaged.intersects(&bounds) {
+                continue;
+            }
+            let state = layout.get_button_key(button);
 
             let locked = LockedStyle::from_action(
                 &state.action,
                 &active_modifiers,
                 layout.get_view_latched(),
-                &layout.current_view,
+                layout.current_view,
             );
             if state.pressed == keyboard::PressType::Pressed
                 || locked != LockedStyle::Free
             {
-                render_button_at_position(
-                    renderer, &cr,
-                    offset,
-                    button.as_ref(),
+                paint_button_at_position(
+                    renderer, atlas, &cr,
+                    Point { x: bounds.x, y: bounds.y },
+                    &layout.buttons, button,
                     state.pressed, locked,
                 );
             }
-        })
+        }
     }
     
+    /// Draws all buttons of the view released.
+    /// The view doesn't have to be the current one.
+    /// The atlas is optional.
     #[no_mangle]
     pub extern "C"
     fn squeek_draw_layout_base_view(
         layout: *mut Layout,
+        view: *const ViewSpan,
         renderer: EekRenderer,
+        atlas: *const Atlas,
         cr: *mut cairo_sys::cairo_t,
     ) {
         let layout = unsafe { &mut *layout };
+        let view = unsafe { &*view };
+        let atlas = unsafe { atlas.as_ref() };
         let cr = unsafe { cairo::Context::from_raw_none(cr) };
-        
-        layout.foreach_visible_button(|offset, button| {
-            render_button_at_position(
-                renderer, &cr,
-                offset,
-                button.as_ref(),
+
+        if !layout.has_view(view) {
+            log_print!(
+                logging::Level::Bug,
+                "View doesn't belong to the layout",
+            );
+            return;
+        }
+        for button in view.buttons.clone() {
+            paint_button_at_position(
+                renderer, atlas, &cr,
+                layout.buttons.positions[button].clone(),
+                &layout.buttons, button,
                 keyboard::PressType::Released,
                 LockedStyle::Free,
             );
-        })
+        }
     }
 }
 
 #[derive(Clone, Copy, PartialEq, Debug)]
 enum LockedStyle {
-    Free,
-    Latched,
-    Locked,
+    Free = 0,
+    Latched = 1,
+    Locked = 2,
 }
 
 impl LockedStyle {
@@ -139,7 +209,7 @@ impl LockedStyle {
         action: &Action,
         mods: &HashSet<Modifier>,
         latched_view: &LatchedState,
-        current_view: &str,
+        current_view: ViewId,
     ) -> LockedStyle {
         let active_mod = match action {
             Action::ApplyModifier(m) => mods.contains(m),
@@ -149,7 +219,7 @@ impl LockedStyle {
         let active_view = action.is_active(current_view);
         let latched_button = match latched_view {
             LatchedState::Not => false,
-            LatchedState::FromView(view) => !action.has_locked_appearance_from(view),
+            LatchedState::FromView(view) => !action.has_locked_appearance_from(*view),
         };
         match (active_mod, active_view, latched_button) {
             // Modifiers don't latch.
@@ -161,28 +231,283 @@ impl LockedStyle {
     }
 }
 
+/// Locked styles which the button can ever get drawn in.
+fn get_possible_locked_styles(action: &Action) -> &'static [LockedStyle] {
+    match action {
+        // Modifiers don't latch.
+        Action::ApplyModifier(_) => &[LockedStyle::Free, LockedStyle::Locked],
+        Action::SetView(_) | Action::LockView { .. } => &[
+            LockedStyle::Free,
+            LockedStyle::Latched,
+            LockedStyle::Locked,
+        ],
+        _ => &[LockedStyle::Free],
+    }
+}
+
+const STATE_COUNT: usize = 6;
+
+fn get_state_index(pressed: keyboard::PressType, locked: LockedStyle)
+    -> usize
+{
+    pressed as usize * 3 + locked as usize
+}
+
+/// Everything apart from the state that makes buttons look different.
+/// Strings are identified by their index in the `ButtonTable` pools.
+#[derive(PartialEq, Eq, Hash)]
+struct Appearance {
+    name: usize,
+    label: usize,
+    outline_name: usize,
+    width: u64,
+    height: u64,
+}
+
+/// Rectangle in device pixels
+#[derive(Clone, Copy)]
+struct Cell {
+    x: i32,
+    y: i32,
+    width: i32,
+    height: i32,
+}
+
+/// All buttons of a layout, rasterized once in every state they can take,
+/// and packed into a single surface.
+/// Buttons which look the same share cells.
+/// Cells get rasterized a view at a time,
+/// so that no single frame pays for the whole layout.
+/// Valid only for the layout and the scale it was created with.
+pub struct Atlas {
+    surface: cairo::ImageSurface,
+    /// Device pixels per layout unit
+    scale: f64,
+    /// Indices into `cells`, indexed by button,
+    /// and then by `get_state_index`
+    buttons: Vec<[Option<usize>; STATE_COUNT]>,
+    cells: Vec<Cell>,
+    /// Which button to render into each cell, and how
+    contents: Vec<(usize, keyboard::PressType, LockedStyle)>,
+    /// Whether each cell holds its button yet
+    rendered: Vec<bool>,
+}
+
+impl Atlas {
+    /// Transparent pixels between cells,
+    /// so that filtering doesn't pick up the neighbours.
+    const PADDING: i32 = 1;
+
+    fn new(layout: &Layout, scale: f64) -> Result<Atlas, cairo::Status> {
+        let table = &layout.buttons;
+        let mut appearances = HashMap::new();
+        // Which button to render into each cell, and how
+        let mut contents: Vec<(usize, keyboard::PressType, LockedStyle)>
+            = Vec::new();
+        let mut cells = Vec::new();
+        let mut buttons = Vec::with_capacity(table.len());
+
+        for button in 0..table.len() {
+            let size = &table.sizes[button];
+            let appearance = Appearance {
+                name: table.name_ids[button],
+                label: table.label_ids[button],
+                outline_name: table.outline_ids[button],
+                width: size.width.to_bits(),
+                height: size.height.to_bits(),
+            };
+            let action = &layout.get_button_key(button).action;
+            let states = appearances.entry(appearance).or_insert_with(|| {
+                let mut states = [None; STATE_COUNT];
+                let pressed_types = [
+                    keyboard::PressType::Released,
+                    keyboard::PressType::Pressed,
+                ];
+                for pressed in pressed_types.iter() {
+                    for locked in get_possible_locked_styles(action) {
+                        states[get_state_index(*pressed, *locked)]
+                            = Some(cells.len());
+                        contents.push((button, *pressed, *locked));
+                        cells.push(Cell {
+                            x: 0,
+                            y: 0,
+                            width: (size.width * scale).ceil() as i32,
+                            height: (size.height * scale).ceil() as i32,
+                        });
+                    }
+                }
+                states
+            });
+            buttons.push(*states);
+        }
+
+        let (width, height) = Atlas::pack(&mut cells);
+        let surface = cairo::ImageSurface::create(
+            cairo::Format::ARgb32,
+            cmp::max(width, 1),
+            cmp::max(height, 1),
+        )?;
+        let rendered = vec![false; cells.len()];
+        Ok(Atlas { surface, scale, buttons, cells, contents, rendered })
+    }
+
+    /// Rasterizes the cells used by buttons of the view.
+    /// Returns whether any were missing.
+    fn render_view(
+        &mut self,
+        layout: &Layout,
+        view: &ViewSpan,
+        renderer: c::EekRenderer,
+    ) -> bool {
+        let missing: Vec<usize> = view.buttons.clone()
+            .filter_map(|button| self.buttons.get(button))
+            .flat_map(|states| states.iter().filter_map(|cell| *cell))
+            .filter(|cell| !self.rendered[*cell])
+            .collect();
+        if missing.is_empty() {
+            return false;
+        }
+        {
+            let cr = cairo::Context::new(&self.surface);
+            for index in missing {
+                if self.rendered[index] {
+                    // Shared by buttons looking the same
+                    continue;
+                }
+                let cell = self.cells[index];
+                let (button, pressed, locked) = self.contents[index];
+                cr.save();
+                cr.translate(cell.x as f64, cell.y as f64);
+                cr.scale(self.scale, self.scale);
+                render_button_at_position(
+                    renderer, &cr,
+                    Point { x: 0.0, y: 0.0 },
+                    &layout.buttons, button,
+                    pressed, locked,
+                );
+                cr.restore();
+                self.rendered[index] = true;
+            }
+        }
+        self.surface.flush();
+        true
+    }
+
+    /// Places cells in shelves of roughly equal heights.
+    /// Returns the size of the needed surface.
+    fn pack(cells: &mut Vec<Cell>) -> (i32, i32) {
+        let padded = |size: i32| size + Atlas::PADDING;
+        let area: f64 = cells.iter()
+            .map(|c| padded(c.width) as f64 * padded(c.height) as f64)
+            .sum();
+        let widest = cells.iter().map(|c| padded(c.width)).max().unwrap_or(0);
+        let width = cmp::max(area.sqrt().ceil() as i32, widest);
+
+        let mut order: Vec<usize> = (0..cells.len()).collect();
+        order.sort_by_key(|i| cmp::Reverse(cells[*i].height));
+
+        let (mut x, mut y, mut shelf_height) = (0, 0, 0);
+        for i in order {
+            let cell = &mut cells[i];
+            if x + padded(cell.width) > width {
+                x = 0;
+                y += shelf_height;
+                shelf_height = 0;
+            }
+            cell.x = x;
+            cell.y = y;
+            x += padded(cell.width);
+            shelf_height = cmp::max(shelf_height, padded(cell.height));
+        }
+        (width, y + shelf_height)
+    }
+
+    /// Paints the button in the given state, if present in the atlas.
+    /// Returns whether it was painted.
+    /// The position gets rounded to whole device pixels,
+    /// so that the pixels get copied without resampling.
+    fn paint_button(
+        &self,
+        cr: &cairo::Context,
+        position: Point,
+        button: usize,
+        pressed: keyboard::PressType,
+        locked: LockedStyle,
+    ) -> bool {
+        let cell = self.buttons.get(button)
+            .and_then(|states| states[get_state_index(pressed, locked)])
+            .filter(|index| self.rendered[*index])
+            .map(|index| self.cells[index]);
+        match cell {
+            Some(cell) => {
+                // The layout origin is snapped to a device pixel,
+                // so whole pixels from it are whole pixels on the surface.
+                let snap = |offset: f64| (offset * self.scale).round() / self.scale;
+                cr.save();
+                cr.translate(snap(position.x), snap(position.y));
+                cr.scale(1.0 / self.scale, 1.0 / self.scale);
+                cr.set_source_surface(
+                    &self.surface,
+                    -cell.x as f64, -cell.y as f64,
+                );
+                cr.rectangle(0.0, 0.0, cell.width as f64, cell.height as f64);
+                cr.fill();
+                cr.restore();
+                true
+            },
+            None => false,
+        }
+    }
+}
+
+/// Uses the atlas if there is one, and falls back to rendering from scratch.
+fn paint_button_at_position(
+    renderer: c::EekRenderer,
+    atlas: Option<&Atlas>,
+    cr: &cairo::Context,
+    position: Point,
+    buttons: &ButtonTable,
+    button: usize,
+    pressed: keyboard::PressType,
+    locked: LockedStyle,
+) {
+    let painted = atlas
+        .map(|atlas| atlas.paint_button(cr, position.clone(), button, pressed, locked))
+        .unwrap_or(false);
+    if !painted {
+        render_button_at_position(
+            renderer, cr,
+            position,
+            buttons, button,
+            pressed, locked,
+        );
+    }
+}
+
 /// Renders a button at a position (button's own bounds ignored)
 fn render_button_at_position(
     renderer: c::EekRenderer,
     cr: &cairo::Context,
     position: Point,
-    button: &Button,
+    buttons: &ButtonTable,
+    button: usize,
     pressed: keyboard::PressType,
     locked: LockedStyle,
 ) {
+    let size = &buttons.sizes[button];
     cr.save();
     cr.translate(position.x, position.y);
     cr.rectangle(
         0.0, 0.0,
-        button.size.width, button.size.height
+        size.width, size.height
     );
     cr.clip();
 
-    let scale_factor = unsafe {
-        c::eek_renderer_get_scale_factor(renderer)
+    let bounds = Bounds {
+        x: 0.0, y: 0.0,
+        width: size.width, height: size.height,
     };
-    let bounds = button.get_bounds();
-    let (label_c, icon_name_c) = match &button.label {
+    let (label_c, icon_name_c) = match buttons.get_label(button) {
         Label::Text(text) => (text.as_ptr(), ptr::null()),
         Label::IconName(name) => {
             let l = unsafe {
@@ -194,36 +519,31 @@ fn render_button_at_position(
         },
     };
 
-    with_button_context(
-        renderer,
-        button,
-        pressed,
-        locked,
-        |ctx| unsafe {
-            // TODO: split into separate procedures:
-            // draw outline, draw label, draw icon.
-            c::eek_render_button_in_context(
-                scale_factor,
-                cairo::Context::to_raw_none(&cr),
-                *ctx,
-                bounds,
-                icon_name_c,
-                label_c,
-            )
-        }
-    );
+    let style = get_button_style(renderer, buttons, button, pressed, locked);
+    unsafe {
+        // TODO: split into separate procedures:
+        // draw outline, draw label, draw icon.
+        c::eek_render_button_in_context(
+            renderer,
+            cairo::Context::to_raw_none(&cr),
+            style,
+            bounds,
+            icon_name_c,
+            label_c,
+        )
+    };
 
     cr.restore();
 }
 
-fn with_button_context<R, F: FnOnce(&c::GtkStyleContext) -> R>(
+fn get_button_style(
     renderer: c::EekRenderer,
-    button: &Button,
+    buttons: &ButtonTable,
+    button: usize,
     pressed: keyboard::PressType,
     locked: LockedStyle,
-    operation: F,
-) -> R {
-    let outline_name_c = button.outline_name.as_ptr();
+) -> c::ButtonStyle {
+    let outline_name_c = buttons.get_outline_name(button).as_ptr();
     let locked_class_c = match locked {
         LockedStyle::Free => ptr::null(),
         LockedStyle::Locked => unsafe {
@@ -234,27 +554,15 @@ fn with_button_context<R, F: FnOnce(&c::GtkStyleContext) -> R>(
         },
     };
     
-    let ctx = unsafe {
-        c::eek_get_style_context_for_button(
+    unsafe {
+        c::eek_get_style_for_button(
             renderer,
-            button.name.as_ptr(),
+            buttons.get_name(button).as_ptr(),
             outline_name_c,
             locked_class_c,
             pressed as u64,
         )
-    };
-    
-    let r = operation(&ctx);
-
-    unsafe {
-        c::eek_put_style_context_for_button(
-            ctx,
-            outline_name_c,
-            locked_class_c,
-        )
-    };
-
-    r
+    }
 }
 
 pub fn queue_redraw(keyboard: EekGtkKeyboard) {
@@ -262,23 +570,40 @@ pub fn queue_redraw(keyboard: EekGtkKeyboard) {
     widget.queue_draw();
 }
 
+/// Queues redrawing of the area given in widget coordinates.
+pub fn queue_redraw_area(keyboard: EekGtkKeyboard, area: Bounds) {
+    let widget = unsafe { gtk::Widget::from_glib_none(keyboard.0) };
+    // Round outwards, so that partially covered pixels get redrawn too
+    let x = area.x.floor();
+    let y = area.y.floor();
+    widget.queue_draw_area(
+        x as i32,
+        y as i32,
+        ((area.x + area.width).ceil() - x) as i32,
+        ((area.y + area.height).ceil() - y) as i32,
+    );
+}
+
 #[cfg(test)]
 mod test {
     use super::*;
 
     #[test]
     fn test_exit_only() {
+        let a = ViewId(0);
+        let ab = ViewId(1);
+        let b = ViewId(2);
         assert_eq!(
             LockedStyle::from_action(
                 &Action::LockView {
-                    lock: "ab".into(), 
-                    unlock: "a".into(),
+                    lock: ab,
+                    unlock: a,
                     latches: true,
-                    looks_locked_from: vec!["b".into()],
+                    looks_locked_from: vec![b],
                 },
                 &HashSet::new(),
-                &LatchedState::FromView("b".into()),
-                "ab",
+                &LatchedState::FromView(b),
+                ab,
             ),
             LockedStyle::Locked,
         );
@@ -4,12 +4,19 @@
  */
 
 use std::boxed::Box;
+use std::env;
 use std::ffi::CString;
 use std::fmt;
 use std::num::Wrapping;
+use std::ptr;
 use std::string::String;
 
+use ::autocorrect;
 use ::logging;
+use ::prediction;
+use ::prediction::Predictor;
+use ::swipe;
+use ::swipe::KeyCenters;
 use ::util::c::into_cstring;
 
 // Traits
@@ -41,6 +48,61 @@ pub mod c {
         pub fn eek_input_method_delete_surrounding_text(im: *mut InputMethod, before: u32, after: u32);
         pub fn eek_input_method_commit(im: *mut InputMethod, serial: u32);
         fn eekboard_context_service_set_hint_purpose(state: *const StateManager, hint: u32, purpose: u32);
+        /// Takes a NULL-terminated array, or NULL to hide suggestions
+        pub fn eekboard_context_service_set_suggestions(state: *const StateManager, words: *const *const c_char);
+    }
+
+    /// Stand-ins for the protocol, which isn't linked into tests.
+    #[cfg(test)]
+    pub mod test {
+        use super::*;
+
+        use std::cell::RefCell;
+        use std::ffi::CStr;
+
+        #[derive(Debug, PartialEq)]
+        pub enum Request {
+            Commit(String),
+            Delete(u32),
+        }
+
+        thread_local! {
+            /// Text changes requested by the current test
+            pub static REQUESTS: RefCell<Vec<Request>> = RefCell::new(Vec::new());
+        }
+
+        #[no_mangle]
+        pub extern "C"
+        fn eek_input_method_commit_string(
+            _im: *mut InputMethod,
+            text: *const c_char,
+        ) {
+            let text = unsafe { CStr::from_ptr(text) };
+            REQUESTS.with(|r| r.borrow_mut().push(
+                Request::Commit(text.to_string_lossy().into_owned())
+            ));
+        }
+
+        #[no_mangle]
+        pub extern "C"
+        fn eek_input_method_delete_surrounding_text(
+            _im: *mut InputMethod,
+            before: u32,
+            _after: u32,
+        ) {
+            REQUESTS.with(|r| r.borrow_mut().push(Request::Delete(before)));
+        }
+
+        #[no_mangle]
+        pub extern "C"
+        fn eek_input_method_commit(_im: *mut InputMethod, _serial: u32) {}
+
+        #[no_mangle]
+        pub extern "C"
+        fn eekboard_context_service_set_suggestions(
+            _state: *const StateManager,
+            _words: *const *const c_char,
+        ) {}
     }
     
     // The following defined in Rust. TODO: wrap naked pointers to Rust data inside RefCells to prevent multiple writers
@@ -150,6 +212,7 @@ pub mod c {
         };
 
         imservice.serial += Wrapping(1u32);
+        imservice.text_outdated = false;
 
         if active_changed {
             (imservice.active_callback)(imservice.current.active);
@@ -163,6 +226,7 @@ pub mod c {
                 }
             }
         }
+        imservice.update_suggestions();
     }
     
     // TODO: this is really untested
@@ -179,6 +243,7 @@ pub mod c {
         imservice.current.active = false;
 
         (imservice.active_callback)(imservice.current.active);
+        imservice.update_suggestions();
     }    
 
     // FIXME: destroy and deallocate
@@ -337,8 +402,23 @@ pub struct IMService {
     current: IMProtocolState, // turn current into an idiomatic representation?
     preedit_string: String,
     serial: Wrapping<u32>,
+
+    predictor: Option<Predictor>,
+    /// Completions of the word before the cursor, shown to the user.
+    /// None when the text field doesn't want completions.
+    suggestions: Option<Vec<String>>,
+    /// Length in bytes of the word the suggestions complete
+    completed_len: usize,
+    /// Decode drags across letters as words
+    swipe_enabled: bool,
+    /// Changed since the last done event, by commits or by keys,
+    /// so the surrounding text doesn't reflect what was typed.
+    text_outdated: bool,
 }
 
+/// How many completions fit in the suggestion bar
+const MAX_SUGGESTIONS: usize = 3;
+
 pub enum SubmitError {
     /// The input method had not been activated
     NotActive,
@@ -360,6 +440,11 @@ impl IMService {
             current: IMProtocolState::default(),
             preedit_string: String::new(),
             serial: Wrapping(0u32),
+            predictor: prediction::load_for_system_locale(),
+            suggestions: None,
+            completed_len: 0,
+            swipe_enabled: env::var_os("SQUEEKBOARD_SWIPE").is_some(),
+            text_outdated: false,
         });
         unsafe {
             c::imservice_connect_listeners(
@@ -406,6 +491,7 @@ impl IMService {
                 unsafe {
                     c::eek_input_method_commit(self.im, self.serial.0)
                 }
+                self.text_outdated = true;
                 Ok(())
             },
             false => Err(SubmitError::NotActive),
@@ -415,4 +501,254 @@ impl IMService {
     pub fn is_active(&self) -> bool {
         self.current.active
     }
+
+    /// Keys sent through the virtual keyboard, like Backspace,
+    /// change the text without the input method knowing how.
+    pub fn mark_text_outdated(&mut self) {
+        self.text_outdated = true;
+    }
+
+    /// Submits the rest of the chosen suggestion, followed by a space.
+    /// Does nothing until the text typed since the last commit arrives.
+    pub fn commit_suggestion(&mut self, index: usize)
+        -> Result<(), SubmitError>
+    {
+        // The suggestions complete the word as it was before the commit,
+        // so the part to submit is unknown until the text gets updated.
+        if self.text_outdated {
+            return Ok(());
+        }
+        let text = match self.suggestions.as_ref().and_then(|s| s.get(index)) {
+            Some(word) => format!("{} ", &word[self.completed_len..]),
+            None => return Ok(()),
+        };
+        self.commit_string(&CString::new(text).unwrap())?;
+        self.commit()?;
+        // The word is complete.
+        // Stale suggestions must not get submitted
+        // before the new surrounding text arrives.
+        self.set_suggestions(Some(Vec::new()), 0);
+        Ok(())
+    }
+
+    pub fn is_swipe_available(&self) -> bool {
+        self.swipe_enabled
+            && self.predictor.is_some()
+            && self.completion_wanted()
+    }
+
+    /// Submits the word the gesture stands for, followed by a space.
+    /// Its first letter was already submitted when the gesture started.
+    pub fn commit_swipe(
+        &mut self,
+        keys: &swipe::KeyCenters,
+        gesture: &swipe::Gesture,
+    ) -> Result<(), SubmitError> {
+        let word = self.predictor.as_ref()
+            .and_then(|predictor| predictor.get_dictionary())
+            .and_then(|dict| swipe::decode(&dict, keys, gesture));
+        let word = match word {
+            Some(word) => word,
+            None => return Ok(()),
+        };
+        // The typed letter may be uppercase,
+        // and its lowercase form may have a different length
+        let rest = word.char_indices().nth(1)
+            .map(|(index, _)| &word[index..])
+            .unwrap_or("");
+        let text = format!("{} ", rest);
+        self.commit_string(&CString::new(text).unwrap())?;
+        self.commit()?;
+        self.set_suggestions(Some(Vec::new()), 0);
+        Ok(())
+    }
+
+    /// Replaces the word before the cursor if it's mistyped.
+    /// Needs a commit to take effect.
+    pub fn autocorrect(&mut self, keys: &KeyCenters)
+        -> Result<(), SubmitError>
+    {
+        let hint = self.current.content_hint;
+        let wanted = self.current.active
+            && hint.contains(ContentHint::SPELLCHECK)
+            && !hint.intersects(
+                ContentHint::HIDDEN_TEXT | ContentHint::SENSITIVE_DATA
+            )
+            // Byte counts would be off
+            && !self.text_outdated;
+        if !wanted {
+            return Ok(());
+        }
+        let correction = match (
+            self.predictor.as_ref().and_then(|p| p.get_dictionary()),
+            self.word_to_complete(),
+        ) {
+            (Some(dict), Some(word)) => {
+                autocorrect::correct(&dict, keys, word)
+                    .map(|correction| (word.len(), correction))
+            },
+            _ => None,
+        };
+        if let Some((typed_len, correction)) = correction {
+            self.delete_surrounding_text(typed_len as u32, 0)?;
+            self.commit_string(&CString::new(correction).unwrap())?;
+        }
+        Ok(())
+    }
+
+    fn completion_wanted(&self) -> bool {
+        let hint = self.current.content_hint;
+        self.current.active
+            && hint.contains(ContentHint::COMPLETION)
+            && !hint.intersects(
+                ContentHint::HIDDEN_TEXT | ContentHint::SENSITIVE_DATA
+            )
+    }
+
+    /// The word before the cursor
+    fn word_to_complete(&self) -> Option<&str> {
+        self.current.surrounding_text.to_str().ok()
+            .and_then(|text| prediction::current_word(
+                text,
+                self.current.surrounding_cursor as usize,
+            ))
+    }
+
+    fn update_suggestions(&mut self) {
+        let (words, completed_len) = match self.predictor {
+            Some(ref predictor) if self.completion_wanted() => {
+                match self.word_to_complete() {
+                    Some(word) => (
+                        Some(predictor.complete(word, MAX_SUGGESTIONS)),
+                        word.len(),
+                    ),
+                    None => (Some(Vec::new()), 0),
+                }
+            },
+            _ => (None, 0),
+        };
+        self.set_suggestions(words, completed_len);
+    }
+
+    /// None hides the suggestion bar,
+    /// an empty list keeps it in place for the next word.
+    fn set_suggestions(
+        &mut self,
+        words: Option<Vec<String>>,
+        completed_len: usize,
+    ) {
+        self.completed_len = completed_len;
+        if words == self.suggestions {
+            return;
+        }
+        self.suggestions = words;
+        // Suggestions come from valid UTF-8 without NULs
+        let words: Option<Vec<CString>> = self.suggestions.as_ref()
+            .map(|words| words.iter()
+                .map(|w| CString::new(w.as_str()).unwrap())
+                .collect()
+            );
+        let pointers: Option<Vec<_>> = words.as_ref()
+            .map(|words| words.iter()
+                .map(|w| w.as_ptr())
+                .chain(Some(ptr::null()))
+                .collect()
+            );
+        unsafe {
+            c::eekboard_context_service_set_suggestions(
+                self.state_manager,
+                pointers.as_ref()
+                    .map(|p| p.as_ptr())
+                    .unwrap_or(ptr::null()),
+            )
+        }
+    }
+}
+
+#[cfg(test)]
+pub mod test {
+    use super::*;
+
+    use std::fs;
+    use std::process;
+    use ::prediction::compile;
+    use ::swipe::test::{ make_keys, swipe };
+    pub use self::c::test::Request;
+    use self::c::test::REQUESTS;
+
+    /// Active, wanting completions and corrections,
+    /// with the words in the dictionary
+    pub fn make_imservice(name: &str, words: Vec<(&str, u64)>) -> IMService {
+        let path = env::temp_dir()
+            .join(format!("squeekboard-test-{}-{}.dict", process::id(), name));
+        fs::write(&path, compile(words)).unwrap();
+        let predictor = Predictor::open(&path).unwrap();
+        fs::remove_file(&path).unwrap();
+        IMService {
+            im: ptr::null_mut(),
+            state_manager: ptr::null(),
+            active_callback: Box::new(|_| {}),
+            pending: IMProtocolState::default(),
+            current: IMProtocolState {
+                active: true,
+                content_hint: ContentHint::COMPLETION
+                    | ContentHint::SPELLCHECK,
+                ..IMProtocolState::default()
+            },
+            preedit_string: String::new(),
+            serial: Wrapping(0u32),
+            predictor: Some(predictor),
+            suggestions: None,
+            completed_len: 0,
+            swipe_enabled: true,
+            text_outdated: false,
+        }
+    }
+
+    /// Like the done event, with the cursor at the end of the text
+    pub fn receive_text(imservice: &mut IMService, text: &str) {
+        imservice.current.surrounding_text = CString::new(text).unwrap();
+        imservice.current.surrounding_cursor = text.len() as u32;
+        imservice.text_outdated = false;
+        imservice.update_suggestions();
+    }
+
+    pub fn take_requests() -> Vec<Request> {
+        REQUESTS.with(|r| r.borrow_mut().drain(..).collect())
+    }
+
+    #[test]
+    fn suggestion_waits_for_text() {
+        let mut imservice = make_imservice("suggestion", vec![("hello", 1)]);
+        receive_text(&mut imservice, "hel");
+        assert_eq!(imservice.suggestions, Some(vec!["hello".into()]));
+
+        // Typed before the text got updated
+        imservice.commit_string(&CString::new("l").unwrap()).ok().unwrap();
+        imservice.commit().ok().unwrap();
+        take_requests();
+        imservice.commit_suggestion(0).ok().unwrap();
+        assert_eq!(take_requests(), vec![]);
+
+        receive_text(&mut imservice, "hell");
+        imservice.commit_suggestion(0).ok().unwrap();
+        assert_eq!(take_requests(), vec![Request::Commit("o ".into())]);
+    }
+    #[test]
+    fn swipe_after_multibyte_capital() {
+        let mut imservice = make_imservice(
+            "swipe",
+            vec![("istanbul", 1), ("işte", 1)],
+        );
+        let keys = make_keys(&[("abeilnstuş", 0.0)]);
+        // 'İ' takes 2 bytes, 'i' only 1
+        let gesture = swipe(&keys, "İstanbul");
+        take_requests();
+        imservice.commit_swipe(&keys, &gesture).ok().unwrap();
+        assert_eq!(take_requests(), vec![Request::Commit("stanbul ".into())]);
+
+        let gesture = swipe(&keys, "İşte");
+        imservice.commit_swipe(&keys, &gesture).ok().unwrap();
+        assert_eq!(take_requests(), vec![Request::Commit("şte ".into())]);
+    }
 }
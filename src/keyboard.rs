@@ -1,21 +1,19 @@
 /*! State of the emulated keyboard and keys.
  * Regards the keyboard as if it was composed of switches. */
 
-use std::cell::RefCell;
-use std::collections::HashMap;
+use std::cmp::Ordering;
+use std::collections::{ HashMap, HashSet };
 use std::fmt;
 use std::io;
 use std::mem;
 use std::ptr;
-use std::rc::Rc;
 use std::string::FromUtf8Error;
 
 use ::action::Action;
-use ::util;
 
 // Traits
 use std::io::Write;
-use std::iter::{ FromIterator, IntoIterator };
+use std::iter::IntoIterator;
 
 #[derive(Debug, Clone, Copy, PartialEq)]
 pub enum PressType {
@@ -24,7 +22,7 @@ pub enum PressType {
 }
 
 /// The extended, unambiguous layout-keycode
-#[derive(Debug, Clone)]
+#[derive(Debug, Clone, Copy)]
 pub struct KeyCode {
     pub code: u32,
     pub keymap_idx: usize,
@@ -49,9 +47,10 @@ bitflags!{
 }
 
 /// When the submitted actions of keys need to be tracked,
-/// they need a stable, comparable ID
-#[derive(Clone, PartialEq)]
-pub struct KeyStateId(*const KeyState);
+/// they need a stable, comparable ID.
+/// It's the index of the key in the layout's table of keys.
+#[derive(Clone, Copy, Debug, PartialEq, Eq, Hash)]
+pub struct KeyStateId(pub usize);
 
 #[derive(Debug, Clone)]
 pub struct KeyState {
@@ -62,54 +61,210 @@ pub struct KeyState {
     pub action: Action,
 }
 
-impl KeyState {
-    #[must_use]
-    pub fn into_released(self) -> KeyState {
-        KeyState {
-            pressed: PressType::Released,
-            ..self
-        }
-    }
+/// Key codes fitting in a keymap, starting from ~~8~~
+/// HACK: starting from 9, because 8 results in keycode 0,
+/// which the compositor likes to discard
+const KEYMAP_CAPACITY: usize = 255 - 9;
+const FIRST_KEYCODE: usize = 9;
+
+/// Symbols likely to be typed one after another, like those on one view
+pub struct SymbolGroup {
+    pub symbols: Vec<String>,
+    /// How often the group gets used, relative to other groups
+    pub weight: f64,
+}
 
-    #[must_use]
-    pub fn into_pressed(self) -> KeyState {
-        KeyState {
-            pressed: PressType::Pressed,
-            ..self
-        }
+fn compare_weights(a: f64, b: f64) -> Ordering {
+    a.partial_cmp(&b).unwrap_or(Ordering::Equal)
+}
+
+/// Key codes of symbols, shared between layouts.
+/// Codes are split into pages, each page becoming a keymap.
+/// Symbols keep their codes when the layout changes,
+/// so layouts made of the same symbols produce identical keymaps,
+/// and switching between them doesn't need a new keymap.
+pub struct KeycodeTable {
+    /// The symbol at index `i` gets the code `FIRST_KEYCODE + i`
+    pages: Vec<Vec<String>>,
+}
+
+impl KeycodeTable {
+    pub fn new() -> KeycodeTable {
+        KeycodeTable { pages: Vec::new() }
     }
 
-    /// KeyStates instances are the unique identifiers of pressed keys,
-    /// and the actions submitted with them.
-    pub fn get_id(keystate: &Rc<RefCell<KeyState>>) -> KeyStateId {
-        KeyStateId(keystate.as_ptr() as *const KeyState)
+    fn find_code(&self, page: usize, name: &str) -> Option<usize> {
+        self.pages[page].iter()
+            .position(|n| n == name)
+            .map(|idx| idx + FIRST_KEYCODE)
     }
-}
 
-/// Sorts an iterator by converting it to a Vector and back
-fn sorted<'a, I: Iterator<Item=String>>(
-    iter: I
-) -> impl Iterator<Item=String> {
-    let mut v: Vec<String> = iter.collect();
-    v.sort();
-    v.into_iter()
-}
+    /// Gives each symbol a code, adding symbols to pages as needed.
+    /// All the symbols get placed on a single page if they fit.
+    /// Otherwise, the symbols of a group get placed on a single page
+    /// where possible, heaviest groups first.
+    /// Every change of keymap while typing costs an upload
+    /// and a compilation in the compositor.
+    ///
+    /// Returns the codes, and the pages used.
+    /// `KeyCode::keymap_idx` indexes the list of pages.
+    pub fn assign(&mut self, groups: &[SymbolGroup])
+        -> (HashMap<String, KeyCode>, Vec<usize>)
+    {
+        let mut weights: HashMap<&str, f64> = HashMap::new();
+        for group in groups {
+            let names: HashSet<&str> = group.symbols.iter()
+                .map(String::as_str)
+                .collect();
+            for name in names {
+                *weights.entry(name).or_insert(0.0) += group.weight;
+            }
+        }
 
-/// Generates a mapping where each key gets a keycode, starting from ~~8~~
-/// HACK: starting from 9, because 8 results in keycode 0,
-/// which the compositor likes to discard
-pub fn generate_keycodes<'a, C: IntoIterator<Item=String>>(
-    key_names: C,
-) -> HashMap<String, KeyCode> {
-    HashMap::from_iter(
-        // Sort to remove a source of indeterminism in keycode assignment.
-        sorted(key_names.into_iter())
-            .zip(util::cycle_count(9..255))
-            .map(|(name, (code, keymap_idx))| (
+        // When all the symbols fit on one page, the layout never needs
+        // to switch keymaps, so groups don't matter.
+        // Use the page already sharing the most with the layout.
+        let mut all: Vec<&str> = weights.keys().cloned().collect();
+        all.sort();
+        let single_page = {
+            let pages = &self.pages;
+            let missing = |page: usize| {
+                all.iter()
+                    .filter(|name| !pages[page].iter().any(|n| n == **name))
+                    .count()
+            };
+            (0..pages.len())
+                .filter(|page| pages[*page].len() + missing(*page) <= KEYMAP_CAPACITY)
+                .min_by_key(|page| missing(*page))
+                .or(match all.len() {
+                    0 => None,
+                    len if len <= KEYMAP_CAPACITY => Some(pages.len()),
+                    _ => None,
+                })
+        };
+        if let Some(page) = single_page {
+            if page == self.pages.len() {
+                self.pages.push(Vec::new());
+            }
+            let codes = all.iter()
+                .map(|name| {
+                    let code = match self.find_code(page, name) {
+                        Some(code) => code,
+                        None => {
+                            self.pages[page].push(String::from(*name));
+                            self.pages[page].len() - 1 + FIRST_KEYCODE
+                        },
+                    };
+                    (
+                        String::from(*name),
+                        KeyCode { code: code as u32, keymap_idx: 0 },
+                    )
+                })
+                .collect();
+            return (codes, vec![page]);
+        }
+
+        let mut order: Vec<&SymbolGroup> = groups.iter().collect();
+        // The sort is stable, so ties stay in the given order.
+        order.sort_by(|a, b| compare_weights(b.weight, a.weight));
+
+        // Symbol to page and code
+        let mut assigned: HashMap<&str, (usize, usize)> = HashMap::new();
+        for group in order {
+            let mut members: Vec<&str> = group.symbols.iter()
+                .map(String::as_str)
+                .collect();
+            members.sort();
+            members.dedup();
+            let mut unplaced: Vec<&str> = members.iter()
+                .cloned()
+                .filter(|name| !assigned.contains_key(name))
+                .collect();
+            // The most used first, in case they don't all fit together
+            unplaced.sort_by(|a, b| compare_weights(weights[b], weights[a]));
+
+            // Prefer the page already sharing the most with the group.
+            // If none has room for the whole group, start a new one,
+            // so that the group doesn't end up split more than needed.
+            let mut page = {
+                let pages = &self.pages;
+                let affinity = |page: usize| -> f64 {
+                    members.iter()
+                        .filter(|name| match assigned.get(*name) {
+                            Some(&(p, _)) => p == page,
+                            None => pages[page].iter().any(|n| n == **name),
+                        })
+                        .map(|name| weights[name])
+                        .sum()
+                };
+                let fits = |page: usize| {
+                    let missing = unplaced.iter()
+                        .filter(|name| !pages[page].iter().any(|n| n == **name))
+                        .count();
+                    pages[page].len() + missing <= KEYMAP_CAPACITY
+                };
+                (0..pages.len())
+                    .filter(|page| fits(*page))
+                    .map(|page| (page, affinity(page)))
+                    .fold(None, |best: Option<(usize, f64)>, (page, a)| match best {
+                        Some((b, best_a)) if best_a >= a => Some((b, best_a)),
+                        _ => Some((page, a)),
+                    })
+                    .map(|(page, _)| page)
+                    .unwrap_or(pages.len())
+            };
+
+            for name in unplaced {
+                if page == self.pages.len() {
+                    self.pages.push(Vec::new());
+                }
+                let code = match self.find_code(page, name) {
+                    Some(code) => code,
+                    None => {
+                        if self.pages[page].len() == KEYMAP_CAPACITY {
+                            page = self.pages.len();
+                            self.pages.push(Vec::new());
+                        }
+                        self.pages[page].push(name.into());
+                        self.pages[page].len() - 1 + FIRST_KEYCODE
+                    },
+                };
+                assigned.insert(name, (page, code));
+            }
+        }
+
+        let mut used: Vec<usize> = assigned.values()
+            .map(|&(page, _)| page)
+            .collect();
+        used.sort();
+        used.dedup();
+        let codes = assigned.into_iter()
+            .map(|(name, (page, code))| (
                 String::from(name),
-                KeyCode { code, keymap_idx },
+                KeyCode {
+                    code: code as u32,
+                    keymap_idx: used.binary_search(&page)
+                        .expect("Page not recorded"),
+                },
             ))
-    )
+            .collect();
+        (codes, used)
+    }
+
+    /// Generates keymaps for the pages, in the same order
+    pub fn generate_keymaps(&self, pages: &[usize])
+        -> Result<Vec<String>, FormattingError>
+    {
+        pages.iter()
+            .map(|page| {
+                let mut symbolmap = single_key_map_new();
+                for (idx, name) in self.pages[*page].iter().enumerate() {
+                    symbolmap[idx + FIRST_KEYCODE] = Some(name.clone());
+                }
+                generate_keymap(&symbolmap)
+            })
+            .collect()
+    }
 }
 
 #[derive(Debug)]
@@ -155,28 +310,6 @@ fn single_key_map_new() -> SingleKeyMap {
     }
 }
 
-pub fn generate_keymaps(symbolmap: HashMap::<String, KeyCode>)
-    -> Result<Vec<String>, FormattingError>
-{
-    let mut bins: Vec<SingleKeyMap> = Vec::new();
-    
-    for (name, KeyCode { code, keymap_idx }) in symbolmap.into_iter() {
-        if keymap_idx >= bins.len() {
-            bins.resize_with(
-                keymap_idx + 1,
-                || single_key_map_new(),
-            );
-        }
-        bins[keymap_idx][code as usize] = Some(name);
-    }
-
-    let mut out = Vec::new();
-    for bin in bins {
-        out.push(generate_keymap(&bin)?);
-    }
-    Ok(out)
-}
-
 /// Generates a de-facto single level keymap.
 /// Key codes must not repeat and must remain between 9 and 255.
 fn generate_keymap(
@@ -304,9 +437,10 @@ mod tests {
 
     #[test]
     fn test_keymap_second_resolve() {
-        let keymaps = generate_keymaps(hashmap!(
-            "a".into() => KeyCode { keymap_idx: 1, code: 9 },
-        )).unwrap();
+        let table = KeycodeTable {
+            pages: vec![vec!["b".into()], vec!["a".into()]],
+        };
+        let keymaps = table.generate_keymaps(&[0, 1]).unwrap();
 
         let context = xkb::Context::new(xkb::CONTEXT_NO_FLAGS);
 
@@ -322,15 +456,135 @@ mod tests {
         assert_eq!(state.key_get_one_sym(9), xkb::KEY_a);
     }
 
+    #[test]
+    fn test_symbolmap_single() {
+        // Everything fits, so groups don't matter
+        let (keycodes, pages) = KeycodeTable::new().assign(&[
+            SymbolGroup { symbols: vec!["b".into(), "c".into()], weight: 1.0 },
+            SymbolGroup { symbols: vec!["a".into(), "b".into()], weight: 2.0 },
+        ]);
+        assert_eq!(pages, vec![0]);
+        assert_eq!(keycodes["a"].code, 9);
+        assert_eq!(keycodes["b"].code, 10);
+        assert_eq!(keycodes["c"].code, 11);
+    }
+
     #[test]
     fn test_symbolmap_overflow() {
         // The 257th key (U1101) is interesting.
         // Use Unicode encoding for being able to use in xkb keymaps.
         let keynames = (0..258).map(|num| format!("U{:04X}", 0x1000 + num));
-        let keycodes = generate_keycodes(keynames);
+        let (keycodes, _pages) = KeycodeTable::new().assign(&[SymbolGroup {
+            symbols: keynames.collect(),
+            weight: 1.0,
+        }]);
         
         // test now
         let code = keycodes.get("U1101").expect("Did not find the tested keysym");
         assert_eq!(code.keymap_idx, 1);
     }
+
+    /// Names of n symbols, starting from the given one
+    fn symbols(first: u32, count: u32) -> Vec<String> {
+        (first..(first + count)).map(|num| format!("U{:04X}", num)).collect()
+    }
+
+    #[test]
+    fn test_symbolmap_groups() {
+        let shared = symbols(0x2000, 3);
+        let group = |first| SymbolGroup {
+            symbols: symbols(first, 200).into_iter()
+                .chain(shared.iter().cloned())
+                .collect(),
+            weight: 1.0,
+        };
+        let (keycodes, _pages) = KeycodeTable::new().assign(&[
+            group(0x1000),
+            SymbolGroup { weight: 4.0, ..group(0x1100) },
+        ]);
+
+        let keymap_of = |name: &str| keycodes[name].keymap_idx;
+        // The heavier group gets placed together with shared symbols
+        let heavy = keymap_of("U1100");
+        assert!(symbols(0x1100, 200).iter().all(|name| keymap_of(name) == heavy));
+        assert!(shared.iter().all(|name| keymap_of(name) == heavy));
+        let light = keymap_of("U1000");
+        assert_ne!(light, heavy);
+        assert!(symbols(0x1000, 200).iter().all(|name| keymap_of(name) == light));
+
+        // Every keymap has unique codes within range
+        let mut codes: Vec<(usize, u32)> = keycodes.values()
+            .map(|code| (code.keymap_idx, code.code))
+            .collect();
+        codes.sort();
+        codes.dedup();
+        assert_eq!(codes.len(), keycodes.len());
+        assert!(codes.iter().all(|&(_, code)| code >= 9 && code < 255));
+    }
+
+    fn group(names: &[&str]) -> SymbolGroup {
+        SymbolGroup {
+            symbols: names.iter().map(|name| String::from(*name)).collect(),
+            weight: 1.0,
+        }
+    }
+
+    #[test]
+    fn test_symbolmap_stable() {
+        let mut table = KeycodeTable::new();
+        let (first, pages) = table.assign(&[group(&["a", "b", "c"])]);
+        let keymaps = table.generate_keymaps(&pages).unwrap();
+
+        // Another layout with some other symbols
+        let (second, pages) = table.assign(&[group(&["d", "c", "a"])]);
+        assert_eq!(second["a"].code, first["a"].code);
+        assert_eq!(second["c"].code, first["c"].code);
+        assert_eq!(second["d"].code, 12);
+        assert_eq!(pages, vec![0]);
+
+        // The first one again
+        let (again, pages) = table.assign(&[group(&["c", "b", "a"])]);
+        for name in &["a", "b", "c"] {
+            assert_eq!(again[*name].code, first[*name].code);
+        }
+        // The keymap grew, but is now the same for both layouts
+        let again_keymaps = table.generate_keymaps(&pages).unwrap();
+        assert_ne!(again_keymaps, keymaps);
+        let (_, pages) = table.assign(&[group(&["d"])]);
+        assert_eq!(table.generate_keymaps(&pages).unwrap(), again_keymaps);
+    }
+
+    #[test]
+    fn test_symbolmap_new_page() {
+        let mut table = KeycodeTable::new();
+        let shared = ["BackSpace", "space"];
+        let names = |first| {
+            symbols(first, 200).into_iter()
+                .chain(shared.iter().map(|name| String::from(*name)))
+                .collect()
+        };
+        table.assign(&[SymbolGroup { symbols: names(0x1000), weight: 1.0 }]);
+        // Doesn't fit on the first page, so shared symbols get repeated
+        let (keycodes, pages) = table.assign(
+            &[SymbolGroup { symbols: names(0x1100), weight: 1.0 }]
+        );
+        assert_eq!(pages, vec![1]);
+        assert!(keycodes.values().all(|code| code.keymap_idx == 0));
+        assert_eq!(keycodes.len(), 202);
+    }
+
+    #[test]
+    fn test_symbolmap_single_after_full() {
+        let mut table = KeycodeTable::new();
+        table.assign(&[SymbolGroup { symbols: symbols(0x1000, 240), weight: 1.0 }]);
+        // Groups which would fit on the first page one by one,
+        // but not together
+        let (keycodes, pages) = table.assign(&[
+            SymbolGroup { symbols: symbols(0x2000, 5), weight: 1.0 },
+            SymbolGroup { symbols: symbols(0x2100, 5), weight: 1.0 },
+        ]);
+        assert_eq!(pages, vec![1]);
+        assert!(keycodes.values().all(|code| code.keymap_idx == 0));
+        assert_eq!(keycodes.len(), 10);
+    }
 }
@@ -25,18 +25,31 @@ struct squeek_layout_state {
 };
 
 struct squeek_layout;
+/// Opaque, valid as long as the layout is.
+struct squeek_view;
 
 
 struct transformation squeek_layout_calculate_transformation(
         const struct squeek_layout *layout,
         double allocation_width, double allocation_size);
+struct transformation squeek_layout_calculate_snapped_transformation(
+        const struct squeek_layout *layout,
+        double allocation_width, double allocation_size,
+        uint32_t scale_factor);
 
 struct squeek_layout *squeek_load_layout(const char *name, uint32_t type, uint32_t variant_type, const char *overlay_name);
+struct squeek_layout *squeek_load_builtin_layout(const char *name);
+void squeek_builtin_layout_foreach(void (*callback)(const char *name, void *data), void *data);
 enum squeek_arrangement_kind squeek_layout_get_kind(const struct squeek_layout *);
+const struct squeek_view *squeek_layout_get_current_view(const struct squeek_layout *layout);
+void squeek_layout_foreach_reachable_view(const struct squeek_layout *layout, void (*callback)(const struct squeek_view *view, void *data), void *data);
 void squeek_layout_free(struct squeek_layout*);
+uint32_t squeek_layout_get_button_count(const struct squeek_layout *layout);
+void squeek_layout_set_button_pressed(struct squeek_layout *layout, uint32_t index, uint32_t pressed);
 
 void squeek_layout_release(struct squeek_layout *layout,
                            struct submission *submission,
+                           uintptr_t point,
                            struct transformation widget_to_layout,
                            uint32_t timestamp,
                            EekboardContextService *manager,
@@ -44,17 +57,30 @@ void squeek_layout_release(struct squeek_layout *layout,
 void squeek_layout_release_all_only(struct squeek_layout *layout,
                                     struct submission *submission,
                                     uint32_t timestamp);
+void squeek_layout_find_buttons(const struct squeek_layout *layout,
+                                const EekPoint *points, uint32_t count,
+                                struct transformation widget_to_layout,
+                                int32_t *buttons);
 void squeek_layout_depress(struct squeek_layout *layout,
                            struct submission *submission,
+                           uintptr_t point,
                            double x_widget, double y_widget,
                            struct transformation widget_to_layout,
                            uint32_t timestamp, EekGtkKeyboard *ui_keyboard);
 void squeek_layout_drag(struct squeek_layout *layout,
                         struct submission *submission,
+                        uintptr_t point,
                         double x_widget, double y_widget,
                         struct transformation widget_to_layout,
                         uint32_t timestamp, EekboardContextService *manager,
                         EekGtkKeyboard *ui_keyboard);
-void squeek_layout_draw_all_changed(struct squeek_layout *layout, EekRenderer* renderer, cairo_t     *cr, struct submission *submission);
-void squeek_draw_layout_base_view(struct squeek_layout *layout, EekRenderer* renderer, cairo_t     *cr);
+/// Buttons of a layout pre-rendered in all their states.
+struct squeek_atlas;
+
+struct squeek_atlas *squeek_atlas_new(const struct squeek_layout *layout, double scale);
+void squeek_atlas_free(struct squeek_atlas *atlas);
+uint32_t squeek_atlas_render_view(struct squeek_atlas *atlas, const struct squeek_layout *layout, const struct squeek_view *view, EekRenderer *renderer);
+
+void squeek_layout_draw_all_changed(struct squeek_layout *layout, EekRenderer* renderer, const struct squeek_atlas *atlas, cairo_t     *cr, struct submission *submission);
+void squeek_draw_layout_base_view(struct squeek_layout *layout, const struct squeek_view *view, EekRenderer* renderer, const struct squeek_atlas *atlas, cairo_t     *cr);
 #endif
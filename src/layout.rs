@@ -15,33 +15,39 @@
  * Note that it might be a better idea
  * to make `View` position depend on its contents,
  * and let the renderer scale and center it within the widget.
+ *
+ * Those structures only describe the layout while it's being built.
+ * The finished `Layout` flattens them into tables indexed by button,
+ * with views referring to ranges of buttons,
+ * so that hit testing and drawing walk contiguous memory.
+ * Key states live in a table of their own, indexed by `KeyStateId`.
  */
 
-use std::cell::RefCell;
-use std::collections::{ HashMap, HashSet };
+use std::cell::Cell;
+use std::cmp;
+use std::collections::HashMap;
 use std::ffi::CString;
 use std::fmt;
-use std::rc::Rc;
+use std::hash::Hash;
+use std::ops::Range;
 use std::vec::Vec;
 
-use ::action::Action;
+use ::action::{ Action, ViewId };
 use ::drawing;
-use ::keyboard::KeyState;
+use ::keyboard::{ KeyState, KeyStateId, PressType };
 use ::logging;
 use ::manager;
 use ::submission::{ Submission, SubmitData, Timestamp };
+use ::swipe;
 use ::util::find_max_double;
 
-// Traits
-use std::borrow::Borrow;
-use ::logging::Warn;
-
 /// Gathers stuff defined in C or called by C
 pub mod c {
     use super::*;
 
     use gtk_sys;
     use std::os::raw::c_void;
+    use std::slice;
 
     use std::ops::{ Add, Sub };
 
@@ -57,6 +63,16 @@ pub mod c {
         );
     }
 
+    /// Stand-ins for the widget, which isn't linked into tests.
+    #[cfg(test)]
+    pub mod test {
+        use super::*;
+
+        #[no_mangle]
+        pub extern "C"
+        fn eek_gtk_keyboard_emit_feedback(_keyboard: EekGtkKeyboard) {}
+    }
+
     /// Defined in eek-types.h
     #[repr(C)]
     #[derive(Clone, Debug, PartialEq)]
@@ -107,10 +123,17 @@ pub mod c {
             point.x > self.x && point.x < self.x + self.width
                 && point.y > self.y && point.y < self.y + self.height
         }
+
+        pub fn intersects(&self, other: &Bounds) -> bool {
+            self.x < other.x + other.width && other.x < self.x + self.width
+                && self.y < other.y + other.height
+                && other.y < self.y + self.height
+        }
     }
 
     /// Translate and then scale
     #[repr(C)]
+    #[derive(Clone, Copy, Debug, PartialEq)]
     pub struct Transformation {
         pub origin_x: f64,
         pub origin_y: f64,
@@ -126,7 +149,7 @@ pub mod c {
                 scale: self.scale * next.scale,
             }
         }
-        fn forward(&self, p: Point) -> Point {
+        pub fn forward(&self, p: Point) -> Point {
             Point {
                 x: (p.x - self.origin_x) / self.scale,
                 y: (p.y - self.origin_y) / self.scale,
@@ -176,6 +199,27 @@ pub mod c {
         })
     }
 
+    /// Like `squeek_layout_calculate_transformation`,
+    /// but aligned to the pixels of a screen
+    /// with `scale_factor` device pixels per widget pixel.
+    #[no_mangle]
+    pub extern "C"
+    fn squeek_layout_calculate_snapped_transformation(
+        layout: *const Layout,
+        allocation_width: f64,
+        allocation_height: f64,
+        scale_factor: u32,
+    ) -> Transformation {
+        let layout = unsafe { &*layout };
+        layout.calculate_snapped_transformation(
+            Size {
+                width: allocation_width,
+                height: allocation_height,
+            },
+            scale_factor,
+        )
+    }
+
     #[no_mangle]
     pub extern "C"
     fn squeek_layout_get_kind(layout: *const Layout) -> u32 {
@@ -183,22 +227,81 @@ pub mod c {
         layout.kind.clone() as u32
     }
 
+    /// Identifies the current view for the purpose of caching its rendering.
+    /// The pointer stays unique for as long as the layout exists.
+    #[no_mangle]
+    pub extern "C"
+    fn squeek_layout_get_current_view(layout: *const Layout)
+        -> *const ViewSpan
+    {
+        let layout = unsafe { &*layout };
+        layout.get_current_view() as *const ViewSpan
+    }
+
+    /// Calls back with every view which can be switched to
+    /// from the current one.
+    /// Views are ordered by name, the current view isn't included.
+    #[no_mangle]
+    pub extern "C"
+    fn squeek_layout_foreach_reachable_view(
+        layout: *const Layout,
+        callback: extern "C" fn(view: *const ViewSpan, data: *mut c_void),
+        data: *mut c_void,
+    ) {
+        let layout = unsafe { &*layout };
+        for view in layout.get_reachable_views() {
+            callback(view as *const ViewSpan, data);
+        }
+    }
+
     #[no_mangle]
     pub extern "C"
     fn squeek_layout_free(layout: *mut Layout) {
         unsafe { Box::from_raw(layout) };
     }
 
+    /// Returns the number of buttons in the current view.
+    /// For benchmarks.
+    #[no_mangle]
+    pub extern "C"
+    fn squeek_layout_get_button_count(layout: *const Layout) -> u32 {
+        let layout = unsafe { &*layout };
+        layout.get_current_view().buttons.len() as u32
+    }
+
+    /// Changes how the key behind the nth button of the current view
+    /// is drawn, without submitting anything.
+    /// For benchmarks.
+    #[no_mangle]
+    pub extern "C"
+    fn squeek_layout_set_button_pressed(
+        layout: *mut Layout,
+        index: u32,
+        pressed: u32,
+    ) {
+        let layout = unsafe { &mut *layout };
+        let buttons = layout.get_current_view().buttons.clone();
+        let index = index as usize;
+        if index < buttons.len() {
+            let key = layout.buttons.keys[buttons.start + index];
+            layout.keys[key.0].pressed = match pressed {
+                0 => PressType::Released,
+                _ => PressType::Pressed,
+            };
+        }
+    }
+
     /// Entry points for more complex procedures and algorithms which span multiple modules
     pub mod procedures {
         use super::*;
 
-        /// Release pointer in the specified position
+        /// Release the key held by the input point
         #[no_mangle]
         pub extern "C"
         fn squeek_layout_release(
             layout: *mut Layout,
             submission: *mut Submission,
+            point: usize,
             widget_to_layout: Transformation,
             time: u32,
             manager: manager::c::Manager,
@@ -212,20 +315,14 @@ pub mod c {
                 keyboard: ui_keyboard,
             };
 
-            // The list must be copied,
-            // because it will be mutated in the loop
-            for key in layout.pressed_keys.clone() {
-                let key: &Rc<RefCell<KeyState>> = key.borrow();
-                seat::handle_release_key(
-                    layout,
-                    submission,
-                    Some(&ui_backend),
-                    time,
-                    Some(manager),
-                    key,
-                );
-            }
-            drawing::queue_redraw(ui_keyboard);
+            seat::handle_lift(
+                layout,
+                submission,
+                Some(&ui_backend),
+                time,
+                Some(manager),
+                PointId(point),
+            );
         }
 
         /// Release all buttons but don't redraw
@@ -238,26 +335,62 @@ pub mod c {
         ) {
             let layout = unsafe { &mut *layout };
             let submission = unsafe { &mut *submission };
-            // The list must be copied,
-            // because it will be mutated in the loop
-            for key in layout.pressed_keys.clone() {
-                let key: &Rc<RefCell<KeyState>> = key.borrow();
+            layout.swipe = None;
+            // Releasing removes the key from the list,
+            // so take the first one until none are left.
+            while let Some(&(_point, key)) = layout.pressed_keys.first() {
                 seat::handle_release_key(
                     layout,
                     submission,
                     None, // don't update UI
                     Timestamp(time),
                     None, // don't switch layouts
-                    &mut key.clone(),
+                    key,
                 );
             }
         }
 
+        /// Finds the buttons of the current view under `count` points
+        /// in widget coordinates.
+        /// For each point, writes the index of the button within the view
+        /// to `buttons`, or -1 if there's no button.
+        #[no_mangle]
+        pub extern "C"
+        fn squeek_layout_find_buttons(
+            layout: *const Layout,
+            points: *const Point,
+            count: u32,
+            widget_to_layout: Transformation,
+            buttons: *mut i32,
+        ) {
+            // The pointers may be null then
+            if count == 0 {
+                return;
+            }
+            let layout = unsafe { &*layout };
+            let points = unsafe { slice::from_raw_parts(points, count as usize) };
+            let buttons = unsafe {
+                slice::from_raw_parts_mut(buttons, count as usize)
+            };
+            let view_start = layout.get_current_view().buttons.start;
+            layout.find_buttons_by_positions(
+                &widget_to_layout,
+                points,
+                |i, found| buttons[i] = match found {
+                    Some(index) => (index - view_start) as i32,
+                    None => -1,
+                },
+            );
+        }
+
+        /// Press the key under a new input point.
+        /// `point` identifies the finger or the mouse.
         #[no_mangle]
         pub extern "C"
         fn squeek_layout_depress(
             layout: *mut Layout,
             submission: *mut Submission,
+            point: usize,
             x_widget: f64, y_widget: f64,
             widget_to_layout: Transformation,
             time: u32,
@@ -265,36 +398,55 @@ pub mod c {
         ) {
             let layout = unsafe { &mut *layout };
             let submission = unsafe { &mut *submission };
-            let point = widget_to_layout.forward(
+            let ui_backend = UIBackend {
+                widget_to_layout,
+                keyboard: ui_keyboard,
+            };
+            let point_id = PointId(point);
+            let point = ui_backend.widget_to_layout.forward(
                 Point { x: x_widget, y: y_widget }
             );
 
-            let state = layout.find_button_by_position(point)
-                .map(|place| place.button.state.clone());
+            // A point can't land twice without lifting,
+            // unless the lift got lost on the way.
+            if layout.is_swiping(point_id) {
+                layout.swipe = None;
+            }
+            if let Some(key) = layout.get_point_key(point_id) {
+                seat::handle_release_key(
+                    layout,
+                    submission,
+                    Some(&ui_backend),
+                    Timestamp(time),
+                    None,
+                    key,
+                );
+            }
+
+            let key = layout.find_button_by_position(point)
+                .map(|button| layout.buttons.keys[button]);
             
-            if let Some(state) = state {
+            if let Some(key) = key {
                 seat::handle_press_key(
                     layout,
                     submission,
+                    Some(&ui_backend),
                     Timestamp(time),
-                    &state,
+                    point_id,
+                    key,
                 );
-                // maybe TODO: draw on the display buffer here
-                drawing::queue_redraw(ui_keyboard);
-                unsafe {
-                    eek_gtk_keyboard_emit_feedback(ui_keyboard);
-                }
             };
         }
 
-        // FIXME: this will work funny
-        // when 2 touch points are on buttons and moving one after another
-        // Solution is to have separate pressed lists for each point
+        /// Moves an input point which already landed,
+        /// releasing the key it left and pressing the key it entered.
+        /// Other points are unaffected.
         #[no_mangle]
         pub extern "C"
         fn squeek_layout_drag(
             layout: *mut Layout,
             submission: *mut Submission,
+            point: usize,
             x_widget: f64, y_widget: f64,
             widget_to_layout: Transformation,
             time: u32,
@@ -308,63 +460,19 @@ pub mod c {
                 widget_to_layout,
                 keyboard: ui_keyboard,
             };
+            let point_id = PointId(point);
             let point = ui_backend.widget_to_layout.forward(
                 Point { x: x_widget, y: y_widget }
             );
-            
-            let pressed = layout.pressed_keys.clone();
-            let button_info = {
-                let place = layout.find_button_by_position(point);
-                place.map(|place| {(
-                    place.button.state.clone(),
-                    place.button.clone(),
-                    place.offset,
-                )})
-            };
-
-            if let Some((state, _button, _view_position)) = button_info {
-                let mut found = false;
-                for wrapped_key in pressed {
-                    let key: &Rc<RefCell<KeyState>> = wrapped_key.borrow();
-                    if Rc::ptr_eq(&state, &wrapped_key.0) {
-                        found = true;
-                    } else {
-                        seat::handle_release_key(
-                            layout,
-                            submission,
-                            Some(&ui_backend),
-                            time,
-                            Some(manager),
-                            key,
-                        );
-                    }
-                }
-                if !found {
-                    seat::handle_press_key(
-                        layout,
-                        submission,
-                        time,
-                        &state,
-                    );
-                    // maybe TODO: draw on the display buffer here
-                    unsafe {
-                        eek_gtk_keyboard_emit_feedback(ui_keyboard);
-                    }
-                }
-            } else {
-                for wrapped_key in pressed {
-                    let key: &Rc<RefCell<KeyState>> = wrapped_key.borrow();
-                    seat::handle_release_key(
-                        layout,
-                        submission,
-                        Some(&ui_backend),
-                        time,
-                        Some(manager),
-                        key,
-                    );
-                }
-            }
-            drawing::queue_redraw(ui_keyboard);
+            seat::handle_drag(
+                layout,
+                submission,
+                Some(&ui_backend),
+                time,
+                Some(manager),
+                point_id,
+                point,
+            );
         }
 
         #[cfg(test)]
@@ -391,18 +499,13 @@ pub mod c {
     }
 }
 
-pub struct ButtonPlace<'a> {
-    button: &'a Button,
-    offset: c::Point,
-}
-
-#[derive(Debug, Clone, PartialEq)]
+#[derive(Debug, Clone, Copy, PartialEq)]
 pub struct Size {
     pub width: f64,
     pub height: f64,
 }
 
-#[derive(Debug, Clone, PartialEq)]
+#[derive(Debug, Clone, PartialEq, Eq, Hash)]
 pub enum Label {
     /// Text used to display the symbol
     Text(CString),
@@ -420,17 +523,8 @@ pub struct Button {
     pub size: Size,
     /// The name of the visual class applied
     pub outline_name: CString,
-    /// current state, shared with other buttons
-    pub state: Rc<RefCell<KeyState>>,
-}
-
-impl Button {
-    pub fn get_bounds(&self) -> c::Bounds {
-        c::Bounds {
-            x: 0.0, y: 0.0,
-            width: self.size.width, height: self.size.height,
-        }
-    }
+    /// The key in `LayoutData::keys`, shared with other buttons
+    pub key: KeyStateId,
 }
 
 /// The graphical representation of a row of buttons
@@ -474,24 +568,6 @@ impl Row {
     pub fn get_buttons(&self) -> &Vec<(f64, Box<Button>)> {
         &self.buttons
     }
-
-    /// Finds the first button that covers the specified point
-    /// relative to row's position's origin
-    fn find_button_by_position(&self, x: f64) -> &(f64, Box<Button>)
-    {
-        // Buttons are sorted so we can use a binary search to find the clicked
-        // button. Note this doesn't check whether the point is actually within
-        // a button. This is on purpose as we want a click past the left edge of
-        // the left-most button to register as a click.
-        let result = self.buttons.binary_search_by(
-            |&(f, _)| f.partial_cmp(&x).unwrap()
-        );
-
-        let index = result.unwrap_or_else(|r| r);
-        let index = if index > 0 { index - 1 } else { 0 };
-
-        &self.buttons[index]
-    }
 }
 
 #[derive(Clone, Debug)]
@@ -540,39 +616,6 @@ impl View {
 
         View { rows, size: Size { width, height } }
     }
-    /// Finds the first button that covers the specified point
-    /// relative to view's position's origin
-    fn find_button_by_position(&self, point: c::Point)
-        -> Option<ButtonPlace>
-    {
-        // Only test bounds of the view here, letting rows/column search extend
-        // to the edges of these bounds.
-        let bounds = c::Bounds {
-            x: 0.0,
-            y: 0.0,
-            width: self.size.width,
-            height: self.size.height,
-        };
-        if !bounds.contains(&point) {
-            return None;
-        }
-
-        // Rows are sorted so we can use a binary search to find the row.
-        let result = self.rows.binary_search_by(
-            |(f, _)| f.y.partial_cmp(&point.y).unwrap()
-        );
-
-        let index = result.unwrap_or_else(|r| r);
-        let index = if index > 0 { index - 1 } else { 0 };
-
-        let row = &self.rows[index];
-        let button = row.1.find_button_by_position(point.x - row.0.x);
-
-        Some(ButtonPlace {
-            button: &button.1,
-            offset: &row.0 + c::Point { x: button.0, y: 0.0 },
-        })
-    }
     
     pub fn get_size(&self) -> Size {
         self.size.clone()
@@ -599,6 +642,337 @@ impl View {
     }
 }
 
+/// The buttons of all views of a layout, one table per property.
+/// A button is an index, valid in each of the per-button tables.
+/// Strings repeat a lot between buttons and views,
+/// so buttons refer to them by their index in the pools.
+#[derive(Default)]
+pub struct ButtonTable {
+    /// Top left corners, relative to the layout's origin
+    pub positions: Vec<c::Point>,
+    pub sizes: Vec<Size>,
+    /// Indices into `names`
+    pub name_ids: Vec<usize>,
+    /// Indices into `labels`
+    pub label_ids: Vec<usize>,
+    /// Indices into `outline_names`
+    pub outline_ids: Vec<usize>,
+    /// Indices into `Layout::keys`
+    pub keys: Vec<KeyStateId>,
+
+    /// ID strings, e.g. for CSS
+    pub names: Vec<CString>,
+    /// Labels to display to the user
+    pub labels: Vec<Label>,
+    /// Names of the visual classes applied
+    pub outline_names: Vec<CString>,
+}
+
+impl ButtonTable {
+    pub fn len(&self) -> usize {
+        self.positions.len()
+    }
+
+    /// Relative to the layout's origin
+    pub fn get_bounds(&self, button: usize) -> c::Bounds {
+        let position = &self.positions[button];
+        let size = &self.sizes[button];
+        c::Bounds {
+            x: position.x, y: position.y,
+            width: size.width, height: size.height,
+        }
+    }
+
+    pub fn get_name(&self, button: usize) -> &CString {
+        &self.names[self.name_ids[button]]
+    }
+
+    pub fn get_label(&self, button: usize) -> &Label {
+        &self.labels[self.label_ids[button]]
+    }
+
+    pub fn get_outline_name(&self, button: usize) -> &CString {
+        &self.outline_names[self.outline_ids[button]]
+    }
+}
+
+/// Returns the index of the value in the pool, adding it when missing
+fn intern<T: Clone + Eq + Hash>(
+    pool: &mut Vec<T>,
+    indices: &mut HashMap<T, usize>,
+    value: &T,
+) -> usize {
+    if let Some(index) = indices.get(value) {
+        return *index;
+    }
+    let index = pool.len();
+    pool.push(value.clone());
+    indices.insert(value.clone(), index);
+    index
+}
+
+/// Squared distance from the point to the closest point of the bounds
+fn distance_sq(bounds: &c::Bounds, point: &c::Point) -> f64 {
+    let dx = (bounds.x - point.x)
+        .max(point.x - (bounds.x + bounds.width))
+        .max(0.0);
+    let dy = (bounds.y - point.y)
+        .max(point.y - (bounds.y + bounds.height))
+        .max(0.0);
+    dx * dx + dy * dy
+}
+
+/// Squared distance between the closest points of two bounds
+fn bounds_distance_sq(a: &c::Bounds, b: &c::Bounds) -> f64 {
+    let dx = (b.x - (a.x + a.width))
+        .max(a.x - (b.x + b.width))
+        .max(0.0);
+    let dy = (b.y - (a.y + a.height))
+        .max(a.y - (b.y + b.height))
+        .max(0.0);
+    dx * dx + dy * dy
+}
+
+/// Squared distance from the point of `area` furthest away from `bounds`
+/// to the closest point of `bounds`.
+fn farthest_distance_sq(area: &c::Bounds, bounds: &c::Bounds) -> f64 {
+    // Distance to a rectangle is convex, so it peaks in a corner.
+    let corners = [
+        c::Point { x: area.x, y: area.y },
+        c::Point { x: area.x + area.width, y: area.y },
+        c::Point { x: area.x, y: area.y + area.height },
+        c::Point { x: area.x + area.width, y: area.y + area.height },
+    ];
+    corners.iter()
+        .map(|corner| distance_sq(bounds, corner))
+        .fold(0.0, f64::max)
+}
+
+/// Uniform grid over a view,
+/// listing for each cell the buttons which can be the nearest one
+/// to some point inside the cell.
+/// Buttons don't need to be aligned in rows, and may overlap.
+#[derive(Clone, Debug)]
+struct HitGrid {
+    /// Top left corner of the view
+    origin: c::Point,
+    columns: usize,
+    rows: usize,
+    /// Cells per layout unit
+    column_scale: f64,
+    row_scale: f64,
+    /// Touches further away than this from any button miss
+    margin_sq: f64,
+    /// Candidates of cell `i` are `candidates[cell_starts[i]..cell_starts[i + 1]]`,
+    /// cells going row by row.
+    cell_starts: Vec<u32>,
+    /// Button indices, ascending within each cell
+    candidates: Vec<u32>,
+}
+
+impl HitGrid {
+    /// Upper limit on cells along each axis,
+    /// to keep views with tiny buttons from taking up lots of memory.
+    const MAX_CELLS: usize = 64;
+
+    fn new(
+        bounds: &c::Bounds,
+        buttons: &ButtonTable,
+        view_buttons: Range<usize>,
+        margin: f64,
+    ) -> HitGrid {
+        let smallest_size = view_buttons.clone()
+            .map(|button| &buttons.sizes[button])
+            .fold(
+                (std::f64::INFINITY, std::f64::INFINITY),
+                |(width, height), size| (
+                    if size.width > 0.0 { width.min(size.width) } else { width },
+                    if size.height > 0.0 { height.min(size.height) } else { height },
+                ),
+            );
+        // With cells half as big as the smallest button,
+        // a cell rarely has more than a handful of candidates.
+        let cell_count = |extent: f64, smallest: f64| {
+            let count = (extent * 2.0 / smallest).ceil() as usize;
+            cmp::max(1, cmp::min(count, HitGrid::MAX_CELLS))
+        };
+        let columns = cell_count(bounds.width, smallest_size.0);
+        let rows = cell_count(bounds.height, smallest_size.1);
+        let cell_width = bounds.width / columns as f64;
+        let cell_height = bounds.height / rows as f64;
+
+        let button_bounds: Vec<c::Bounds> = view_buttons.clone()
+            .map(|button| buttons.get_bounds(button))
+            .collect();
+        let margin_sq = margin * margin;
+
+        let mut cell_starts = Vec::with_capacity(columns * rows + 1);
+        let mut candidates = Vec::new();
+        cell_starts.push(0);
+        for row in 0..rows {
+            for column in 0..columns {
+                let cell = c::Bounds {
+                    x: bounds.x + column as f64 * cell_width,
+                    y: bounds.y + row as f64 * cell_height,
+                    width: cell_width,
+                    height: cell_height,
+                };
+                // Every point of the cell is at most this far
+                // from its nearest button,
+                // so buttons further away from the entire cell
+                // can't be the nearest to any point in it.
+                let reach = button_bounds.iter()
+                    .map(|b| farthest_distance_sq(&cell, b))
+                    .fold(margin_sq, f64::min);
+                for (button, b) in view_buttons.clone().zip(&button_bounds) {
+                    if bounds_distance_sq(&cell, b) <= reach {
+                        candidates.push(button as u32);
+                    }
+                }
+                cell_starts.push(candidates.len() as u32);
+            }
+        }
+
+        HitGrid {
+            origin: c::Point { x: bounds.x, y: bounds.y },
+            columns,
+            rows,
+            column_scale: if cell_width > 0.0 { 1.0 / cell_width } else { 0.0 },
+            row_scale: if cell_height > 0.0 { 1.0 / cell_height } else { 0.0 },
+            margin_sq,
+            cell_starts,
+            candidates,
+        }
+    }
+
+    /// Returns the cell containing a point inside the view
+    fn get_cell(&self, x: f64, y: f64) -> usize {
+        let column = cmp::min(
+            ((x - self.origin.x) * self.column_scale) as usize,
+            self.columns - 1,
+        );
+        let row = cmp::min(
+            ((y - self.origin.y) * self.row_scale) as usize,
+            self.rows - 1,
+        );
+        row * self.columns + column
+    }
+
+    /// Finds the button nearest to a point inside the view.
+    /// Where buttons overlap, the one drawn last wins.
+    /// Equally distant buttons resolve to the one drawn first.
+    fn find_button(&self, buttons: &ButtonTable, point: &c::Point)
+        -> Option<usize>
+    {
+        self.find_button_in_cell(buttons, self.get_cell(point.x, point.y), point)
+    }
+
+    fn find_button_in_cell(
+        &self,
+        buttons: &ButtonTable,
+        cell: usize,
+        point: &c::Point,
+    ) -> Option<usize> {
+        let cell_candidates = &self.candidates[
+            self.cell_starts[cell] as usize..self.cell_starts[cell + 1] as usize
+        ];
+
+        let mut found = None;
+        let mut nearest = self.margin_sq;
+        for candidate in cell_candidates {
+            let candidate = *candidate as usize;
+            let distance = distance_sq(&buttons.get_bounds(candidate), point);
+            let better = match found {
+                None => distance <= nearest,
+                // Candidates are sorted by drawing order
+                Some(_) => distance < nearest || distance == 0.0,
+            };
+            if better {
+                found = Some(candidate);
+                nearest = distance;
+            }
+        }
+        found
+    }
+}
+
+/// A view whose buttons are a contiguous range of the `ButtonTable`,
+/// stored row by row.
+#[derive(Clone, Debug)]
+pub struct ViewSpan {
+    /// Relative to the layout's origin
+    bounds: c::Bounds,
+    pub buttons: Range<usize>,
+    grid: HitGrid,
+}
+
+impl ViewSpan {
+    pub fn get_size(&self) -> Size {
+        Size { width: self.bounds.width, height: self.bounds.height }
+    }
+
+    /// Finds the button that covers the specified point
+    /// relative to the layout's origin
+    fn find_button_by_position(&self, buttons: &ButtonTable, point: &c::Point)
+        -> Option<usize>
+    {
+        // Only test bounds of the view here,
+        // letting the nearest button extend to the edges of these bounds.
+        if !self.bounds.contains(point) {
+            return None;
+        }
+        self.grid.find_button(buttons, point)
+    }
+
+    /// Like `find_button_by_position`, for many points at once.
+    /// The points are in widget coordinates.
+    fn find_buttons_by_positions<F: FnMut(usize, Option<usize>)>(
+        &self,
+        buttons: &ButtonTable,
+        widget_to_layout: &c::Transformation,
+        points: &[c::Point],
+        mut found: F,
+    ) {
+        // Fixed-size scratch space, to keep the arrays on the stack
+        const CHUNK: usize = 64;
+        // Marks points outside the view
+        const NO_CELL: usize = std::usize::MAX;
+
+        let bounds = &self.bounds;
+        let (right, bottom) = (bounds.x + bounds.width, bounds.y + bounds.height);
+        for (chunk, points) in points.chunks(CHUNK).enumerate() {
+            let mut xs = [0.0; CHUNK];
+            let mut ys = [0.0; CHUNK];
+            let mut cells = [0; CHUNK];
+            // The first passes are straight arithmetic over arrays,
+            // with no early exits, so that they can get vectorized.
+            // The same formula as `Transformation::forward`
+            // keeps the results equal to those of single lookups.
+            for (i, point) in points.iter().enumerate() {
+                xs[i] = (point.x - widget_to_layout.origin_x) / widget_to_layout.scale;
+                ys[i] = (point.y - widget_to_layout.origin_y) / widget_to_layout.scale;
+            }
+            for i in 0..points.len() {
+                let (x, y) = (xs[i], ys[i]);
+                let inside = (x > bounds.x) & (x < right)
+                    & (y > bounds.y) & (y < bottom);
+                cells[i] = if inside { self.grid.get_cell(x, y) } else { NO_CELL };
+            }
+            for i in 0..points.len() {
+                let button = match cells[i] {
+                    NO_CELL => None,
+                    cell => self.grid.find_button_in_cell(
+                        buttons,
+                        cell,
+                        &c::Point { x: xs[i], y: ys[i] },
+                    ),
+                };
+                found(chunk * CHUNK + i, button);
+            }
+        }
+    }
+}
+
 /// The physical characteristic of layout for the purpose of styling
 #[derive(Clone, Copy, PartialEq, Debug)]
 pub enum ArrangementKind {
@@ -606,7 +980,7 @@ pub enum ArrangementKind {
     Wide = 1,
 }
 
-#[derive(Debug, PartialEq)]
+#[derive(Clone, Debug, PartialEq)]
 pub struct Margins {
     pub top: f64,
     pub bottom: f64,
@@ -614,52 +988,140 @@ pub struct Margins {
     pub right: f64,
 }
 
-#[derive(Clone, Debug, PartialEq)]
+#[derive(Clone, Copy, Debug, PartialEq)]
 pub enum LatchedState {
     /// Holds view to return to.
-    FromView(String),
+    FromView(ViewId),
     Not,
 }
 
+/// Identifies an input point, like a finger, or the mouse.
+/// Each point can hold down one key at a time.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub struct PointId(pub usize);
+
+/// A transformation, and what it was calculated for
+#[derive(Clone, Copy)]
+struct CachedTransformation {
+    available: Size,
+    /// Device pixels per widget pixel, if snapped
+    scale_factor: Option<u32>,
+    transformation: c::Transformation,
+}
+
 // TODO: split into sth like
 // Arrangement (views) + details (keymap) + State (keys)
 /// State of the UI, contains the backend as well
 pub struct Layout {
     pub margins: Margins,
     pub kind: ArrangementKind,
-    pub current_view: String,
+    pub current_view: ViewId,
 
     // If current view is latched,
     // clicking any button that emits an action (erase, submit, set modifier)
     // will cause lock buttons to unlatch.
     view_latched: LatchedState,
 
-    // Views own the actual buttons which have state
-    // Maybe they should own UI only,
-    // and keys should be owned by a dedicated non-UI-State?
-    /// Point is the offset within the layout
-    pub views: HashMap<String, (c::Point, View)>,
+    /// Buttons of all views
+    pub buttons: ButtonTable,
+    /// Indexed by `ViewId`
+    views: Vec<ViewSpan>,
+    /// Size of the largest view, including margins.
+    /// Views don't change, so this doesn't either.
+    size: Size,
+    /// The last transformation calculated.
+    /// The allocation changes rarely, so one is enough.
+    transformation: Cell<Option<CachedTransformation>>,
 
     // Non-UI stuff
     /// xkb keymaps applicable to the contained keys. Unchangeable
     pub keymaps: Vec<CString>,
     // Changeable state
-    // a Vec would be enough, but who cares, this will be small & fast enough
-    // TODO: turn those into per-input point *_buttons to track dragging.
+    /// State of every key, indexed by `KeyStateId`
+    pub keys: Vec<KeyState>,
+    /// Keys held down, each by a different input point.
+    /// A key is held by one point at most.
     // The renderer doesn't need the list of pressed keys any more,
     // because it needs to iterate
     // through all buttons of the current view anyway.
     // When the list tracks actual location,
     // it becomes possible to place popovers and other UI accurately.
-    pub pressed_keys: HashSet<::util::Pointer<RefCell<KeyState>>>,
+    pub pressed_keys: Vec<(PointId, KeyStateId)>,
+    /// The path of the point which slid off a letter key
+    swipe: Option<Swipe>,
+}
+
+/// A path which starts on a letter key
+/// and becomes a gesture once it reaches far enough.
+struct Swipe {
+    point: PointId,
+    /// The letter key the path started on
+    start: KeyStateId,
+    /// Center of the start key
+    origin: c::Point,
+    /// How far from the origin a tap can slip, about a key width
+    reach: f64,
+    gesture: swipe::Gesture,
+    state: SwipeState,
+}
+
+enum SwipeState {
+    /// Too short to tell apart from a tap which slipped.
+    /// Holds the key under the point.
+    Drifting(Option<KeyStateId>),
+    /// Keys don't get pressed along the way.
+    Drawing,
+}
+
+impl Swipe {
+    fn new(
+        point: PointId,
+        start: KeyStateId,
+        letter: char,
+        bounds: c::Bounds,
+    ) -> Swipe {
+        let origin = c::Point {
+            x: bounds.x + bounds.width / 2.0,
+            y: bounds.y + bounds.height / 2.0,
+        };
+        Swipe {
+            point,
+            start,
+            origin: origin.clone(),
+            reach: bounds.width,
+            gesture: swipe::Gesture::new(letter, origin),
+            state: SwipeState::Drifting(Some(start)),
+        }
+    }
+
+    /// Extends the path to `point`, which is over `key`.
+    /// Leaving the keys or the reach turns the path into a gesture.
+    fn drag(&mut self, point: c::Point, key: Option<KeyStateId>) {
+        let (dx, dy) = (point.x - self.origin.x, point.y - self.origin.y);
+        let within_reach = dx * dx + dy * dy < self.reach * self.reach;
+        self.gesture.push(point);
+        if let SwipeState::Drifting(_) = self.state {
+            self.state = match key {
+                Some(key) if within_reach => SwipeState::Drifting(Some(key)),
+                _ => SwipeState::Drawing,
+            };
+        }
+    }
 }
 
 /// A builder structure for picking up layout data from storage
+#[derive(Clone)]
 pub struct LayoutData {
+    /// Named views, indexed by `ViewId`.
     /// Point is the offset within layout
-    pub views: HashMap<String, (c::Point, View)>,
+    pub views: Vec<(String, (c::Point, View))>,
+    /// Referred to by `Button::key`
+    pub keys: Vec<KeyState>,
     pub keymaps: Vec<CString>,
     pub margins: Margins,
+    /// How far from the nearest button a touch still activates it.
+    /// Infinite to cover the entire view.
+    pub touch_margin: f64,
 }
 
 #[derive(Debug)]
@@ -673,32 +1135,156 @@ impl fmt::Display for NoSuchView {
 
 // Unfortunately, changes are not atomic due to mutability :(
 // An error will not be recoverable
-// The usage of &mut on Rc<RefCell<KeyState>> doesn't mean anything special.
-// Cloning could also be used.
 impl Layout {
     pub fn new(data: LayoutData, kind: ArrangementKind) -> Layout {
+        let mut buttons = ButtonTable::default();
+        let mut name_indices = HashMap::new();
+        let mut label_indices = HashMap::new();
+        let mut outline_indices = HashMap::new();
+
+        // Names are only needed to find the starting view.
+        // Everything else refers to views by index.
+        let base_view = data.views.iter()
+            .position(|(name, _)| name == "base")
+            .unwrap_or_else(|| {
+                log_print!(logging::Level::Warning, "No base view in layout");
+                0
+            });
+
+        let mut view_spans = Vec::with_capacity(data.views.len());
+        for (_name, (view_offset, view)) in data.views {
+            let view_start = buttons.len();
+            for (row_offset, row) in &view.rows {
+                for (x_offset, button) in &row.buttons {
+                    buttons.positions.push(
+                        &view_offset
+                            + row_offset.clone()
+                            + c::Point { x: *x_offset, y: 0.0 }
+                    );
+                    buttons.sizes.push(button.size.clone());
+                    buttons.name_ids.push(
+                        intern(&mut buttons.names, &mut name_indices, &button.name)
+                    );
+                    buttons.label_ids.push(
+                        intern(&mut buttons.labels, &mut label_indices, &button.label)
+                    );
+                    buttons.outline_ids.push(intern(
+                        &mut buttons.outline_names,
+                        &mut outline_indices,
+                        &button.outline_name,
+                    ));
+                    buttons.keys.push(button.key);
+                }
+            }
+            let bounds = c::Bounds {
+                x: view_offset.x,
+                y: view_offset.y,
+                width: view.size.width,
+                height: view.size.height,
+            };
+            let view_buttons = view_start..buttons.len();
+            view_spans.push(ViewSpan {
+                grid: HitGrid::new(
+                    &bounds,
+                    &buttons,
+                    view_buttons.clone(),
+                    data.touch_margin,
+                ),
+                bounds,
+                buttons: view_buttons,
+            });
+        }
+
+        let inner_size = Layout::calculate_inner_size(&view_spans);
+        let size = Size {
+            width: data.margins.left + inner_size.width + data.margins.right,
+            height: (
+                data.margins.top
+                + inner_size.height
+                + data.margins.bottom
+            ),
+        };
+
         Layout {
             kind,
-            current_view: "base".to_owned(),
+            current_view: ViewId(base_view),
             view_latched: LatchedState::Not,
-            views: data.views,
+            buttons,
+            views: view_spans,
+            size,
+            transformation: Cell::new(None),
             keymaps: data.keymaps,
-            pressed_keys: HashSet::new(),
+            keys: data.keys,
+            pressed_keys: Vec::new(),
+            swipe: None,
             margins: data.margins,
         }
     }
 
-    pub fn get_current_view_position(&self) -> &(c::Point, View) {
-        &self.views
-            .get(&self.current_view).expect("Selected nonexistent view")
+    pub fn get_current_view(&self) -> &ViewSpan {
+        &self.views[self.current_view.0]
+    }
+
+    /// Whether the view is one of this layout's
+    pub fn has_view(&self, view: &ViewSpan) -> bool {
+        self.views.iter()
+            .any(|v| v as *const ViewSpan == view as *const ViewSpan)
+    }
+
+    /// Whether the input point draws the current swipe
+    fn is_swiping(&self, point: PointId) -> bool {
+        self.swipe.as_ref()
+            .map(|swipe| swipe.point == point)
+            .unwrap_or(false)
+    }
+
+    /// The key held down by the input point
+    fn get_point_key(&self, point: PointId) -> Option<KeyStateId> {
+        self.pressed_keys.iter()
+            .find(|(p, _)| *p == point)
+            .map(|(_, key)| *key)
+    }
+
+    /// The input point holding the key down
+    fn get_key_point(&self, key: KeyStateId) -> Option<PointId> {
+        self.pressed_keys.iter()
+            .find(|(_, k)| *k == key)
+            .map(|(point, _)| *point)
+    }
+
+    /// State of the key the button belongs to
+    pub fn get_button_key(&self, button: usize) -> &KeyState {
+        &self.keys[self.buttons.keys[button].0]
+    }
+
+    /// The letter the key types, if it types a single one
+    fn get_key_letter(&self, key: KeyStateId) -> Option<char> {
+        match &self.keys[key.0].action {
+            Action::Submit { text: Some(text), .. } => {
+                let mut chars = text.to_str().ok()?.chars();
+                match (chars.next(), chars.next()) {
+                    (Some(c), None) if c.is_alphabetic() => Some(c),
+                    _ => None,
+                }
+            },
+            _ => None,
+        }
     }
 
-    pub fn get_current_view(&self) -> &View {
-        &self.views.get(&self.current_view).expect("Selected nonexistent view").1
+    /// Letter keys of the current view
+    pub fn get_letter_keys(&self) -> swipe::KeyCenters {
+        swipe::KeyCenters::new(
+            self.get_current_view().buttons.clone()
+                .filter_map(|button| {
+                    self.get_key_letter(self.buttons.keys[button])
+                        .map(|c| (c, self.buttons.get_bounds(button)))
+                })
+                .collect()
+        )
     }
 
-    fn set_view(&mut self, view: String) -> Result<(), NoSuchView> {
-        if self.views.contains_key(&view) {
+    fn set_view(&mut self, view: ViewId) -> Result<(), NoSuchView> {
+        if view.0 < self.views.len() {
             self.current_view = view;
             Ok(())
         } else {
@@ -713,93 +1299,202 @@ impl Layout {
     }
 
     /// Calculates size without margins
-    fn calculate_inner_size(&self) -> Size {
-        View::calculate_super_size(
-            self.views.iter().map(|(_, (_offset, v))| v).collect()
-        )
-    }
-
-    /// Size including margins
-    fn calculate_size(&self) -> Size {
-        let inner_size = self.calculate_inner_size();
+    fn calculate_inner_size(views: &[ViewSpan]) -> Size {
         Size {
-            width: self.margins.left + inner_size.width + self.margins.right,
-            height: (
-                self.margins.top
-                + inner_size.height
-                + self.margins.bottom
+            height: find_max_double(
+                views.iter(),
+                |view| view.bounds.height,
+            ),
+            width: find_max_double(
+                views.iter(),
+                |view| view.bounds.width,
             ),
         }
     }
-    
+
+    /// Size including margins
+    fn get_size(&self) -> Size {
+        self.size
+    }
+
     pub fn calculate_transformation(
         &self,
         available: Size,
     ) -> c::Transformation {
-        let size = self.calculate_size();
+        self.get_transformation(available, None)
+    }
+
+    /// Like `calculate_transformation`,
+    /// but the layout's origin lands on a device pixel,
+    /// and the layout spans whole device pixels
+    /// along the axis which limits its size.
+    /// Buttons which are whole device pixels away from the origin
+    /// then don't get blurred by antialiasing.
+    pub fn calculate_snapped_transformation(
+        &self,
+        available: Size,
+        scale_factor: u32,
+    ) -> c::Transformation {
+        self.get_transformation(available, Some(cmp::max(scale_factor, 1)))
+    }
+
+    fn get_transformation(
+        &self,
+        available: Size,
+        scale_factor: Option<u32>,
+    ) -> c::Transformation {
+        if let Some(cached) = self.transformation.get() {
+            if cached.available == available
+                && cached.scale_factor == scale_factor
+            {
+                return cached.transformation;
+            }
+        }
+        let transformation = self.fit(&available, scale_factor);
+        self.transformation.set(Some(CachedTransformation {
+            available,
+            scale_factor,
+            transformation,
+        }));
+        transformation
+    }
+
+    fn fit(
+        &self,
+        available: &Size,
+        scale_factor: Option<u32>,
+    ) -> c::Transformation {
+        let size = &self.size;
         let h_scale = available.width / size.width;
         let v_scale = available.height / size.height;
-        let scale = if h_scale < v_scale { h_scale } else { v_scale };
+        let (scale, extent) = if h_scale < v_scale {
+            (h_scale, size.width)
+        } else {
+            (v_scale, size.height)
+        };
+        let scale = match scale_factor {
+            Some(factor) => {
+                let device_extent = extent * factor as f64;
+                let snapped = (scale * device_extent).floor() / device_extent;
+                // Don't let tiny allocations collapse the layout
+                if snapped > 0.0 { snapped } else { scale }
+            },
+            None => scale,
+        };
         let outside_margins = c::Transformation {
             origin_x: (available.width - (scale * size.width)) / 2.0,
             origin_y: (available.height - (scale * size.height)) / 2.0,
             scale: scale,
         };
-        outside_margins.chain(c::Transformation {
+        let transformation = outside_margins.chain(c::Transformation {
             origin_x: self.margins.left,
             origin_y: self.margins.top,
             scale: 1.0,
-        })
+        });
+        match scale_factor {
+            Some(factor) => {
+                let factor = factor as f64;
+                c::Transformation {
+                    origin_x: (transformation.origin_x * factor).round() / factor,
+                    origin_y: (transformation.origin_y * factor).round() / factor,
+                    ..transformation
+                }
+            },
+            None => transformation,
+        }
     }
 
-    fn find_button_by_position(&self, point: c::Point) -> Option<ButtonPlace> {
-        let (offset, layout) = self.get_current_view_position();
-        layout.find_button_by_position(point - offset)
+    /// Returns the button in the current view
+    fn find_button_by_position(&self, point: c::Point) -> Option<usize> {
+        self.get_current_view().find_button_by_position(&self.buttons, &point)
+    }
+
+    /// Finds the buttons of the current view under each of the points,
+    /// given in widget coordinates.
+    /// `found` gets called with the index of each point and its button.
+    pub fn find_buttons_by_positions<F: FnMut(usize, Option<usize>)>(
+        &self,
+        widget_to_layout: &c::Transformation,
+        points: &[c::Point],
+        found: F,
+    ) {
+        self.get_current_view().find_buttons_by_positions(
+            &self.buttons,
+            widget_to_layout,
+            points,
+            found,
+        )
     }
 
-    pub fn foreach_visible_button<F>(&self, mut f: F)
-        where F: FnMut(c::Point, &Box<Button>)
+    /// Returns the bounds of the buttons of the key in the current view,
+    /// relative to the layout's origin.
+    fn get_key_bounds<'a>(&'a self, key: KeyStateId)
+        -> impl Iterator<Item=c::Bounds> + 'a
     {
-        let (view_offset, view) = self.get_current_view_position();
-        for (row_offset, row) in view.get_rows() {
-            for (x_offset, button) in &row.buttons {
-                let offset = view_offset
-                    + row_offset.clone()
-                    + c::Point { x: *x_offset, y: 0.0 };
-                f(offset, button);
+        let buttons = &self.buttons;
+        self.get_current_view().buttons.clone()
+            .filter(move |button| buttons.keys[*button] == key)
+            .map(move |button| buttons.get_bounds(button))
+    }
+
+    /// Returns the views, other than the current one,
+    /// which buttons of the current view switch to.
+    pub fn get_reachable_views(&self) -> Vec<&ViewSpan> {
+        let mut ids = Vec::new();
+        for button in self.get_current_view().buttons.clone() {
+            match &self.get_button_key(button).action {
+                Action::SetView(view) => ids.push(*view),
+                Action::LockView { lock, unlock, .. } => {
+                    ids.push(*lock);
+                    ids.push(*unlock);
+                },
+                _ => {},
             }
         }
+        ids.sort();
+        ids.dedup();
+        ids.into_iter()
+            .filter(|view| *view != self.current_view)
+            .filter_map(|view| self.views.get(view.0))
+            .collect()
     }
     
+    /// Applies the action of the key to the view.
+    /// Returns whether the view or its latched state changed,
+    /// which affects the appearance of more than the activated button.
     fn apply_view_transition(
         &mut self,
-        action: &Action,
-    ) {
+        key: KeyStateId,
+    ) -> bool {
         let (transition, new_latched) = Layout::process_action_for_view(
-            action,
-            &self.current_view,
+            &self.keys[key.0].action,
+            self.current_view,
             &self.view_latched,
         );
 
+        let changed = transition != ViewTransition::NoChange
+            || new_latched != self.view_latched;
+
         match transition {
             ViewTransition::UnlatchAll => self.unstick_locks(),
-            ViewTransition::ChangeTo(view) => try_set_view(self, view.into()),
+            ViewTransition::ChangeTo(view) => try_set_view(self, view),
             ViewTransition::NoChange => {},
         };
 
         self.view_latched = new_latched;
+        changed
     }
 
     /// Unlatch all latched keys,
     /// so that the new view is the one before first press.
     fn unstick_locks(&mut self) {
-        if let LatchedState::FromView(name) = self.view_latched.clone() {
-            match self.set_view(name.clone()) {
+        if let LatchedState::FromView(view) = self.view_latched {
+            match self.set_view(view) {
                 Ok(_) => { self.view_latched = LatchedState::Not; }
                 Err(e) => log_print!(
                     logging::Level::Bug,
-                    "Bad view {}, can't unlatch ({:?})",
-                    name,
+                    "Bad view {:?}, can't unlatch ({:?})",
+                    view,
                     e,
                 ),
             }
@@ -815,11 +1510,11 @@ impl Layout {
     /// keys go through the following stages when clicked repeatedly: 
     /// unlocked+unlatched -> locked+latched -> locked+unlatched
     /// -> unlocked+unlatched
-    fn process_action_for_view<'a>(
-        action: &'a Action,
-        current_view: &str,
+    fn process_action_for_view(
+        action: &Action,
+        current_view: ViewId,
         latched: &LatchedState,
-    ) -> (ViewTransition<'a>, LatchedState) {
+    ) -> (ViewTransition, LatchedState) {
         match action {
             Action::Submit { text: _, keys: _ }
                 | Action::Erase
@@ -832,7 +1527,7 @@ impl Layout {
                 (t, LatchedState::Not)
             },
             Action::SetView(view) => (
-                ViewTransition::ChangeTo(view),
+                ViewTransition::ChangeTo(*view),
                 LatchedState::Not,
             ),
             Action::LockView { lock, unlock, latches, looks_locked_from: _ } => {
@@ -841,70 +1536,61 @@ impl Layout {
                 match (locked, latched, latches) {
                     // Was unlocked, now make locked but latched.
                     (false, LatchedState::Not, true) => (
-                        VT::ChangeTo(lock),
-                        LatchedState::FromView(current_view.into()),
+                        VT::ChangeTo(*lock),
+                        LatchedState::FromView(current_view),
                     ),
                     // Layout is latched for reason other than this button.
                     (false, LatchedState::FromView(view), true) => (
-                        VT::ChangeTo(lock),
-                        LatchedState::FromView(view.clone()),
+                        VT::ChangeTo(*lock),
+                        LatchedState::FromView(*view),
                     ),
                     // Was latched, now only locked.
                     (true, LatchedState::FromView(_), true)
                         => (VT::NoChange, LatchedState::Not),
                     // Was unlocked, can't latch so now make fully locked.
                     (false, _, false)
-                        => (VT::ChangeTo(lock), LatchedState::Not),
+                        => (VT::ChangeTo(*lock), LatchedState::Not),
                     // Was locked, now make unlocked.
                     (true, _, _)
-                        => (VT::ChangeTo(unlock), LatchedState::Not),
+                        => (VT::ChangeTo(*unlock), LatchedState::Not),
                 }
             },
-            _ => (ViewTransition::NoChange, latched.clone()),
+            _ => (ViewTransition::NoChange, *latched),
         }
     }
 }
 
 #[derive(Debug, PartialEq)]
-enum ViewTransition<'a> {
-    ChangeTo(&'a str),
+enum ViewTransition {
+    ChangeTo(ViewId),
     UnlatchAll,
     NoChange,
 }
 
-fn try_set_view(layout: &mut Layout, view_name: &str) {
-    layout.set_view(view_name.into())
-        .or_print(
-            logging::Problem::Bug,
-            &format!("Bad view {}, ignoring", view_name),
+fn try_set_view(layout: &mut Layout, view: ViewId) {
+    if let Err(e) = layout.set_view(view) {
+        log_print!(
+            logging::Level::Bug,
+            "Bad view {:?}, ignoring ({:?})",
+            view,
+            e,
         );
+    }
 }
 
 
 mod procedures {
     use super::*;
 
-    type Place<'v> = (c::Point, &'v Box<Button>);
-
-    /// Finds all buttons referring to the key in `state`,
-    /// together with their offsets within the view.
-    pub fn find_key_places<'v, 's>(
-        view: &'v View,
-        state: &'s Rc<RefCell<KeyState>>
-    ) -> Vec<Place<'v>> {
-        view.get_rows().iter().flat_map(|(row_offset, row)| {
-            row.buttons.iter()
-                .filter_map(move |(x_offset, button)| {
-                    if Rc::ptr_eq(&button.state, state) {
-                        Some((
-                            row_offset + c::Point { x: *x_offset, y: 0.0 },
-                            button,
-                        ))
-                    } else {
-                        None
-                    }
-                })
-        }).collect()
+    /// Finds all buttons of the view referring to the key.
+    pub fn find_key_places(
+        buttons: &ButtonTable,
+        view: &ViewSpan,
+        key: KeyStateId,
+    ) -> Vec<usize> {
+        view.buttons.clone()
+            .filter(|button| buttons.keys[*button] == key)
+            .collect()
     }
     
     #[cfg(test)]
@@ -913,37 +1599,36 @@ mod procedures {
 
         use ::layout::test::*;
 
-        /// Checks whether the path points to the same boxed instances.
-        /// The instance constraint will be droppable
-        /// when C stops holding references to the data
         #[test]
         fn view_has_button() {
-            fn as_ptr<T>(v: &Box<T>) -> *const T {
-                v.as_ref() as *const T
-            }
-
-            let state = make_state();
-            let state_clone = state.clone();
-
-            let button = make_button_with_state("1".into(), state);
-            let button_ptr = as_ptr(&button);
-
+            let key = KeyStateId(0);
+            let button = make_button_with_state("1".into(), key);
             let row = Row::new(vec!((0.1, button)));
-
             let view = View::new(vec!((1.2, row)));
-
+            let layout = make_layout(vec![make_state()], vec![
+                ("base".into(), (c::Point { x: 0.0, y: 0.0 }, view)),
+            ]);
+
+            let places = find_key_places(
+                &layout.buttons,
+                layout.get_current_view(),
+                key,
+            );
+            assert_eq!(places, vec![0]);
             assert_eq!(
-                find_key_places(&view, &state_clone.clone()).into_iter()
-                    .map(|(place, button)| { (place, as_ptr(button)) })
-                    .collect::<Vec<_>>(),
-                vec!(
-                    (c::Point { x: 0.1, y: 1.2 }, button_ptr)
-                )
+                layout.buttons.positions[places[0]],
+                c::Point { x: 0.1, y: 1.2 },
             );
 
-            let view = View::new(vec![]);
+            let layout = make_layout(vec![make_state()], vec![
+                ("base".into(), (c::Point { x: 0.0, y: 0.0 }, View::new(vec![]))),
+            ]);
             assert_eq!(
-                find_key_places(&view, &state_clone.clone()).is_empty(),
+                find_key_places(
+                    &layout.buttons,
+                    layout.get_current_view(),
+                    key,
+                ).is_empty(),
                 true
             );
         }
@@ -955,33 +1640,70 @@ pub struct UIBackend {
     keyboard: c::EekGtkKeyboard,
 }
 
+impl UIBackend {
+    /// Redraws only the buttons of the key, in the current view
+    fn queue_redraw_key(&self, layout: &Layout, key: KeyStateId) {
+        for bounds in layout.get_key_bounds(key) {
+            drawing::queue_redraw_area(
+                self.keyboard,
+                self.widget_to_layout.reverse_bounds(bounds),
+            );
+        }
+    }
+}
+
 /// Top level procedures, dispatching to everything
 mod seat {
     use super::*;
 
+    /// Presses the key for the input point.
+    /// If another point holds the key already, it gets released first,
+    /// so that quickly repeated presses with different fingers
+    /// all get registered.
     pub fn handle_press_key(
         layout: &mut Layout,
         submission: &mut Submission,
+        ui: Option<&UIBackend>,
         time: Timestamp,
-        rckey: &Rc<RefCell<KeyState>>,
+        point: PointId,
+        key_id: KeyStateId,
     ) {
-        if !layout.pressed_keys.insert(::util::Pointer(rckey.clone())) {
+        if let Some(holder) = layout.get_key_point(key_id) {
             log_print!(
-                logging::Level::Bug,
-                "Key {:?} was already pressed", rckey,
+                logging::Level::Debug,
+                "Key {:?} taken over from {:?} by {:?}", key_id, holder, point,
             );
+            handle_release_key(layout, submission, ui, time, None, key_id);
         }
-        let key: KeyState = {
-            RefCell::borrow(rckey).clone()
-        };
-        let action = key.action.clone();
-        match action {
+        press_key(layout, submission, time, point, key_id);
+
+        if let Some(ui) = ui {
+            // maybe TODO: draw on the display buffer here
+            ui.queue_redraw_key(layout, key_id);
+            unsafe {
+                c::eek_gtk_keyboard_emit_feedback(ui.keyboard);
+            }
+        }
+    }
+
+    /// Changes the state and submits, without touching the UI.
+    /// Runs on every keystroke, so it must not allocate.
+    pub fn press_key(
+        layout: &mut Layout,
+        submission: &mut Submission,
+        time: Timestamp,
+        point: PointId,
+        key_id: KeyStateId,
+    ) {
+        layout.pressed_keys.push((point, key_id));
+        let key = &layout.keys[key_id.0];
+        match &key.action {
             Action::Submit {
                 text: Some(text),
                 keys: _,
             } => submission.handle_press(
-                KeyState::get_id(rckey),
-                SubmitData::Text(&text),
+                key_id,
+                SubmitData::Text(text),
                 &key.keycodes,
                 time,
             ),
@@ -989,20 +1711,20 @@ mod seat {
                 text: None,
                 keys: _,
             } => submission.handle_press(
-                KeyState::get_id(rckey),
+                key_id,
                 SubmitData::Keycodes,
                 &key.keycodes,
                 time,
             ),
             Action::Erase => submission.handle_press(
-                KeyState::get_id(rckey),
+                key_id,
                 SubmitData::Erase,
                 &key.keycodes,
                 time,
             ),
             _ => {},
         };
-        RefCell::replace(rckey, key.into_pressed());
+        layout.keys[key_id.0].pressed = PressType::Pressed;
     }
 
     pub fn handle_release_key(
@@ -1011,343 +1733,459 @@ mod seat {
         ui: Option<&UIBackend>,
         time: Timestamp,
         manager: Option<manager::c::Manager>,
-        rckey: &Rc<RefCell<KeyState>>,
+        key_id: KeyStateId,
     ) {
-        let key: KeyState = {
-            RefCell::borrow(rckey).clone()
-        };
-        let action = key.action.clone();
+        let redraw_all = release_key(layout, submission, time, key_id);
+
+        // only show when UI is present
+        if let Some(ui) = ui {
+            if let Action::ShowPreferences = layout.keys[key_id.0].action {
+                // only show when layout manager is available
+                if let Some(manager) = manager {
+                    // Getting first item will cause mispositioning
+                    // with more than one button with the same key
+                    // on the keyboard.
+                    if let Some(bounds) = layout.get_key_bounds(key_id).next() {
+                        ::popover::show(
+                            ui.keyboard,
+                            ui.widget_to_layout.reverse_bounds(bounds),
+                            manager,
+                        );
+                    }
+                }
+            }
+
+            match redraw_all {
+                true => drawing::queue_redraw(ui.keyboard),
+                false => ui.queue_redraw_key(layout, key_id),
+            }
+        }
+    }
+
+    /// Moves the input point to `position`,
+    /// releasing the key it left and pressing the key it entered.
+    /// Sliding off a letter key starts a swipe instead, when available.
+    pub fn handle_drag(
+        layout: &mut Layout,
+        submission: &mut Submission,
+        ui: Option<&UIBackend>,
+        time: Timestamp,
+        manager: Option<manager::c::Manager>,
+        point: PointId,
+        position: c::Point,
+    ) {
+        let key = layout.find_button_by_position(position.clone())
+            .map(|button| layout.buttons.keys[button]);
+
+        if let Some(ref mut swipe) = layout.swipe {
+            if swipe.point == point {
+                swipe.drag(position, key);
+                return;
+            }
+        }
+
+        let held = layout.get_point_key(point);
+        if held == key {
+            return;
+        }
+        if let Some(held) = held {
+            // The letter got submitted already.
+            // Releasing may change views, so look at the key first.
+            let swipe_start = match (&layout.swipe, submission.is_swipe_available()) {
+                (None, true) => layout.get_key_letter(held)
+                    .and_then(|letter| {
+                        layout.get_key_bounds(held).next()
+                            .map(|bounds| Swipe::new(point, held, letter, bounds))
+                    }),
+                _ => None,
+            };
+            handle_release_key(layout, submission, ui, time, manager, held);
+            if let Some(mut swipe) = swipe_start {
+                // Keys the path passes over wait until it's clear
+                // whether it's a gesture or a tap which slipped.
+                swipe.drag(position, key);
+                layout.swipe = Some(swipe);
+                return;
+            }
+        }
+        if let Some(key) = key {
+            handle_press_key(layout, submission, ui, time, point, key);
+        }
+    }
+
+    /// Lifts the input point, releasing its key or finishing its swipe
+    pub fn handle_lift(
+        layout: &mut Layout,
+        submission: &mut Submission,
+        ui: Option<&UIBackend>,
+        time: Timestamp,
+        manager: Option<manager::c::Manager>,
+        point: PointId,
+    ) {
+        if layout.is_swiping(point) {
+            let swipe = layout.swipe.take().unwrap();
+            match swipe.state {
+                SwipeState::Drawing => submission.handle_swipe(
+                    &layout.get_letter_keys(),
+                    &swipe.gesture,
+                ),
+                // The tap slipped, so the key under the point is the one meant
+                SwipeState::Drifting(Some(key)) if key != swipe.start => {
+                    handle_press_key(layout, submission, ui, time, point, key);
+                    handle_release_key(layout, submission, ui, time, manager, key);
+                },
+                SwipeState::Drifting(_) => {},
+            }
+            return;
+        }
 
-        layout.apply_view_transition(&action);
+        if let Some(key) = layout.get_point_key(point) {
+            handle_release_key(layout, submission, ui, time, manager, key);
+        }
+    }
 
-        // update
-        let key = key.into_released();
+    /// Changes the state and submits, without touching the UI.
+    /// Runs on every keystroke, so it must not allocate.
+    /// Returns whether the look of more than the key's buttons changed.
+    pub fn release_key(
+        layout: &mut Layout,
+        submission: &mut Submission,
+        time: Timestamp,
+        key_id: KeyStateId,
+    ) -> bool {
+        let view_changed = layout.apply_view_transition(key_id);
+        let action = &layout.keys[key_id.0].action;
+        // Modifiers change the look of all buttons applying them
+        let redraw_all = view_changed || match action {
+            Action::ApplyModifier(_) => true,
+            _ => false,
+        };
 
         // process non-view switching
         match action {
             Action::Submit { text: _, keys: _ }
                 | Action::Erase
             => {
-                submission.handle_release(KeyState::get_id(rckey), time);
+                submission.handle_release(key_id, time);
             },
             Action::ApplyModifier(modifier) => {
                 // FIXME: key id is unneeded with stateless locks
-                let key_id = KeyState::get_id(rckey);
-                let gets_locked = !submission.is_modifier_active(modifier);
+                let gets_locked = !submission.is_modifier_active(*modifier);
                 match gets_locked {
                     true => submission.handle_add_modifier(
                         key_id,
-                        modifier, time,
+                        *modifier, time,
                     ),
                     false => submission.handle_drop_modifier(key_id, time),
                 }
             }
-            // only show when UI is present
-            Action::ShowPreferences => if let Some(ui) = &ui {
-                // only show when layout manager is available
-                if let Some(manager) = manager {
-                    let view = layout.get_current_view();
-                    let places = ::layout::procedures::find_key_places(
-                        view, &rckey,
-                    );
-                    // Getting first item will cause mispositioning
-                    // with more than one button with the same key
-                    // on the keyboard.
-                    if let Some((position, button)) = places.get(0) {
-                        let bounds = c::Bounds {
-                            x: position.x,
-                            y: position.y,
-                            width: button.size.width,
-                            height: button.size.height,
-                        };
-                        ::popover::show(
-                            ui.keyboard,
-                            ui.widget_to_layout.reverse_bounds(bounds),
-                            manager,
-                        );
-                    }
-                }
-            },
-            // Other keys are handled in view switcher before.
+            // Other keys are handled in view switcher before,
+            // or need the UI.
             _ => {}
         };
 
-        let pointer = ::util::Pointer(rckey.clone());
         // Apply state changes
-        layout.pressed_keys.remove(&pointer);
+        layout.pressed_keys.retain(|(_, pressed)| *pressed != key_id);
         // Commit activated button state changes
-        RefCell::replace(rckey, key);
+        layout.keys[key_id.0].pressed = PressType::Released;
+        redraw_all
     }
 }
 
 #[cfg(test)]
-mod test {
+pub mod test {
     use super::*;
 
+    use std::alloc::{ GlobalAlloc, System };
+    use std::alloc::Layout as MemoryLayout;
+    use std::cell::Cell;
     use std::ffi::CString;
-    use ::keyboard::PressType;
+    use ::action::KeySym;
+    use ::keyboard::{ KeyCode, PressType };
 
-    pub fn make_state_with_action(action: Action)
-        -> Rc<RefCell<::keyboard::KeyState>>
-    {
-        Rc::new(RefCell::new(::keyboard::KeyState {
+    thread_local! {
+        static ALLOCATIONS: Cell<usize> = Cell::new(0);
+    }
+
+    /// Counts allocations per thread,
+    /// so that tests running in parallel don't disturb each other.
+    struct CountingAllocator;
+
+    unsafe impl GlobalAlloc for CountingAllocator {
+        unsafe fn alloc(&self, layout: MemoryLayout) -> *mut u8 {
+            let _ = ALLOCATIONS.try_with(|count| count.set(count.get() + 1));
+            System.alloc(layout)
+        }
+
+        unsafe fn dealloc(&self, ptr: *mut u8, layout: MemoryLayout) {
+            System.dealloc(ptr, layout)
+        }
+    }
+
+    #[global_allocator]
+    static ALLOCATOR: CountingAllocator = CountingAllocator;
+
+    fn count_allocations<F: FnOnce()>(f: F) -> usize {
+        let before = ALLOCATIONS.with(|count| count.get());
+        f();
+        ALLOCATIONS.with(|count| count.get()) - before
+    }
+
+    pub fn make_state_with_action(action: Action) -> ::keyboard::KeyState {
+        ::keyboard::KeyState {
             pressed: PressType::Released,
             keycodes: Vec::new(),
             action,
-        }))
+        }
     }
 
-    pub fn make_state() -> Rc<RefCell<::keyboard::KeyState>> {
-        make_state_with_action(Action::SetView("default".into()))
+    pub fn make_state() -> ::keyboard::KeyState {
+        make_state_with_action(Action::SetView(ViewId(0)))
     }
 
     pub fn make_button_with_state(
         name: String,
-        state: Rc<RefCell<::keyboard::KeyState>>,
+        key: KeyStateId,
     ) -> Box<Button> {
         Box::new(Button {
             name: CString::new(name.clone()).unwrap(),
             size: Size { width: 0f64, height: 0f64 },
             outline_name: CString::new("test").unwrap(),
             label: Label::Text(CString::new(name).unwrap()),
-            state: state,
+            key: key,
         })
     }
+
+    pub fn make_layout(
+        keys: Vec<::keyboard::KeyState>,
+        views: Vec<(String, (c::Point, View))>,
+    ) -> Layout {
+        Layout::new(
+            LayoutData {
+                views,
+                keys,
+                keymaps: Vec::new(),
+                margins: Margins {
+                    top: 0.0,
+                    left: 0.0,
+                    right: 0.0,
+                    bottom: 0.0,
+                },
+                touch_margin: std::f64::INFINITY,
+            },
+            ArrangementKind::Base,
+        )
+    }
     
     #[test]
     fn latch_lock_unlock() {
+        let lock = ViewId(0);
+        let unlock = ViewId(1);
+        let base = ViewId(2);
+
         let action = Action::LockView {
-            lock: "lock".into(),
-            unlock: "unlock".into(),
+            lock,
+            unlock,
             latches: true,
             looks_locked_from: vec![],
         };
 
         assert_eq!(
-            Layout::process_action_for_view(&action, "unlock", &LatchedState::Not),
-            (ViewTransition::ChangeTo("lock"), LatchedState::FromView("unlock".into())),
+            Layout::process_action_for_view(&action, unlock, &LatchedState::Not),
+            (ViewTransition::ChangeTo(lock), LatchedState::FromView(unlock)),
         );
 
         assert_eq!(
-            Layout::process_action_for_view(&action, "lock", &LatchedState::FromView("unlock".into())),
+            Layout::process_action_for_view(&action, lock, &LatchedState::FromView(unlock)),
             (ViewTransition::NoChange, LatchedState::Not),
         );
 
         assert_eq!(
-            Layout::process_action_for_view(&action, "lock", &LatchedState::Not),
-            (ViewTransition::ChangeTo("unlock"), LatchedState::Not),
+            Layout::process_action_for_view(&action, lock, &LatchedState::Not),
+            (ViewTransition::ChangeTo(unlock), LatchedState::Not),
         );
 
         assert_eq!(
-            Layout::process_action_for_view(&Action::Erase, "lock", &LatchedState::FromView("base".into())),
+            Layout::process_action_for_view(&Action::Erase, lock, &LatchedState::FromView(base)),
             (ViewTransition::UnlatchAll, LatchedState::Not),
         );
     }
 
     #[test]
     fn latch_pop_layout() {
+        let base = ViewId(0);
+        let locked = ViewId(1);
+
         let switch = Action::LockView {
-            lock: "locked".into(),
-            unlock: "base".into(),
+            lock: locked,
+            unlock: base,
             latches: true,
             looks_locked_from: vec![],
         };
         
         let submit = Action::Erase;
 
+        let keys = vec![
+            make_state_with_action(switch.clone()),
+            make_state_with_action(submit.clone()),
+        ];
+
         let view = View::new(vec![(
             0.0,
             Row::new(vec![
                 (
                     0.0,
-                    make_button_with_state(
-                        "switch".into(),
-                        make_state_with_action(switch.clone())
-                    ),
+                    make_button_with_state("switch".into(), KeyStateId(0)),
                 ),
                 (
                     1.0,
-                    make_button_with_state(
-                        "submit".into(),
-                        make_state_with_action(submit.clone())
-                    ),
+                    make_button_with_state("submit".into(), KeyStateId(1)),
                 ),
             ]),
         )]);
 
-        let mut layout = Layout {
-            current_view: "base".into(),
-            view_latched: LatchedState::Not,
-            keymaps: Vec::new(),
-            kind: ArrangementKind::Base,
-            pressed_keys: HashSet::new(),
-            margins: Margins {
-                top: 0.0,
-                left: 0.0,
-                right: 0.0,
-                bottom: 0.0,
-            },
-            views: hashmap! {
-                // Both can use the same structure.
-                // Switching doesn't depend on the view shape
-                // as long as the switching button is present.
-                "base".into() => (c::Point { x: 0.0, y: 0.0 }, view.clone()),
-                "locked".into() => (c::Point { x: 0.0, y: 0.0 }, view),
-            },
-        };        
+        let mut layout = make_layout(keys, vec![
+            // Both can use the same structure.
+            // Switching doesn't depend on the view shape
+            // as long as the switching button is present.
+            ("base".into(), (c::Point { x: 0.0, y: 0.0 }, view.clone())),
+            ("locked".into(), (c::Point { x: 0.0, y: 0.0 }, view)),
+        ]);
 
         // Basic cycle
-        layout.apply_view_transition(&switch);
-        assert_eq!(&layout.current_view, "locked");
-        layout.apply_view_transition(&switch);
-        assert_eq!(&layout.current_view, "locked");
-        layout.apply_view_transition(&submit);
-        assert_eq!(&layout.current_view, "locked");
-        layout.apply_view_transition(&switch);
-        assert_eq!(&layout.current_view, "base");
-        layout.apply_view_transition(&switch);
+        layout.apply_view_transition(KeyStateId(0));
+        assert_eq!(layout.current_view, locked);
+        layout.apply_view_transition(KeyStateId(0));
+        assert_eq!(layout.current_view, locked);
+        layout.apply_view_transition(KeyStateId(1));
+        assert_eq!(layout.current_view, locked);
+        layout.apply_view_transition(KeyStateId(0));
+        assert_eq!(layout.current_view, base);
+        layout.apply_view_transition(KeyStateId(0));
         // Unlatch
-        assert_eq!(&layout.current_view, "locked");
-        layout.apply_view_transition(&submit);
-        assert_eq!(&layout.current_view, "base");
+        assert_eq!(layout.current_view, locked);
+        layout.apply_view_transition(KeyStateId(1));
+        assert_eq!(layout.current_view, base);
     }
 
     #[test]
     fn reverse_unlatch_layout() {
+        let base = ViewId(0);
+        let locked = ViewId(1);
+        let unlocked = ViewId(2);
+
         let switch = Action::LockView {
-            lock: "locked".into(),
-            unlock: "base".into(),
+            lock: locked,
+            unlock: base,
             latches: true,
             looks_locked_from: vec![],
         };
         
         let unswitch = Action::LockView {
-            lock: "locked".into(),
-            unlock: "unlocked".into(),
+            lock: locked,
+            unlock: unlocked,
             latches: false,
             looks_locked_from: vec![],
         };
         
         let submit = Action::Erase;
 
+        let keys = vec![
+            make_state_with_action(switch.clone()),
+            make_state_with_action(submit.clone()),
+            make_state_with_action(unswitch.clone()),
+        ];
+
         let view = View::new(vec![(
             0.0,
             Row::new(vec![
                 (
                     0.0,
-                    make_button_with_state(
-                        "switch".into(),
-                        make_state_with_action(switch.clone())
-                    ),
+                    make_button_with_state("switch".into(), KeyStateId(0)),
                 ),
                 (
                     1.0,
-                    make_button_with_state(
-                        "submit".into(),
-                        make_state_with_action(submit.clone())
-                    ),
+                    make_button_with_state("submit".into(), KeyStateId(1)),
                 ),
             ]),
         )]);
 
-        let mut layout = Layout {
-            current_view: "base".into(),
-            view_latched: LatchedState::Not,
-            keymaps: Vec::new(),
-            kind: ArrangementKind::Base,
-            pressed_keys: HashSet::new(),
-            margins: Margins {
-                top: 0.0,
-                left: 0.0,
-                right: 0.0,
-                bottom: 0.0,
-            },
-            views: hashmap! {
-                // Both can use the same structure.
-                // Switching doesn't depend on the view shape
-                // as long as the switching button is present.
-                "base".into() => (c::Point { x: 0.0, y: 0.0 }, view.clone()),
-                "locked".into() => (c::Point { x: 0.0, y: 0.0 }, view.clone()),
-                "unlocked".into() => (c::Point { x: 0.0, y: 0.0 }, view),
-            },
-        };        
+        let mut layout = make_layout(keys, vec![
+            // Both can use the same structure.
+            // Switching doesn't depend on the view shape
+            // as long as the switching button is present.
+            ("base".into(), (c::Point { x: 0.0, y: 0.0 }, view.clone())),
+            ("locked".into(), (c::Point { x: 0.0, y: 0.0 }, view.clone())),
+            ("unlocked".into(), (c::Point { x: 0.0, y: 0.0 }, view)),
+        ]);
 
-        layout.apply_view_transition(&switch);
-        assert_eq!(&layout.current_view, "locked");
-        layout.apply_view_transition(&unswitch);
-        assert_eq!(&layout.current_view, "unlocked");
+        layout.apply_view_transition(KeyStateId(0));
+        assert_eq!(layout.current_view, locked);
+        layout.apply_view_transition(KeyStateId(2));
+        assert_eq!(layout.current_view, unlocked);
     }
 
     #[test]
     fn latch_twopop_layout() {
+        let base = ViewId(0);
+        let locked = ViewId(1);
+        let accented = ViewId(2);
+
         let switch = Action::LockView {
-            lock: "locked".into(),
-            unlock: "base".into(),
+            lock: locked,
+            unlock: base,
             latches: true,
             looks_locked_from: vec![],
         };
         
         let switch_again = Action::LockView {
-            lock: "ĄĘ".into(),
-            unlock: "locked".into(),
+            lock: accented,
+            unlock: locked,
             latches: true,
             looks_locked_from: vec![],
         };
         
         let submit = Action::Erase;
 
+        let keys = vec![
+            make_state_with_action(switch.clone()),
+            make_state_with_action(submit.clone()),
+            make_state_with_action(switch_again.clone()),
+        ];
+
         let view = View::new(vec![(
             0.0,
             Row::new(vec![
                 (
                     0.0,
-                    make_button_with_state(
-                        "switch".into(),
-                        make_state_with_action(switch.clone())
-                    ),
+                    make_button_with_state("switch".into(), KeyStateId(0)),
                 ),
                 (
                     1.0,
-                    make_button_with_state(
-                        "submit".into(),
-                        make_state_with_action(submit.clone())
-                    ),
+                    make_button_with_state("submit".into(), KeyStateId(1)),
                 ),
             ]),
         )]);
 
-        let mut layout = Layout {
-            current_view: "base".into(),
-            view_latched: LatchedState::Not,
-            keymaps: Vec::new(),
-            kind: ArrangementKind::Base,
-            pressed_keys: HashSet::new(),
-            margins: Margins {
-                top: 0.0,
-                left: 0.0,
-                right: 0.0,
-                bottom: 0.0,
-            },
-            views: hashmap! {
-                // All can use the same structure.
-                // Switching doesn't depend on the view shape
-                // as long as the switching button is present.
-                "base".into() => (c::Point { x: 0.0, y: 0.0 }, view.clone()),
-                "locked".into() => (c::Point { x: 0.0, y: 0.0 }, view.clone()),
-                "ĄĘ".into() => (c::Point { x: 0.0, y: 0.0 }, view),
-            },
-        };        
+        let mut layout = make_layout(keys, vec![
+            // All can use the same structure.
+            // Switching doesn't depend on the view shape
+            // as long as the switching button is present.
+            ("base".into(), (c::Point { x: 0.0, y: 0.0 }, view.clone())),
+            ("locked".into(), (c::Point { x: 0.0, y: 0.0 }, view.clone())),
+            ("ĄĘ".into(), (c::Point { x: 0.0, y: 0.0 }, view)),
+        ]);
 
         // Latch twice, then Ąto-unlatch across 2 levels
-        layout.apply_view_transition(&switch);
+        layout.apply_view_transition(KeyStateId(0));
         println!("{:?}", layout.view_latched);
-        assert_eq!(&layout.current_view, "locked");
-        layout.apply_view_transition(&switch_again);
+        assert_eq!(layout.current_view, locked);
+        layout.apply_view_transition(KeyStateId(2));
         println!("{:?}", layout.view_latched);
-        assert_eq!(&layout.current_view, "ĄĘ");
-        layout.apply_view_transition(&submit);
+        assert_eq!(layout.current_view, accented);
+        layout.apply_view_transition(KeyStateId(1));
         println!("{:?}", layout.view_latched);
-        assert_eq!(&layout.current_view, "base");
+        assert_eq!(layout.current_view, base);
     }
 
     #[test]
@@ -1362,14 +2200,14 @@ mod test {
                         0.0,
                         Box::new(Button {
                             size: Size { width: 5.0, height: 10.0 },
-                            ..*make_button_with_state("A".into(), make_state())
+                            ..*make_button_with_state("A".into(), KeyStateId(0))
                         }),
                     ),
                     (
                         5.0,
                         Box::new(Button {
                             size: Size { width: 5.0, height: 10.0 },
-                            ..*make_button_with_state("B".into(), make_state())
+                            ..*make_button_with_state("B".into(), KeyStateId(0))
                         }),
                     ),
                 ]),
@@ -1381,28 +2219,161 @@ mod test {
                         0.0,
                         Box::new(Button {
                             size: Size { width: 30.0, height: 10.0 },
-                            ..*make_button_with_state("bar".into(), make_state())
+                            ..*make_button_with_state("bar".into(), KeyStateId(0))
                         }),
                     ),
                 ]),
             )
         ]);
-        assert!(
-            view.find_button_by_position(c::Point { x: 5.0, y: 5.0 })
-                .unwrap().button.name.to_str().unwrap() == "A"
-        );
-        assert!(
-            view.find_button_by_position(c::Point { x: 14.99, y: 5.0 })
-                .unwrap().button.name.to_str().unwrap() == "A"
+        let layout = make_layout(vec![make_state()], vec![
+            ("base".into(), (c::Point { x: 0.0, y: 0.0 }, view)),
+        ]);
+        let name_at = |x, y| {
+            layout.find_button_by_position(c::Point { x, y })
+                .map(|button| layout.buttons.get_name(button).clone())
+                .unwrap()
+                .into_string().unwrap()
+        };
+        assert_eq!(name_at(5.0, 5.0), "A");
+        assert_eq!(name_at(14.99, 5.0), "A");
+        assert_eq!(name_at(15.01, 5.0), "B");
+        assert_eq!(name_at(25.0, 5.0), "B");
+        assert_eq!(name_at(1.0, 15.0), "bar");
+        assert_eq!(
+            layout.find_button_by_position(c::Point { x: 31.0, y: 5.0 }),
+            None,
         );
-        assert!(
-            view.find_button_by_position(c::Point { x: 15.01, y: 5.0 })
-                .unwrap().button.name.to_str().unwrap() == "B"
+    }
+
+    fn make_sized_button(name: &str, width: f64, height: f64) -> Box<Button> {
+        Box::new(Button {
+            size: Size { width, height },
+            ..*make_button_with_state(name.into(), KeyStateId(0))
+        })
+    }
+
+    #[test]
+    fn check_overlapping() {
+        // A tall button covering a part of the next row,
+        // like the enter key on some ISO layouts.
+        let view = View::new(vec![
+            (
+                0.0,
+                Row::new(vec![
+                    (0.0, make_sized_button("A", 10.0, 10.0)),
+                    (10.0, make_sized_button("enter", 10.0, 20.0)),
+                ]),
+            ),
+            (
+                10.0,
+                Row::new(vec![
+                    (0.0, make_sized_button("B", 15.0, 10.0)),
+                    (15.0, make_sized_button("C", 5.0, 10.0)),
+                ]),
+            ),
+        ]);
+        let layout = make_layout(vec![make_state()], vec![
+            ("base".into(), (c::Point { x: 0.0, y: 0.0 }, view)),
+        ]);
+        let name_at = |x, y| {
+            layout.find_button_by_position(c::Point { x, y })
+                .map(|button| layout.buttons.get_name(button).clone())
+                .unwrap()
+                .into_string().unwrap()
+        };
+        assert_eq!(name_at(5.0, 5.0), "A");
+        assert_eq!(name_at(15.0, 5.0), "enter");
+        assert_eq!(name_at(5.0, 15.0), "B");
+        // Covered by enter and another button, the one drawn later wins
+        assert_eq!(name_at(12.0, 15.0), "B");
+        assert_eq!(name_at(18.0, 15.0), "C");
+    }
+
+    #[test]
+    fn check_touch_margin() {
+        // Two buttons with a gap between them
+        let view = View::new(vec![(
+            0.0,
+            Row::new(vec![
+                (0.0, make_sized_button("A", 10.0, 10.0)),
+                (20.0, make_sized_button("B", 10.0, 10.0)),
+            ]),
+        )]);
+        let make = |touch_margin| Layout::new(
+            LayoutData {
+                views: vec![
+                    ("base".into(), (c::Point { x: 0.0, y: 0.0 }, view.clone())),
+                ],
+                keys: vec![make_state()],
+                keymaps: Vec::new(),
+                margins: Margins { top: 0.0, left: 0.0, right: 0.0, bottom: 0.0 },
+                touch_margin,
+            },
+            ArrangementKind::Base,
         );
-        assert!(
-            view.find_button_by_position(c::Point { x: 25.0, y: 5.0 })
-                .unwrap().button.name.to_str().unwrap() == "B"
+        let name_at = |layout: &Layout, x| {
+            layout.find_button_by_position(c::Point { x, y: 5.0 })
+                .map(|button| layout.buttons.get_name(button).clone())
+                .map(|name| name.into_string().unwrap())
+        };
+
+        let layout = make(std::f64::INFINITY);
+        assert_eq!(name_at(&layout, 12.0), Some("A".into()));
+        assert_eq!(name_at(&layout, 18.0), Some("B".into()));
+
+        let layout = make(1.0);
+        assert_eq!(name_at(&layout, 10.5), Some("A".into()));
+        assert_eq!(name_at(&layout, 12.0), None);
+        assert_eq!(name_at(&layout, 19.5), Some("B".into()));
+    }
+
+    #[test]
+    fn check_batched_lookup() {
+        let view = View::new(vec![
+            (
+                0.0,
+                Row::new(vec![
+                    (0.0, make_sized_button("A", 10.0, 10.0)),
+                    (10.0, make_sized_button("B", 10.0, 10.0)),
+                ]),
+            ),
+            (
+                10.0,
+                Row::new(vec![(0.0, make_sized_button("space", 15.0, 10.0))]),
+            ),
+        ]);
+        let layout = make_layout(vec![make_state()], vec![
+            ("base".into(), (c::Point { x: 0.0, y: 0.0 }, view)),
+        ]);
+        let transformation = c::Transformation {
+            origin_x: 3.0,
+            origin_y: 4.0,
+            scale: 2.0,
+        };
+        // More than fit in one chunk, some outside of the view
+        let points: Vec<_> = (0..200)
+            .map(|i| c::Point {
+                x: (i % 20) as f64 * 2.5 - 5.0,
+                y: (i / 20) as f64 * 5.0,
+            })
+            .collect();
+        let mut found = vec![None; points.len()];
+        layout.find_buttons_by_positions(
+            &transformation,
+            &points,
+            |i, button| found[i] = button,
         );
+
+        for (point, found) in points.iter().zip(found.iter()) {
+            assert_eq!(
+                *found,
+                layout.find_button_by_position(
+                    transformation.forward(point.clone())
+                ),
+            );
+        }
+        assert!(found.iter().any(|f| f.is_none()));
+        assert!(found.iter().any(|f| f.is_some()));
     }
 
     #[test]
@@ -1415,34 +2386,35 @@ mod test {
                     0.0,
                     Box::new(Button {
                         size: Size { width: 1.0, height: 1.0 },
-                        ..*make_button_with_state("foo".into(), make_state())
+                        ..*make_button_with_state("foo".into(), KeyStateId(0))
                     }),
                 )]),
             ),
         ]);
-        let layout = Layout {
-            current_view: String::new(),
-            view_latched: LatchedState::Not,
-            keymaps: Vec::new(),
-            kind: ArrangementKind::Base,
-            pressed_keys: HashSet::new(),
-            // Lots of bottom margin
-            margins: Margins {
-                top: 0.0,
-                left: 0.0,
-                right: 0.0,
-                bottom: 1.0,
-            },
-            views: hashmap! {
-                String::new() => (c::Point { x: 0.0, y: 0.0 }, view),
+        let layout = Layout::new(
+            LayoutData {
+                views: vec![
+                    (String::new(), (c::Point { x: 0.0, y: 0.0 }, view)),
+                ],
+                keys: vec![make_state()],
+                keymaps: Vec::new(),
+                // Lots of bottom margin
+                margins: Margins {
+                    top: 0.0,
+                    left: 0.0,
+                    right: 0.0,
+                    bottom: 1.0,
+                },
+                touch_margin: std::f64::INFINITY,
             },
-        };
+            ArrangementKind::Base,
+        );
         assert_eq!(
-            layout.calculate_inner_size(),
+            Layout::calculate_inner_size(&layout.views),
             Size { width: 1.0, height: 1.0 }
         );
         assert_eq!(
-            layout.calculate_size(),
+            layout.get_size(),
             Size { width: 1.0, height: 2.0 }
         );
         // Don't change those values randomly!
@@ -1455,4 +2427,321 @@ mod test {
         assert_eq!(transformation.origin_x, 0.5);
         assert_eq!(transformation.origin_y, 0.0);
     }
+
+    /// Pressing and releasing a typical key happens on every keystroke,
+    /// so it must not touch the allocator.
+    #[test]
+    fn keystroke_without_allocations() {
+        let key = KeyState {
+            pressed: PressType::Released,
+            keycodes: vec![KeyCode { code: 9, keymap_idx: 0 }],
+            action: Action::Submit {
+                text: Some(CString::new("a").unwrap()),
+                keys: vec![KeySym("a".into())],
+            },
+        };
+        let button = Box::new(Button {
+            name: CString::new("a").unwrap(),
+            size: Size { width: 1.0, height: 1.0 },
+            outline_name: CString::new("test").unwrap(),
+            label: Label::Text(CString::new("a").unwrap()),
+            key: KeyStateId(0),
+        });
+        let view = View::new(vec![(0.0, Row::new(vec![(0.0, button)]))]);
+        let mut layout = make_layout(vec![key], vec![
+            ("base".into(), (c::Point { x: 0.0, y: 0.0 }, view)),
+        ]);
+        let mut submission = ::submission::test::make_submission();
+
+        let keystroke = |layout: &mut Layout, submission: &mut Submission| {
+            let key = layout.find_button_by_position(c::Point { x: 0.5, y: 0.5 })
+                .map(|button| layout.buttons.keys[button])
+                .unwrap();
+            seat::press_key(layout, submission, Timestamp(0), PointId(1), key);
+            assert_eq!(layout.keys[key.0].pressed, PressType::Pressed);
+            seat::release_key(layout, submission, Timestamp(1), key);
+            assert_eq!(layout.keys[key.0].pressed, PressType::Released);
+        };
+
+        // Lets the lists of pressed keys reach their working size
+        keystroke(&mut layout, &mut submission);
+        assert_eq!(
+            count_allocations(|| keystroke(&mut layout, &mut submission)),
+            0,
+        );
+    }
+
+    fn make_text_key(text: &str) -> KeyState {
+        KeyState {
+            pressed: PressType::Released,
+            keycodes: vec![KeyCode { code: 9, keymap_idx: 0 }],
+            action: Action::Submit {
+                text: Some(CString::new(text).unwrap()),
+                keys: vec![KeySym(text.into())],
+            },
+        }
+    }
+
+    /// Keys A, B and C, with no buttons
+    fn make_touch_layout() -> Layout {
+        make_layout(
+            vec![make_text_key("a"), make_text_key("b"), make_text_key("c")],
+            vec![(
+                "base".into(),
+                (c::Point { x: 0.0, y: 0.0 }, View::new(vec![])),
+            )],
+        )
+    }
+
+    /// Like lifting the point in `squeek_layout_release`
+    fn release_point(
+        layout: &mut Layout,
+        submission: &mut Submission,
+        point: PointId,
+    ) {
+        if let Some(key) = layout.get_point_key(point) {
+            seat::handle_release_key(
+                layout, submission, None, Timestamp(1), None, key,
+            );
+        }
+    }
+
+    #[test]
+    fn touch_rollover() {
+        let (a, b) = (KeyStateId(0), KeyStateId(1));
+        let (first, second) = (PointId(1), PointId(2));
+        let mut layout = make_touch_layout();
+        let mut submission = ::submission::test::make_submission();
+
+        seat::handle_press_key(
+            &mut layout, &mut submission, None, Timestamp(0), first, a,
+        );
+        // The second finger lands before the first lifts
+        seat::handle_press_key(
+            &mut layout, &mut submission, None, Timestamp(0), second, b,
+        );
+        assert_eq!(layout.keys[a.0].pressed, PressType::Pressed);
+        assert_eq!(layout.keys[b.0].pressed, PressType::Pressed);
+        assert_eq!(layout.get_point_key(first), Some(a));
+        assert_eq!(layout.get_point_key(second), Some(b));
+
+        release_point(&mut layout, &mut submission, first);
+        assert_eq!(layout.keys[a.0].pressed, PressType::Released);
+        assert_eq!(layout.keys[b.0].pressed, PressType::Pressed);
+        assert_eq!(layout.get_point_key(first), None);
+        assert_eq!(layout.get_point_key(second), Some(b));
+
+        release_point(&mut layout, &mut submission, second);
+        assert_eq!(layout.keys[b.0].pressed, PressType::Released);
+        assert!(layout.pressed_keys.is_empty());
+    }
+
+    #[test]
+    fn touch_takes_over_key() {
+        let a = KeyStateId(0);
+        let (first, second) = (PointId(1), PointId(2));
+        let mut layout = make_touch_layout();
+        let mut submission = ::submission::test::make_submission();
+
+        seat::handle_press_key(
+            &mut layout, &mut submission, None, Timestamp(0), first, a,
+        );
+        seat::handle_press_key(
+            &mut layout, &mut submission, None, Timestamp(0), second, a,
+        );
+        assert_eq!(layout.keys[a.0].pressed, PressType::Pressed);
+        assert_eq!(layout.get_key_point(a), Some(second));
+        assert_eq!(layout.get_point_key(first), None);
+        assert_eq!(layout.pressed_keys.len(), 1);
+
+        // The point which lost the key has nothing to release
+        release_point(&mut layout, &mut submission, first);
+        assert_eq!(layout.keys[a.0].pressed, PressType::Pressed);
+        assert_eq!(layout.get_key_point(a), Some(second));
+
+        release_point(&mut layout, &mut submission, second);
+        assert_eq!(layout.keys[a.0].pressed, PressType::Released);
+        assert!(layout.pressed_keys.is_empty());
+    }
+
+    #[test]
+    fn touch_release_keeps_other_points() {
+        let (a, b, c) = (KeyStateId(0), KeyStateId(1), KeyStateId(2));
+        let (first, second) = (PointId(1), PointId(2));
+        let mut layout = make_touch_layout();
+        let mut submission = ::submission::test::make_submission();
+
+        seat::handle_press_key(
+            &mut layout, &mut submission, None, Timestamp(0), first, a,
+        );
+        seat::handle_press_key(
+            &mut layout, &mut submission, None, Timestamp(0), second, b,
+        );
+        // The first point slides from A to C, like in `squeek_layout_drag`
+        release_point(&mut layout, &mut submission, first);
+        seat::handle_press_key(
+            &mut layout, &mut submission, None, Timestamp(1), first, c,
+        );
+        assert_eq!(layout.keys[a.0].pressed, PressType::Released);
+        assert_eq!(layout.keys[b.0].pressed, PressType::Pressed);
+        assert_eq!(layout.keys[c.0].pressed, PressType::Pressed);
+        assert_eq!(layout.get_point_key(first), Some(c));
+        assert_eq!(layout.get_point_key(second), Some(b));
+
+        // Lifting the second point leaves the first one's key down
+        release_point(&mut layout, &mut submission, second);
+        assert_eq!(layout.keys[b.0].pressed, PressType::Released);
+        assert_eq!(layout.keys[c.0].pressed, PressType::Pressed);
+        assert_eq!(layout.pressed_keys, vec![(first, c)]);
+    }
+
+    /// Keys A, B and C in a row, 10 wide
+    fn make_row_layout() -> Layout {
+        let view = View::new(vec![(
+            0.0,
+            Row::new(vec![
+                (0.0, make_button_with_state("a".into(), KeyStateId(0))),
+                (10.0, make_button_with_state("b".into(), KeyStateId(1))),
+                (20.0, make_button_with_state("c".into(), KeyStateId(2))),
+            ].into_iter()
+                .map(|(offset, button)| (offset, Box::new(Button {
+                    size: Size { width: 10.0, height: 10.0 },
+                    ..*button
+                })))
+                .collect()
+            ),
+        )]);
+        make_layout(
+            vec![make_text_key("a"), make_text_key("b"), make_text_key("c")],
+            vec![("base".into(), (c::Point { x: 0.0, y: 0.0 }, view))],
+        )
+    }
+
+    #[test]
+    fn swipe_drift_types_neighbour() {
+        use ::imservice::test::{ make_imservice, take_requests, Request };
+
+        let a = KeyStateId(0);
+        let point = PointId(1);
+        let mut layout = make_row_layout();
+        let mut submission = ::submission::test::make_im_submission(
+            make_imservice("drift", vec![("abc", 1)])
+        );
+        assert!(submission.is_swipe_available());
+
+        seat::handle_press_key(
+            &mut layout, &mut submission, None, Timestamp(0), point, a,
+        );
+        // Slips just past the edge of A onto B
+        seat::handle_drag(
+            &mut layout, &mut submission, None, Timestamp(1), None,
+            point, c::Point { x: 11.0, y: 5.0 },
+        );
+        seat::handle_lift(
+            &mut layout, &mut submission, None, Timestamp(2), None, point,
+        );
+        assert_eq!(
+            take_requests(),
+            vec![Request::Commit("a".into()), Request::Commit("b".into())],
+        );
+        assert!(layout.swipe.is_none());
+        assert!(layout.pressed_keys.is_empty());
+    }
+
+    #[test]
+    fn swipe_starts_past_reach() {
+        let a = KeyStateId(0);
+        let point = PointId(1);
+        let mut layout = make_row_layout();
+        let mut submission = ::submission::test::make_im_submission(
+            ::imservice::test::make_imservice("reach", vec![("abc", 1)])
+        );
+
+        seat::handle_press_key(
+            &mut layout, &mut submission, None, Timestamp(0), point, a,
+        );
+        seat::handle_drag(
+            &mut layout, &mut submission, None, Timestamp(1), None,
+            point, c::Point { x: 11.0, y: 5.0 },
+        );
+        // Past the middle of B, a key width away from the middle of A
+        seat::handle_drag(
+            &mut layout, &mut submission, None, Timestamp(2), None,
+            point, c::Point { x: 16.0, y: 5.0 },
+        );
+        match layout.swipe {
+            Some(Swipe { state: SwipeState::Drawing, .. }) => {},
+            _ => panic!("No gesture drawn"),
+        }
+        // Keys along the way don't get pressed
+        assert!(layout.pressed_keys.is_empty());
+    }
+
+    #[test]
+    fn check_snapped_transformation() {
+        let view = View::new(vec![(
+            0.0,
+            Row::new(vec![(
+                0.0,
+                Box::new(Button {
+                    size: Size { width: 10.0, height: 10.0 },
+                    ..*make_button_with_state("A".into(), KeyStateId(0))
+                }),
+            )]),
+        )]);
+        let layout = make_layout(vec![make_state()], vec![
+            ("base".into(), (c::Point { x: 0.0, y: 0.0 }, view)),
+        ]);
+        let available = Size { width: 33.0, height: 21.7 };
+
+        for scale_factor in 1..4 {
+            let factor = scale_factor as f64;
+            let t = layout.calculate_snapped_transformation(
+                available,
+                scale_factor,
+            );
+            // Origin on a device pixel
+            assert_eq!((t.origin_x * factor).fract(), 0.0);
+            assert_eq!((t.origin_y * factor).fract(), 0.0);
+            // Height is limiting, and spans whole device pixels
+            let height = 10.0 * t.scale * factor;
+            assert!((height - height.round()).abs() < 1e-9);
+            assert!(10.0 * t.scale <= available.height);
+            // Never smaller by more than a device pixel
+            assert!(available.height - 10.0 * t.scale < 1.0 / factor);
+        }
+
+        // Cached for the same allocation only
+        let t = layout.calculate_transformation(available);
+        assert!((t.scale - 2.17).abs() < 1e-9);
+        let cached = layout.transformation.get().unwrap();
+        assert_eq!(cached.available, available);
+        assert_eq!(cached.scale_factor, None);
+        assert_eq!(cached.transformation, t);
+
+        // A planted value comes back, so it's not calculated again
+        let planted = c::Transformation {
+            origin_x: 1.0,
+            origin_y: 2.0,
+            scale: 3.0,
+        };
+        layout.transformation.set(Some(CachedTransformation {
+            transformation: planted,
+            ..cached
+        }));
+        assert_eq!(layout.calculate_transformation(available), planted);
+
+        let other = Size { width: 33.0, height: 20.0 };
+        let t = layout.calculate_transformation(other);
+        assert_ne!(t, planted);
+        let cached = layout.transformation.get().unwrap();
+        assert_eq!(cached.available, other);
+        assert_eq!(cached.transformation, t);
+
+        // Snapped and unsnapped don't share entries
+        let t = layout.calculate_snapped_transformation(other, 2);
+        let cached = layout.transformation.get().unwrap();
+        assert_eq!(cached.scale_factor, Some(2));
+        assert_eq!(cached.transformation, t);
+    }
 }
@@ -19,6 +19,7 @@ extern crate xkbcommon;
 mod logging;
 
 mod action;
+mod autocorrect;
 pub mod data;
 mod drawing;
 pub mod float_ord;
@@ -30,9 +31,11 @@ mod locale_config;
 mod manager;
 mod outputs;
 mod popover;
+pub mod prediction;
 mod resources;
 mod style;
 mod submission;
+mod swipe;
 pub mod tests;
 pub mod util;
 mod ui_manager;
@@ -0,0 +1,674 @@
+/*! Word completion based on a compiled dictionary.
+ *
+ * Dictionaries are compiled ahead of time
+ * (see the `compile_dictionary` tool) into a byte trie
+ * with identical subtrees merged,
+ * and are memory-mapped instead of parsed at startup.
+ *
+ * File format, all integers little endian:
+ *
+ * ```text
+ * header: b"SQWD", version: u8, 3 bytes padding, root offset: u32
+ * node:   weight: u8, best: u8, child count: u8,
+ *         child count × (label: u8, node offset: u32), sorted by label
+ * ```
+ *
+ * `weight` is 0 for nodes that don't end a word,
+ * otherwise the quantized word frequency.
+ * `best` is the highest weight of any word in the subtree,
+ * which lets the search visit the most likely words first.
+ * Children are always stored before their parents,
+ * so following offsets can't loop even in a corrupted file.
+ */
+
+use std::cmp;
+use std::collections::{ BinaryHeap, HashMap };
+use std::collections::BTreeMap;
+use std::env;
+use std::fmt;
+use std::path::{ Path, PathBuf };
+use std::str;
+
+use ::locale_config::system_locale;
+use ::logging;
+use ::util::MappedFile;
+use ::xdg;
+
+// Traits
+use ::logging::Warn;
+
+
+const MAGIC: &[u8] = b"SQWD";
+const VERSION: u8 = 1;
+const HEADER_SIZE: usize = 12;
+const NODE_HEADER_SIZE: usize = 3;
+const CHILD_SIZE: usize = 5;
+
+/// How many trie nodes a single lookup may visit.
+/// Bounds the time spent per keystroke
+/// independently of the dictionary and the prefix,
+/// at well below a millisecond.
+pub const EXPANSION_BUDGET: usize = 2000;
+
+#[derive(Debug, PartialEq)]
+pub enum Error {
+    BadMagic,
+    UnsupportedVersion(u8),
+    Corrupted,
+}
+
+impl fmt::Display for Error {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        match self {
+            Error::BadMagic => write!(f, "Not a dictionary"),
+            Error::UnsupportedVersion(v) => {
+                write!(f, "Unsupported dictionary version {}", v)
+            },
+            Error::Corrupted => write!(f, "Dictionary corrupted"),
+        }
+    }
+}
+
+fn read_u32(data: &[u8], offset: usize) -> Option<u32> {
+    data.get(offset..offset + 4).map(|b| {
+        b[0] as u32
+            | (b[1] as u32) << 8
+            | (b[2] as u32) << 16
+            | (b[3] as u32) << 24
+    })
+}
+
+fn push_u32(data: &mut Vec<u8>, value: u32) {
+    for i in 0..4 {
+        data.push((value >> (8 * i)) as u8);
+    }
+}
+
+struct Node<'a> {
+    offset: usize,
+    weight: u8,
+    best: u8,
+    /// Packed (label, offset) entries
+    children: &'a [u8],
+}
+
+impl<'a> Node<'a> {
+    fn child_count(&self) -> usize {
+        self.children.len() / CHILD_SIZE
+    }
+
+    fn child_at(&self, index: usize) -> (u8, usize) {
+        let entry = &self.children[index * CHILD_SIZE..];
+        (entry[0], read_u32(entry, 1).unwrap() as usize)
+    }
+
+    fn child(&self, label: u8) -> Option<usize> {
+        let (mut low, mut high) = (0, self.child_count());
+        while low < high {
+            let mid = (low + high) / 2;
+            let (l, offset) = self.child_at(mid);
+            match l.cmp(&label) {
+                cmp::Ordering::Less => low = mid + 1,
+                cmp::Ordering::Greater => high = mid,
+                cmp::Ordering::Equal => return Some(offset),
+            }
+        }
+        None
+    }
+}
+
+/// A search frontier entry.
+/// Ordered by the best weight reachable,
+/// then finished words before unexplored nodes,
+/// then alphabetically.
+#[derive(PartialEq, Eq, PartialOrd, Ord)]
+struct Candidate {
+    weight: u8,
+    is_word: bool,
+    word: cmp::Reverse<Vec<u8>>,
+    offset: usize,
+}
+
+/// A view of compiled dictionary data.
+pub struct Dictionary<'a> {
+    data: &'a [u8],
+    root: usize,
+}
+
+impl<'a> Dictionary<'a> {
+    pub fn new(data: &'a [u8]) -> Result<Dictionary<'a>, Error> {
+        if data.get(..MAGIC.len()) != Some(MAGIC) {
+            return Err(Error::BadMagic);
+        }
+        match data.get(MAGIC.len()) {
+            Some(&VERSION) => {},
+            Some(&v) => return Err(Error::UnsupportedVersion(v)),
+            None => return Err(Error::Corrupted),
+        };
+        let root = read_u32(data, 8).ok_or(Error::Corrupted)? as usize;
+        let dict = Dictionary { data, root };
+        match dict.node(root, data.len()) {
+            Some(_) => Ok(dict),
+            None => Err(Error::Corrupted),
+        }
+    }
+
+    /// Reads the node at `offset`, which must come before `limit`.
+    fn node(&self, offset: usize, limit: usize) -> Option<Node<'a>> {
+        if offset < HEADER_SIZE || offset >= limit {
+            return None;
+        }
+        let header = self.data.get(offset..offset + NODE_HEADER_SIZE)?;
+        let start = offset + NODE_HEADER_SIZE;
+        let children = self.data.get(
+            start..start + header[2] as usize * CHILD_SIZE
+        )?;
+        Some(Node {
+            offset,
+            weight: header[0],
+            best: header[1],
+            children,
+        })
+    }
+
+    /// Follows the prefix from the root
+    fn find(&self, prefix: &str) -> Option<Node<'a>> {
+        let mut node = self.node(self.root, self.data.len())?;
+        for &label in prefix.as_bytes() {
+            node = node.child(label)
+                .and_then(|offset| self.node(offset, node.offset))?;
+        }
+        Some(node)
+    }
+
+    /// Whether the word is in the dictionary, exactly as given
+    pub fn contains(&self, word: &str) -> bool {
+        self.find(word).map(|node| node.weight > 0).unwrap_or(false)
+    }
+
+    /// Returns up to `count` words starting with `prefix`,
+    /// but longer than it, most frequent first.
+    /// Gives up on less likely words after visiting `budget` nodes.
+    pub fn complete(&self, prefix: &str, count: usize, budget: usize)
+        -> Vec<String>
+    {
+        let node = match self.find(prefix) {
+            Some(node) => node,
+            None => return Vec::new(),
+        };
+
+        let mut found = Vec::new();
+        let mut frontier = BinaryHeap::new();
+        frontier.push(Candidate {
+            weight: node.best,
+            is_word: false,
+            word: cmp::Reverse(prefix.as_bytes().to_vec()),
+            offset: node.offset,
+        });
+        let mut expanded = 0;
+        while let Some(candidate) = frontier.pop() {
+            if found.len() >= count {
+                break;
+            }
+            let cmp::Reverse(word) = candidate.word;
+            if candidate.is_word {
+                if let Ok(word) = String::from_utf8(word) {
+                    found.push(word);
+                }
+                continue;
+            }
+            if expanded >= budget {
+                break;
+            }
+            expanded += 1;
+            // Offsets got validated when the candidate was queued
+            let node = self.node(candidate.offset, self.data.len()).unwrap();
+            if node.weight > 0 && word.len() > prefix.len() {
+                frontier.push(Candidate {
+                    weight: node.weight,
+                    is_word: true,
+                    word: cmp::Reverse(word.clone()),
+                    offset: node.offset,
+                });
+            }
+            for i in 0..node.child_count() {
+                let (label, offset) = node.child_at(i);
+                if let Some(child) = self.node(offset, node.offset) {
+                    let mut word = word.clone();
+                    word.push(label);
+                    frontier.push(Candidate {
+                        weight: child.best,
+                        is_word: false,
+                        word: cmp::Reverse(word),
+                        offset,
+                    });
+                }
+            }
+        }
+        found
+    }
+
+    /// Like `complete`, but a prefix starting with a capital,
+    /// like at the start of a sentence,
+    /// also gets completed like its lowercase form.
+    /// The capital is kept, so the words still start with the prefix.
+    /// Those come first, because words in the dictionary are mostly
+    /// lowercase.
+    pub fn complete_capitalized(&self, prefix: &str, count: usize, budget: usize)
+        -> Vec<String>
+    {
+        let mut chars = prefix.chars();
+        let lowered = match chars.next() {
+            Some(first) if first.is_uppercase() => {
+                first.to_lowercase().chain(chars).collect::<String>()
+            },
+            _ => return self.complete(prefix, count, budget),
+        };
+        let mut found: Vec<String> = self.complete(&lowered, count, budget)
+            .into_iter()
+            .map(|word| format!("{}{}", prefix, &word[lowered.len()..]))
+            .collect();
+        for word in self.complete(prefix, count, budget) {
+            if found.len() >= count {
+                break;
+            }
+            if !found.contains(&word) {
+                found.push(word);
+            }
+        }
+        found
+    }
+}
+
+struct WalkEntry<S> {
+    offset: usize,
+    /// The parent's offset
+    limit: usize,
+    word: Vec<u8>,
+    /// Where the last, possibly incomplete, character starts
+    char_start: usize,
+    state: S,
+}
+
+impl<'a> Dictionary<'a> {
+    /// Visits words depth-first, letting `step` prune branches.
+    /// `step` receives the state of the parent and the next character,
+    /// and returns the state for the child, or None to skip the branch.
+    /// `found` receives every word not pruned, its weight, and its state.
+    /// Gives up after visiting `budget` nodes, and then returns false.
+    pub fn walk<S, F, G>(&self, init: S, budget: usize, mut step: F, mut found: G)
+        -> bool
+        where
+            F: FnMut(&S, char) -> Option<S>,
+            G: FnMut(&str, u8, &S),
+            S: Clone,
+    {
+        let mut stack = vec![WalkEntry {
+            offset: self.root,
+            limit: self.data.len(),
+            word: Vec::new(),
+            char_start: 0,
+            state: init,
+        }];
+        let mut expanded = 0;
+        while let Some(entry) = stack.pop() {
+            if expanded >= budget {
+                return false;
+            }
+            expanded += 1;
+            let node = match self.node(entry.offset, entry.limit) {
+                Some(node) => node,
+                None => continue,
+            };
+            if node.weight > 0 && entry.char_start == entry.word.len() {
+                if let Ok(word) = str::from_utf8(&entry.word) {
+                    found(word, node.weight, &entry.state);
+                }
+            }
+            for i in 0..node.child_count() {
+                let (label, offset) = node.child_at(i);
+                let mut word = entry.word.clone();
+                word.push(label);
+                let child = match str::from_utf8(&word[entry.char_start..]) {
+                    Ok(c) => {
+                        let c = c.chars().next().unwrap();
+                        step(&entry.state, c).map(|state| WalkEntry {
+                            offset,
+                            limit: node.offset,
+                            char_start: word.len(),
+                            word,
+                            state,
+                        })
+                    },
+                    // The character continues in the next byte
+                    Err(ref e) if e.error_len().is_none() => Some(WalkEntry {
+                        offset,
+                        limit: node.offset,
+                        word,
+                        char_start: entry.char_start,
+                        state: entry.state.clone(),
+                    }),
+                    Err(_) => None,
+                };
+                if let Some(child) = child {
+                    stack.push(child);
+                }
+            }
+        }
+        true
+    }
+}
+
+/// Maps word counts onto 1..=255 logarithmically,
+/// relative to the most frequent word.
+fn quantize(count: u64, max: u64) -> u8 {
+    let count = cmp::max(count, 1) as f64;
+    let max = cmp::max(max, 2) as f64;
+    let scaled = 1.0 + 254.0 * count.ln() / max.ln();
+    scaled.max(1.0).min(255.0) as u8
+}
+
+#[derive(Default)]
+struct BuildNode {
+    count: Option<u64>,
+    children: BTreeMap<u8, usize>,
+}
+
+/// Serializes the node and its descendants,
+/// reusing identical subtrees already written.
+/// Returns the offset and the best weight.
+fn write_node(
+    nodes: &[BuildNode],
+    index: usize,
+    max: u64,
+    written: &mut HashMap<Vec<u8>, usize>,
+    out: &mut Vec<u8>,
+) -> (usize, u8) {
+    let node = &nodes[index];
+    let weight = node.count.map(|c| quantize(c, max)).unwrap_or(0);
+    let mut best = weight;
+    let mut children = Vec::new();
+    for (&label, &child) in node.children.iter() {
+        let (offset, child_best) = write_node(nodes, child, max, written, out);
+        best = cmp::max(best, child_best);
+        children.push(label);
+        push_u32(&mut children, offset as u32);
+    }
+    let mut encoded = vec![weight, best, node.children.len() as u8];
+    encoded.extend_from_slice(&children);
+    if let Some(&offset) = written.get(&encoded) {
+        return (offset, best);
+    }
+    let offset = out.len();
+    out.extend_from_slice(&encoded);
+    written.insert(encoded, offset);
+    (offset, best)
+}
+
+/// Builds dictionary data out of words and their frequencies.
+/// Repeated words have their counts added up.
+pub fn compile<'a, I>(words: I) -> Vec<u8>
+    where I: IntoIterator<Item=(&'a str, u64)>
+{
+    let mut nodes = vec![BuildNode::default()];
+    for (word, count) in words {
+        // A NUL label would allow 256 children,
+        // and no text input produces it anyway
+        if word.is_empty() || word.as_bytes().contains(&0) {
+            continue;
+        }
+        let mut index = 0;
+        for &label in word.as_bytes() {
+            index = match nodes[index].children.get(&label) {
+                Some(&child) => child,
+                None => {
+                    nodes.push(BuildNode::default());
+                    let child = nodes.len() - 1;
+                    nodes[index].children.insert(label, child);
+                    child
+                },
+            };
+        }
+        let node = &mut nodes[index];
+        node.count = Some(node.count.unwrap_or(0).saturating_add(count));
+    }
+    let max = nodes.iter().filter_map(|n| n.count).max().unwrap_or(1);
+
+    let mut out = Vec::new();
+    out.extend_from_slice(MAGIC);
+    out.extend_from_slice(&[VERSION, 0, 0, 0]);
+    push_u32(&mut out, 0);
+    let (root, _best) = write_node(&nodes, 0, max, &mut HashMap::new(), &mut out);
+    let root = root as u32;
+    out[8..12].copy_from_slice(&[
+        root as u8, (root >> 8) as u8, (root >> 16) as u8, (root >> 24) as u8,
+    ]);
+    out
+}
+
+/// Returns the word being typed at the byte offset `cursor`,
+/// or None if there's nothing to complete.
+/// The cursor in the middle of a word doesn't count as typing.
+pub fn current_word(text: &str, cursor: usize) -> Option<&str> {
+    let is_word_char = |c: char| c.is_alphabetic() || c == '\'';
+    if cursor > text.len() || !text.is_char_boundary(cursor) {
+        return None;
+    }
+    let (before, after) = text.split_at(cursor);
+    if after.chars().next().map(is_word_char).unwrap_or(false) {
+        return None;
+    }
+    let start = before.char_indices().rev()
+        .take_while(|&(_, c)| is_word_char(c))
+        .last()
+        .map(|(i, _)| i);
+    match start {
+        Some(start) => Some(&before[start..]),
+        None => None,
+    }
+}
+
+/// A dictionary kept in a file
+pub struct Predictor {
+    file: MappedFile,
+}
+
+impl Predictor {
+    pub fn open(path: &Path) -> Result<Predictor, String> {
+        let file = MappedFile::open(path)?;
+        Dictionary::new(file.as_bytes())
+            .map_err(|e| format!("{:?}: {}", path, e))?;
+        Ok(Predictor { file })
+    }
+
+    pub fn get_dictionary(&self) -> Option<Dictionary<'_>> {
+        // Checked when opening
+        Dictionary::new(self.file.as_bytes()).ok()
+    }
+
+    pub fn complete(&self, prefix: &str, count: usize) -> Vec<String> {
+        match self.get_dictionary() {
+            Some(dict) => dict.complete_capitalized(
+                prefix,
+                count,
+                EXPANSION_BUDGET,
+            ),
+            None => Vec::new(),
+        }
+    }
+}
+
+/// Dictionaries are named like `en-US.dict` or `en.dict`.
+fn dictionary_names(lang: &str) -> Vec<String> {
+    let mut names = vec![format!("{}.dict", lang)];
+    if let Some(idx) = lang.find('-') {
+        names.push(format!("{}.dict", &lang[..idx]));
+    }
+    names
+}
+
+/// Finds the dictionary for the language of the system locale
+pub fn load_for_system_locale() -> Option<Predictor> {
+    let path = env::var_os("SQUEEKBOARD_DICTIONARIESDIR")
+        .map(PathBuf::from)
+        .or_else(|| xdg::data_path("squeekboard/dictionaries"))?;
+    let lang = system_locale()
+        .map(|locale|
+            locale.tags_for("messages")
+                .next().unwrap() // guaranteed to exist
+                .as_ref()
+                .to_owned()
+        )?;
+    dictionary_names(&lang).into_iter()
+        .map(|name| path.join(name))
+        .find(|path| path.exists())
+        .and_then(|path| {
+            Predictor::open(&path)
+                .or_print(logging::Problem::Warning, "Can't load dictionary")
+        })
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    fn sample() -> Vec<u8> {
+        compile(vec![
+            ("the", 1000),
+            ("then", 50),
+            ("there", 300),
+            ("these", 200),
+            ("they", 400),
+            ("this", 500),
+            ("tho", 1),
+            ("a", 900),
+        ])
+    }
+
+    #[test]
+    fn complete_by_frequency() {
+        let data = sample();
+        let dict = Dictionary::new(&data).unwrap();
+        assert_eq!(
+            dict.complete("th", 3, EXPANSION_BUDGET),
+            vec!["the", "this", "they"],
+        );
+        assert_eq!(
+            dict.complete("the", 10, EXPANSION_BUDGET),
+            vec!["they", "there", "these", "then"],
+        );
+    }
+
+    #[test]
+    fn complete_missing() {
+        let data = sample();
+        let dict = Dictionary::new(&data).unwrap();
+        assert!(dict.complete("x", 3, EXPANSION_BUDGET).is_empty());
+        assert!(dict.complete("they", 3, EXPANSION_BUDGET).is_empty());
+    }
+
+    #[test]
+    fn complete_capitalized() {
+        let data = compile(vec![
+            ("the", 1000),
+            ("they", 400),
+            ("Thea", 10),
+            ("istanbul", 5),
+        ]);
+        let dict = Dictionary::new(&data).unwrap();
+        assert_eq!(
+            dict.complete_capitalized("Th", 3, EXPANSION_BUDGET),
+            vec!["The", "They", "Thea"],
+        );
+        assert_eq!(
+            dict.complete_capitalized("th", 3, EXPANSION_BUDGET),
+            vec!["the", "they"],
+        );
+        assert_eq!(
+            dict.complete_capitalized("Ist", 3, EXPANSION_BUDGET),
+            vec!["Istanbul"],
+        );
+    }
+
+    #[test]
+    fn complete_within_budget() {
+        let data = sample();
+        let dict = Dictionary::new(&data).unwrap();
+        // The root, "t", "th", "the" get visited before any word is found
+        assert!(dict.complete("", 3, 3).is_empty());
+        assert_eq!(dict.complete("", 1, 4), vec!["the"]);
+    }
+
+    #[test]
+    fn walk_pruned() {
+        let data = compile(vec![("żaba", 1), ("żuk", 2), ("zebra", 3)]);
+        let dict = Dictionary::new(&data).unwrap();
+        let mut found = Vec::new();
+        let finished = dict.walk(
+            0,
+            EXPANSION_BUDGET,
+            |depth, c| match (depth, c) {
+                (0, 'ż') => Some(1),
+                (0, _) => None,
+                (_, 'a') => None,
+                (d, _) => Some(d + 1),
+            },
+            |word, weight, depth| found.push((word.to_owned(), weight, *depth)),
+        );
+        assert_eq!(found, vec![("żuk".to_owned(), quantize(2, 3), 3)]);
+        assert!(finished);
+    }
+
+    #[test]
+    fn walk_within_budget() {
+        let data = sample();
+        let dict = Dictionary::new(&data).unwrap();
+        let mut found = 0;
+        assert!(!dict.walk((), 3, |_, _| Some(()), |_, _, _| found += 1));
+        assert_eq!(found, 0);
+    }
+
+    #[test]
+    fn contains() {
+        let data = sample();
+        let dict = Dictionary::new(&data).unwrap();
+        assert!(dict.contains("the"));
+        // Only a prefix
+        assert!(!dict.contains("th"));
+        assert!(!dict.contains("thee"));
+    }
+
+    #[test]
+    fn compile_merges_suffixes() {
+        let separate = compile(vec![("walking", 1), ("talking", 1)]);
+        let single = compile(vec![("walking", 1)]);
+        // The root gains an edge, everything below it is shared
+        assert_eq!(separate.len() - single.len(), CHILD_SIZE);
+    }
+
+    #[test]
+    fn reject_corrupted() {
+        assert_eq!(Dictionary::new(b"SQWE").err(), Some(Error::BadMagic));
+        let mut data = sample();
+        data[4] = 2;
+        assert_eq!(
+            Dictionary::new(&data).err(),
+            Some(Error::UnsupportedVersion(2)),
+        );
+        let mut data = sample();
+        let len = data.len();
+        data.truncate(len - 1);
+        assert_eq!(Dictionary::new(&data).err(), Some(Error::Corrupted));
+    }
+
+    #[test]
+    fn find_current_word() {
+        assert_eq!(current_word("hello wor", 9), Some("wor"));
+        assert_eq!(current_word("don't", 5), Some("don't"));
+        assert_eq!(current_word("żół", 6), Some("żół"));
+        assert_eq!(current_word("hello ", 6), None);
+        assert_eq!(current_word("hello", 3), None);
+        assert_eq!(current_word("hello", 10), None);
+        assert_eq!(current_word("żół", 1), None);
+    }
+}
@@ -98,6 +98,32 @@ static KEYBOARDS: &[(&'static str, &'static str)] = &[
     ("emoji/us", include_str!("../data/keyboards/emoji/us.yaml")),
 ];
 
+/// Gathers stuff defined in C or called by C
+pub mod c {
+    use super::*;
+    use std::ffi::CString;
+    use std::os::raw::{ c_char, c_void };
+
+    /// Calls the callback with the name of each builtin layout,
+    /// including arrangements and overlays.
+    #[no_mangle]
+    pub extern "C"
+    fn squeek_builtin_layout_foreach(
+        callback: extern "C" fn(name: *const c_char, data: *mut c_void),
+        data: *mut c_void,
+    ) {
+        for (name, _) in KEYBOARDS.iter() {
+            let name = CString::new(*name).expect("Bad layout name");
+            callback(name.as_ptr(), data);
+        }
+    }
+}
+
+/// Names and contents of all builtin layouts
+pub fn get_keyboards() -> &'static [(&'static str, &'static str)] {
+    KEYBOARDS
+}
+
 pub fn get_keyboard(needle: &str) -> Option<&'static str> {
     KEYBOARDS.iter().find(|(name, _)| *name == needle).map(|(_, layout)| *layout)
 }
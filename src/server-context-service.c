@@ -28,6 +28,9 @@
 #include "wayland.h"
 #include "server-context-service.h"
 
+/// Minimum, in logical pixels
+#define SUGGESTION_BAR_HEIGHT 32
+
 enum {
     PROP_0,
     PROP_VISIBLE,
@@ -48,6 +51,8 @@ struct _ServerContextService {
     gboolean visible;
     PhoshLayerSurface *window;
     GtkWidget *widget; // nullable
+    GtkWidget *suggestion_bar; // nullable
+    GStrv suggestions; // owned, nullable
     guint hiding;
     guint last_requested_height;
 };
@@ -63,6 +68,7 @@ on_destroy (ServerContextService *self, GtkWidget *widget)
 
     self->window = NULL;
     self->widget = NULL;
+    self->suggestion_bar = NULL;
 
     //eekboard_context_service_destroy (EEKBOARD_CONTEXT_SERVICE (context));
 }
@@ -103,6 +109,14 @@ calculate_height(int32_t width, GdkRectangle *geometry)
     return height;
 }
 
+/// The suggestion bar is shown above the keys while completions are active.
+/// It gets its own room, so that keys don't shrink when it appears.
+static guint
+get_suggestion_bar_height (ServerContextService *self)
+{
+    return self->suggestions ? SUGGESTION_BAR_HEIGHT : 0;
+}
+
 static void
 on_surface_configure(ServerContextService *self, PhoshLayerSurface *surface)
 {
@@ -141,7 +155,8 @@ on_surface_configure(ServerContextService *self, PhoshLayerSurface *surface)
      // this entire height calculation does nothing.
      // guint desired_height = squeek_uiman_get_perceptual_height(context->manager);
      // Temporarily use old method, until the size manager is complete.
-    guint desired_height = calculate_height(width, &geometry);
+    guint desired_height = calculate_height(width, &geometry)
+        + get_suggestion_bar_height (self);
 
     guint configured_height = (guint)height;
     // if height was already requested once but a different one was given
@@ -168,7 +183,8 @@ make_window (ServerContextService *self)
 
     struct squeek_output_handle output = squeek_outputs_get_current(squeek_wayland->outputs);
     squeek_uiman_set_output(self->manager, output);
-    uint32_t height = squeek_uiman_get_perceptual_height(self->manager);
+    uint32_t height = squeek_uiman_get_perceptual_height(self->manager)
+        + get_suggestion_bar_height (self);
 
     self->window = g_object_new (
         PHOSH_TYPE_LAYER_SURFACE,
@@ -212,18 +228,69 @@ destroy_window (ServerContextService *self)
     self->window = NULL;
 }
 
+static void
+on_suggestion_clicked (GtkButton *button, ServerContextService *self)
+{
+    guint index = GPOINTER_TO_UINT(g_object_get_data (G_OBJECT(button),
+                                                      "suggestion-index"));
+    submission_commit_suggestion (self->submission, index);
+}
+
+static void
+fill_suggestion_bar (ServerContextService *self)
+{
+    if (!self->suggestion_bar) {
+        return;
+    }
+    GList *children = gtk_container_get_children (GTK_CONTAINER(self->suggestion_bar));
+    for (GList *child = children; child; child = child->next) {
+        gtk_widget_destroy (GTK_WIDGET(child->data));
+    }
+    g_list_free (children);
+
+    if (!self->suggestions) {
+        gtk_widget_hide (self->suggestion_bar);
+        return;
+    }
+    for (guint i = 0; self->suggestions[i]; i++) {
+        GtkWidget *button = gtk_button_new_with_label (self->suggestions[i]);
+        gtk_button_set_relief (GTK_BUTTON(button), GTK_RELIEF_NONE);
+        gtk_widget_set_can_focus (button, FALSE);
+        g_object_set_data (G_OBJECT(button), "suggestion-index",
+                           GUINT_TO_POINTER(i));
+        g_signal_connect (button, "clicked",
+                          G_CALLBACK(on_suggestion_clicked), self);
+        gtk_container_add (GTK_CONTAINER(self->suggestion_bar), button);
+        gtk_widget_show (button);
+    }
+    gtk_widget_show (self->suggestion_bar);
+}
+
 static void
 make_widget (ServerContextService *self)
 {
     if (self->widget) {
         gtk_widget_destroy(self->widget);
         self->widget = NULL;
+        self->suggestion_bar = NULL;
     }
-    self->widget = eek_gtk_keyboard_new (self->state, self->submission, self->layout);
-
-    gtk_widget_set_has_tooltip (self->widget, TRUE);
+    GtkWidget *keyboard = eek_gtk_keyboard_new (self->state, self->submission, self->layout);
+    gtk_widget_set_has_tooltip (keyboard, TRUE);
+
+    // Keeps its height even when empty,
+    // so that keys don't move when a word is started or finished.
+    // The surface grows by that height while the bar is shown.
+    self->suggestion_bar = gtk_box_new (GTK_ORIENTATION_HORIZONTAL, 0);
+    gtk_box_set_homogeneous (GTK_BOX(self->suggestion_bar), TRUE);
+    gtk_widget_set_size_request (self->suggestion_bar, -1, SUGGESTION_BAR_HEIGHT);
+    gtk_widget_set_name (self->suggestion_bar, "suggestions");
+
+    self->widget = gtk_box_new (GTK_ORIENTATION_VERTICAL, 0);
+    gtk_box_pack_start (GTK_BOX(self->widget), self->suggestion_bar, FALSE, FALSE, 0);
+    gtk_box_pack_start (GTK_BOX(self->widget), keyboard, TRUE, TRUE, 0);
     gtk_container_add (GTK_CONTAINER(self->window), self->widget);
     gtk_widget_show_all(self->widget);
+    fill_suggestion_bar (self);
 }
 
 static void
@@ -375,6 +442,7 @@ server_context_service_dispose (GObject *object)
 
     destroy_window (self);
     self->widget = NULL;
+    g_clear_pointer (&self->suggestions, g_strfreev);
 
     G_OBJECT_CLASS (server_context_service_parent_class)->dispose (object);
 }
@@ -463,3 +531,17 @@ server_context_service_update_visible (ServerContextService *self, gboolean visi
     }
 }
 
+void
+server_context_service_set_suggestions (ServerContextService *self, const char *const *words)
+{
+    guint old_bar_height = get_suggestion_bar_height (self);
+    g_strfreev (self->suggestions);
+    self->suggestions = g_strdupv ((gchar **)words);
+    fill_suggestion_bar (self);
+    // Make room for the bar, or give it back to the keys
+    if (old_bar_height != get_suggestion_bar_height (self)
+            && self->window
+            && gtk_widget_get_realized (GTK_WIDGET(self->window))) {
+        on_surface_configure (self, self->window);
+    }
+}
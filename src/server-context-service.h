@@ -33,6 +33,8 @@ ServerContextService *server_context_service_new(EekboardContextService *self, s
 enum squeek_arrangement_kind server_context_service_get_layout_type(ServerContextService *);
 void server_context_service_force_show_keyboard (ServerContextService *self);
 void server_context_service_hide_keyboard (ServerContextService *self);
+/// Replaces the words in the suggestion bar. Hides the bar if `words` is NULL.
+void server_context_service_set_suggestions (ServerContextService *self, const char *const *words);
 G_END_DECLS
 #endif  /* SERVER_CONTEXT_SERVICE_H */
 
@@ -18,6 +18,7 @@ struct submission* get_submission(struct zwp_input_method_manager_v2 *immanager,
 // Defined in Rust
 struct submission* submission_new(struct zwp_input_method_v2 *im, struct zwp_virtual_keyboard_v1 *vk, EekboardContextService *state, struct vis_manager *vis_manager);
 uint8_t submission_hint_available(struct submission *self);
+void submission_commit_suggestion(struct submission *self, uint32_t index);
 void submission_set_ui(struct submission *self, ServerContextService *ui_context);
 void submission_use_layout(struct submission *self, struct squeek_layout *layout, uint32_t time);
 #endif
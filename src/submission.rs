@@ -19,11 +19,14 @@
 
 use std::collections::HashSet;
 use std::ffi::CString;
+use std::rc::Rc;
 use ::action::Modifier;
 use ::imservice;
 use ::imservice::IMService;
 use ::keyboard::{ KeyCode, KeyStateId, Modifiers, PressType };
 use ::layout;
+use ::logging;
+use ::swipe;
 use ::ui_manager::VisibilityManager;
 use ::util::vec_remove;
 use ::vkeyboard;
@@ -75,6 +78,9 @@ pub mod c {
                 pressed: Vec::new(),
                 keymap_fds: Vec::new(),
                 keymap_idx: None,
+                keymap_cache: vkeyboard::KeyMapCache::new_default(),
+                switch_counter: SwitchCounter::default(),
+                letter_keys: swipe::KeyCenters::new(Vec::new()),
             }
         ))
     }
@@ -105,15 +111,29 @@ pub mod c {
             .map(|imservice| imservice.is_active());
         (Some(true) == active) as u8
     }
+
+    #[no_mangle]
+    pub extern "C"
+    fn submission_commit_suggestion(submission: *mut Submission, index: u32) {
+        if submission.is_null() {
+            panic!("Null submission pointer");
+        }
+        let submission: &mut Submission = unsafe { &mut *submission };
+        if let Some(imservice) = submission.imservice.as_mut() {
+            // Suggestions are only shown while the input method is active
+            let _ = imservice.commit_suggestion(index as usize);
+        }
+    }
 }
 
 #[derive(Clone, Copy)]
 pub struct Timestamp(pub u32);
 
-#[derive(Clone)]
 enum SubmittedAction {
-    /// A collection of keycodes that were pressed
-    VirtualKeyboard(Vec<KeyCode>),
+    /// The keycode to release together with the key.
+    /// None if the key was made of multiple keycodes,
+    /// which all got released already on press.
+    VirtualKeyboard(Option<KeyCode>),
     IMService,
 }
 
@@ -122,8 +142,46 @@ pub struct Submission {
     virtual_keyboard: VirtualKeyboard,
     modifiers_active: Vec<(KeyStateId, Modifier)>,
     pressed: Vec<(KeyStateId, SubmittedAction)>,
-    keymap_fds: Vec<vkeyboard::c::KeyMap>,
+    keymap_fds: Vec<Rc<vkeyboard::c::KeyMap>>,
     keymap_idx: Option<usize>,
+    keymap_cache: vkeyboard::KeyMapCache,
+    switch_counter: SwitchCounter,
+    /// Letters of the base view, for judging typos
+    letter_keys: swipe::KeyCenters,
+}
+
+/// Keystrokes sent to the virtual keyboard,
+/// and keymap switches they caused
+#[derive(Default)]
+struct SwitchCounter {
+    keystrokes: u32,
+    switches: u32,
+}
+
+impl SwitchCounter {
+    /// Reports the rate once in this many keystrokes
+    const PERIOD: u32 = 1000;
+
+    fn count_keystroke(&mut self) {
+        self.keystrokes += 1;
+        if self.keystrokes == Self::PERIOD {
+            log_print!(
+                logging::Level::Debug,
+                "Keymap switches per {} keystrokes: {}",
+                Self::PERIOD,
+                self.switches,
+            );
+            *self = SwitchCounter::default();
+        }
+    }
+}
+
+/// Whether typing the text ends a word
+fn is_word_boundary(text: &CString) -> bool {
+    match text.as_bytes() {
+        b" " | b"." | b"," | b"!" | b"?" | b";" | b":" => true,
+        _ => false,
+    }
 }
 
 pub enum SubmitData<'a> {
@@ -139,7 +197,7 @@ impl Submission {
         &mut self,
         key_id: KeyStateId,
         data: SubmitData,
-        keycodes: &Vec<KeyCode>,
+        keycodes: &[KeyCode],
         time: Timestamp,
     ) {
         let mods_are_on = !self.modifiers_active.is_empty();
@@ -153,7 +211,15 @@ impl Submission {
 
                 let submit_outcome = match data {
                     SubmitData::Text(text) => {
-                        Outcome::Submitted(imservice.commit_string(text))
+                        // The correction and the boundary
+                        // get committed together
+                        let corrected = match is_word_boundary(text) {
+                            true => imservice.autocorrect(&self.letter_keys),
+                            false => Ok(()),
+                        };
+                        Outcome::Submitted(
+                            corrected.and_then(|()| imservice.commit_string(text))
+                        )
                     },
                     SubmitData::Erase => {
                         /* Delete_surrounding_text takes byte offsets,
@@ -182,6 +248,10 @@ impl Submission {
         let submit_action = match was_committed_as_text {
             true => SubmittedAction::IMService,
             false => {
+                if let Some(imservice) = &mut self.imservice {
+                    imservice.mark_text_outdated();
+                }
+                self.switch_counter.count_keystroke();
                 let keycodes_count = keycodes.len();
                 for keycode in keycodes.iter() {
                     self.select_keymap(keycode.keymap_idx, time);
@@ -210,7 +280,10 @@ impl Submission {
                         },
                     };
                 }
-                SubmittedAction::VirtualKeyboard(keycodes.clone())
+                SubmittedAction::VirtualKeyboard(match keycodes_count {
+                    1 => Some(keycodes[0]),
+                    _ => None,
+                })
             },
         };
         
@@ -226,23 +299,17 @@ impl Submission {
                 SubmittedAction::IMService => {},
                 // no matter if the imservice got activated,
                 // keys must be released
-                SubmittedAction::VirtualKeyboard(keycodes) => {
-                    let keycodes_count = keycodes.len();
-                    match keycodes_count {
-                        1 => {
-                            let keycode = &keycodes[0];
-                            self.select_keymap(keycode.keymap_idx, time);
-                            self.virtual_keyboard.switch(
-                                keycode.code,
-                                PressType::Released,
-                                time,
-                            );
-                        },
-                        // Design choice here: submit multiple all at press time
-                        // and do nothing at release time.
-                        _ => {},
-                    };
+                SubmittedAction::VirtualKeyboard(Some(keycode)) => {
+                    self.select_keymap(keycode.keymap_idx, time);
+                    self.virtual_keyboard.switch(
+                        keycode.code,
+                        PressType::Released,
+                        time,
+                    );
                 },
+                // Design choice here: submit multiple all at press time
+                // and do nothing at release time.
+                SubmittedAction::VirtualKeyboard(None) => {},
             }
         };
     }
@@ -300,16 +367,19 @@ impl Submission {
     }
 
     fn release_all_virtual_keys(&mut self, time: Timestamp) {
-        let virtual_pressed = self.pressed
-            .clone().into_iter()
-            .filter_map(|(id, action)| {
-                match action {
-                    SubmittedAction::VirtualKeyboard(_) => Some(id),
-                    _ => None,
-                }
-            });
-        for id in virtual_pressed {
-            self.handle_release(id, time);
+        // Releasing removes the key from the list,
+        // so look it up anew every time.
+        loop {
+            let id = self.pressed.iter()
+                .find(|(_id, action)| match action {
+                    SubmittedAction::VirtualKeyboard(_) => true,
+                    _ => false,
+                })
+                .map(|(id, _action)| *id);
+            match id {
+                Some(id) => self.handle_release(id, time),
+                None => break,
+            }
         }
     }
 
@@ -325,6 +395,10 @@ impl Submission {
     /// due to modifiers meaning different things in different keymaps.
     fn select_keymap(&mut self, idx: usize, time: Timestamp) {
         if self.keymap_idx != Some(idx) {
+            // The first keymap of a layout is not caused by typing
+            if self.keymap_idx.is_some() {
+                self.switch_counter.switches += 1;
+            }
             self.keymap_idx = Some(idx);
             self.clear_all_modifiers();
             self.release_all_virtual_keys(time);
@@ -333,14 +407,50 @@ impl Submission {
         }
     }
     
+    /// Whether drags across letters should get decoded as words
+    pub fn is_swipe_available(&self) -> bool {
+        self.imservice.as_ref()
+            .map(|imservice| imservice.is_swipe_available())
+            .unwrap_or(false)
+    }
+
+    /// Submits the rest of the word the gesture stands for.
+    pub fn handle_swipe(
+        &mut self,
+        keys: &swipe::KeyCenters,
+        gesture: &swipe::Gesture,
+    ) {
+        if let Some(imservice) = self.imservice.as_mut() {
+            // The gesture was only started while the input method was active
+            let _ = imservice.commit_swipe(keys, gesture);
+        }
+    }
+
     pub fn use_layout(&mut self, layout: &layout::Layout, time: Timestamp) {
+        // Keys of the old layout may have no counterpart in the new one,
+        // so they would never get released otherwise.
+        // This must happen while their keymaps are still in place.
+        self.clear_all_modifiers();
+        self.release_all_virtual_keys(time);
+
+        self.letter_keys = layout.get_letter_keys();
+        let active = self.keymap_idx
+            .and_then(|idx| self.keymap_fds.get(idx).cloned());
+        let cache = &mut self.keymap_cache;
         self.keymap_fds = layout.keymaps.iter()
-            .map(|keymap_str| vkeyboard::c::KeyMap::from_cstr(
-                keymap_str.as_c_str()
-            ))
+            .map(|keymap_str| cache.get(keymap_str.as_c_str()))
             .collect();
         self.keymap_idx = None;
 
+        // Layouts with the same symbols share keymaps,
+        // and those need no upload.
+        if let Some(idx) = active.and_then(|active| {
+            self.keymap_fds.iter().position(|k| Rc::ptr_eq(k, &active))
+        }) {
+            self.keymap_idx = Some(idx);
+            return;
+        }
+
         // This can probably be eliminated,
         // because key presses can trigger an update anyway.
         // However, self.keymap_idx needs to become Option<>
@@ -348,3 +458,131 @@ impl Submission {
         self.select_keymap(0, time);
     }
 }
+
+#[cfg(test)]
+pub mod test {
+    use super::*;
+
+    /// Submits to the virtual keyboard only, with the first keymap selected
+    pub fn make_submission() -> Submission {
+        Submission {
+            imservice: None,
+            modifiers_active: Vec::new(),
+            virtual_keyboard: VirtualKeyboard(
+                vkeyboard::c::ZwpVirtualKeyboardV1::null()
+            ),
+            pressed: Vec::new(),
+            keymap_fds: Vec::new(),
+            keymap_idx: Some(0),
+            keymap_cache: vkeyboard::KeyMapCache::new(None),
+            switch_counter: SwitchCounter::default(),
+            letter_keys: swipe::KeyCenters::new(Vec::new()),
+        }
+    }
+
+    /// Submits to the input method first
+    pub fn make_im_submission(imservice: IMService) -> Submission {
+        Submission {
+            imservice: Some(Box::new(imservice)),
+            ..make_submission()
+        }
+    }
+
+    #[test]
+    fn keycodes_outdate_text() {
+        use ::imservice::test::{ make_imservice, receive_text, take_requests };
+        use ::imservice::test::Request;
+
+        let mut imservice = make_imservice("keycodes", vec![("hello", 1)]);
+        receive_text(&mut imservice, "helo");
+        let mut submission = make_submission();
+        submission.imservice = Some(Box::new(imservice));
+
+        // Backspace goes around the input method
+        let backspace = [KeyCode { code: 22, keymap_idx: 0 }];
+        submission.handle_press(
+            KeyStateId(0),
+            SubmitData::Erase,
+            &backspace,
+            Timestamp(0),
+        );
+        submission.handle_release(KeyStateId(0), Timestamp(1));
+        take_requests();
+
+        // The text is "hel" now, so "helo" must not get corrected
+        let space = CString::new(" ").unwrap();
+        submission.handle_press(
+            KeyStateId(1),
+            SubmitData::Text(&space),
+            &[],
+            Timestamp(2),
+        );
+        assert_eq!(take_requests(), vec![Request::Commit(" ".into())]);
+    }
+
+    /// A layout with no buttons, using the keymap
+    fn make_keymap_layout(keymap: &str) -> layout::Layout {
+        let mut layout = ::layout::test::make_layout(
+            Vec::new(),
+            vec![(
+                "base".into(),
+                (
+                    ::layout::c::Point { x: 0.0, y: 0.0 },
+                    ::layout::View::new(vec![]),
+                ),
+            )],
+        );
+        layout.keymaps = vec![CString::new(keymap).unwrap()];
+        layout
+    }
+
+    #[test]
+    fn shared_keymap_releases_keys() {
+        use ::vkeyboard::c::test::{ take_events, Event };
+
+        let make_layout = || make_keymap_layout("xkb_keymap { }");
+        let mut submission = make_submission();
+        submission.use_layout(&make_layout(), Timestamp(0));
+
+        let key = [KeyCode { code: 30, keymap_idx: 0 }];
+        submission.handle_press(
+            KeyStateId(0),
+            SubmitData::Keycodes,
+            &key,
+            Timestamp(1),
+        );
+        submission.handle_add_modifier(
+            KeyStateId(1),
+            Modifier::Control,
+            Timestamp(1),
+        );
+        take_events();
+
+        // Same symbols, same keymap
+        submission.use_layout(&make_layout(), Timestamp(2));
+        assert_eq!(
+            take_events(),
+            vec![
+                Event::Modifiers(0),
+                Event::Key(30 - 8, PressType::Released as u32),
+            ],
+        );
+        assert!(submission.pressed.is_empty());
+        assert!(submission.modifiers_active.is_empty());
+    }
+
+    #[test]
+    fn switch_back_reuses_file() {
+        use ::vkeyboard::c::test::{ take_events, Event, FILES };
+
+        let mut submission = make_submission();
+        // Each switch drops the previous layout
+        for (time, keymap) in ["xkb_keymap { }", "xkb_keymap { };", "xkb_keymap { }"]
+            .iter().enumerate()
+        {
+            submission.use_layout(&make_keymap_layout(keymap), Timestamp(time as u32));
+        }
+        assert_eq!(take_events(), vec![Event::Keymap; 3]);
+        assert_eq!(FILES.with(|c| c.get()), 2);
+    }
+}
@@ -0,0 +1,353 @@
+/*! Decoding words out of swipe gestures.
+ *
+ * The path drawn over the keyboard gets compared
+ * with the paths connecting the key centers of dictionary words.
+ * Words whose letters the path doesn't pass by in order
+ * get pruned while walking the dictionary,
+ * so that only a handful needs the precise comparison.
+ *
+ * Library module.
+ */
+
+use std::f32;
+
+use ::layout::c::{ Bounds, Point };
+use ::prediction::Dictionary;
+
+/// Paths get resampled to this many equidistant points for comparison.
+/// Fixed-size arrays of coordinates let the comparison get vectorized.
+const SAMPLES: usize = 32;
+/// Comparisons are summed in blocks this long
+/// before checking if the candidate can still win.
+const BLOCK: usize = 8;
+/// Density of the path when looking for the keys it passes by.
+/// Must be high enough not to skip over any.
+const PRUNE_SAMPLES: usize = 96;
+/// How many dictionary nodes a decoding may visit.
+/// Keeps decoding within a frame.
+const DECODE_BUDGET: usize = 20000;
+/// How much word frequency weighs against the match of the shape
+const FREQUENCY_WEIGHT: f32 = 0.5;
+
+pub fn lowercase(c: char) -> char {
+    c.to_lowercase().next().unwrap_or(c)
+}
+
+fn distance_sq(a: &Point, b: &Point) -> f64 {
+    let (dx, dy) = (a.x - b.x, a.y - b.y);
+    dx * dx + dy * dy
+}
+
+/// Letter keys of the current view
+pub struct KeyCenters {
+    /// Lowercase letters and the centers of their keys
+    keys: Vec<(char, Point)>,
+    /// Average of the smaller dimension of the keys
+    key_size: f64,
+}
+
+impl KeyCenters {
+    /// Takes letters and the bounds of their keys
+    pub fn new(keys: Vec<(char, Bounds)>) -> KeyCenters {
+        let sizes: f64 = keys.iter()
+            .map(|(_, b)| b.width.min(b.height))
+            .sum();
+        let key_size = match keys.len() {
+            0 => 0.0,
+            count => sizes / count as f64,
+        };
+        KeyCenters {
+            keys: keys.into_iter()
+                .map(|(c, b)| (
+                    lowercase(c),
+                    Point { x: b.x + b.width / 2.0, y: b.y + b.height / 2.0 },
+                ))
+                .collect(),
+            key_size,
+        }
+    }
+
+    /// How far from the center the path still passes by a key
+    fn get_radius(&self) -> f64 {
+        0.75 * self.key_size
+    }
+
+    /// Distance between the keys of lowercase letters, in key sizes
+    pub fn get_distance(&self, a: char, b: char) -> Option<f64> {
+        match (self.get_center(a), self.get_center(b)) {
+            (Some(a), Some(b)) if self.key_size > 0.0 => {
+                Some(distance_sq(a, b).sqrt() / self.key_size)
+            },
+            _ => None,
+        }
+    }
+
+    fn get_center(&self, letter: char) -> Option<&Point> {
+        self.keys.iter()
+            .find(|(c, _)| *c == letter)
+            .map(|(_, center)| center)
+    }
+
+    /// Finds the first point of the path, starting at `from`,
+    /// where the path passes by the letter.
+    fn find_pass(&self, path: &[Point], from: usize, letter: char)
+        -> Option<usize>
+    {
+        let radius_sq = self.get_radius() * self.get_radius();
+        let centers = || self.keys.iter()
+            .filter(move |(c, _)| *c == letter)
+            .map(|(_, center)| center);
+        (from..path.len()).find(|&i| {
+            centers().any(|center| distance_sq(center, &path[i]) <= radius_sq)
+        })
+    }
+}
+
+/// A path drawn without lifting the finger
+pub struct Gesture {
+    /// The letter of the key where the gesture started
+    start: char,
+    /// Relative to the layout's origin
+    points: Vec<Point>,
+}
+
+impl Gesture {
+    pub fn new(start: char, origin: Point) -> Gesture {
+        Gesture { start, points: vec![origin] }
+    }
+
+    pub fn push(&mut self, point: Point) {
+        self.points.push(point);
+    }
+
+    pub fn get_start(&self) -> char {
+        self.start
+    }
+}
+
+/// Places `count` points evenly along the path
+fn resample(points: &[Point], count: usize) -> Vec<Point> {
+    if points.len() < 2 {
+        return points.iter().cloned().cycle().take(count).collect();
+    }
+    let mut distances = Vec::with_capacity(points.len());
+    let mut total = 0.0;
+    distances.push(total);
+    for pair in points.windows(2) {
+        total += distance_sq(&pair[0], &pair[1]).sqrt();
+        distances.push(total);
+    }
+    let mut segment = 0;
+    (0..count).map(|i| {
+        let target = match count {
+            1 => 0.0,
+            count => total * i as f64 / (count - 1) as f64,
+        };
+        while segment + 2 < points.len() && distances[segment + 1] < target {
+            segment += 1;
+        }
+        let (a, b) = (&points[segment], &points[segment + 1]);
+        let length = distances[segment + 1] - distances[segment];
+        let t = match length > 0.0 {
+            true => ((target - distances[segment]) / length).max(0.0).min(1.0),
+            false => 0.0,
+        };
+        Point { x: a.x + (b.x - a.x) * t, y: a.y + (b.y - a.y) * t }
+    }).collect()
+}
+
+/// A resampled path, split into coordinates
+struct Shape {
+    xs: [f32; SAMPLES],
+    ys: [f32; SAMPLES],
+}
+
+impl Shape {
+    fn new(points: &[Point]) -> Shape {
+        let mut shape = Shape { xs: [0.0; SAMPLES], ys: [0.0; SAMPLES] };
+        for (i, point) in resample(points, SAMPLES).iter().enumerate() {
+            shape.xs[i] = point.x as f32;
+            shape.ys[i] = point.y as f32;
+        }
+        shape
+    }
+
+    /// Sum of squared distances between corresponding points.
+    /// Stops early and returns a partial sum above `limit`
+    /// once it's certain to exceed it.
+    fn distance(&self, other: &Shape, limit: f32) -> f32 {
+        let mut sum = 0.0;
+        for block in 0..SAMPLES / BLOCK {
+            // No early exits inside the block, so that it gets vectorized
+            let mut partial = [0.0f32; BLOCK];
+            for i in 0..BLOCK {
+                let j = block * BLOCK + i;
+                let dx = self.xs[j] - other.xs[j];
+                let dy = self.ys[j] - other.ys[j];
+                partial[i] = dx * dx + dy * dy;
+            }
+            sum += partial.iter().sum::<f32>();
+            if sum > limit {
+                break;
+            }
+        }
+        sum
+    }
+}
+
+/// Finds the dictionary word which matches the gesture best.
+/// The word starts with the letter the gesture started on,
+/// ignoring case.
+pub fn decode(dict: &Dictionary, keys: &KeyCenters, gesture: &Gesture)
+    -> Option<String>
+{
+    let path = resample(&gesture.points, PRUNE_SAMPLES);
+    let last = path.len().checked_sub(1)?;
+    let start = lowercase(gesture.start);
+
+    // Words with letters in the order the path passes by them
+    let mut candidates = Vec::new();
+    dict.walk(
+        // The point where the last letter got passed, and the word length
+        (0, 0),
+        DECODE_BUDGET,
+        |&(index, length), c| {
+            let c = lowercase(c);
+            if length == 0 && c != start {
+                return None;
+            }
+            keys.find_pass(&path, index, c).map(|index| (index, length + 1))
+        },
+        |word, weight, &(_index, length)| {
+            let ends_at_last = word.chars().last()
+                .and_then(|c| keys.find_pass(&path, last, lowercase(c)))
+                .is_some();
+            if length > 1 && ends_at_last {
+                candidates.push((word.to_owned(), weight));
+            }
+        },
+    );
+
+    let observed = Shape::new(&gesture.points);
+    // Distances relative to key size don't depend on scaling
+    let radius = keys.get_radius();
+    let scale = 1.0 / (SAMPLES as f64 * radius * radius) as f32;
+    let mut best: Option<(f32, &str)> = None;
+    for (word, weight) in candidates.iter() {
+        // Letters not on keys got pruned already
+        let template: Vec<Point> = word.chars()
+            .filter_map(|c| keys.get_center(lowercase(c)))
+            .cloned()
+            .collect();
+        let bonus = FREQUENCY_WEIGHT * *weight as f32 / 255.0;
+        let limit = match best {
+            Some((score, _)) => (score + bonus) / scale,
+            None => f32::INFINITY,
+        };
+        let score = observed.distance(&Shape::new(&template), limit) * scale
+            - bonus;
+        if best.map(|(best, _)| score < best).unwrap_or(true) {
+            best = Some((score, word));
+        }
+    }
+    best.map(|(_, word)| word.to_owned())
+}
+
+#[cfg(test)]
+pub mod test {
+    use super::*;
+    use ::prediction::compile;
+
+    /// Unit keys in rows, each shifted right by the given amount
+    pub fn make_keys(rows: &[(&str, f64)]) -> KeyCenters {
+        KeyCenters::new(
+            rows.iter().enumerate()
+                .flat_map(|(y, &(letters, offset))| {
+                    letters.chars().enumerate().map(move |(x, c)| (
+                        c,
+                        Bounds {
+                            x: offset + x as f64, y: y as f64,
+                            width: 1.0, height: 1.0,
+                        },
+                    ))
+                })
+                .collect()
+        )
+    }
+
+    /// Unit keys in 3 staggered rows
+    pub fn qwerty() -> KeyCenters {
+        make_keys(&[("qwertyuiop", 0.0), ("asdfghjkl", 0.5), ("zxcvbnm", 1.5)])
+    }
+
+    /// Gesture along the key centers of the letters
+    pub fn swipe(keys: &KeyCenters, word: &str) -> Gesture {
+        let mut letters = word.chars();
+        let first = letters.next().unwrap();
+        let mut gesture = Gesture::new(
+            first,
+            keys.get_center(lowercase(first)).unwrap().clone(),
+        );
+        for c in letters {
+            gesture.push(keys.get_center(c).unwrap().clone());
+        }
+        gesture
+    }
+
+    #[test]
+    fn resample_evenly() {
+        let points = resample(
+            &[Point { x: 0.0, y: 0.0 }, Point { x: 3.0, y: 0.0 }, Point { x: 3.0, y: 1.0 }],
+            5,
+        );
+        let xs: Vec<f64> = points.iter().map(|p| p.x).collect();
+        let ys: Vec<f64> = points.iter().map(|p| p.y).collect();
+        assert_eq!(xs, vec![0.0, 1.0, 2.0, 3.0, 3.0]);
+        assert_eq!(ys, vec![0.0, 0.0, 0.0, 0.0, 1.0]);
+    }
+
+    #[test]
+    fn decode_path() {
+        let data = compile(vec![
+            ("was", 10), ("wad", 10), ("war", 10), ("sad", 10), ("wax", 10),
+        ]);
+        let dict = Dictionary::new(&data).unwrap();
+        let keys = qwerty();
+        assert_eq!(
+            decode(&dict, &keys, &swipe(&keys, "was")),
+            Some("was".into()),
+        );
+        assert_eq!(
+            decode(&dict, &keys, &swipe(&keys, "wad")),
+            Some("wad".into()),
+        );
+    }
+
+    #[test]
+    fn decode_start_case() {
+        let data = compile(vec![("was", 10)]);
+        let dict = Dictionary::new(&data).unwrap();
+        let keys = qwerty();
+        assert_eq!(
+            decode(&dict, &keys, &swipe(&keys, "Was")),
+            Some("was".into()),
+        );
+        assert_eq!(decode(&dict, &keys, &swipe(&keys, "sad")), None);
+    }
+
+    #[test]
+    fn decode_frequent() {
+        // "tried" and "tired" pass by the same keys
+        let data = compile(vec![("tried", 1000), ("tired", 10)]);
+        let dict = Dictionary::new(&data).unwrap();
+        let keys = qwerty();
+        assert_eq!(
+            decode(&dict, &keys, &swipe(&keys, "tried")),
+            Some("tried".into()),
+        );
+        assert_eq!(
+            decode(&dict, &keys, &swipe(&keys, "tired")),
+            Some("tired".into()),
+        );
+    }
+}
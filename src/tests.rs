@@ -106,10 +106,10 @@ fn check_layout(layout: Layout, allow_missing_return: bool) {
     );
 
     // "Press" each button with keysyms
-    for (_pos, view) in layout.views.values() {
+    for (_name, (_pos, view)) in &layout.views {
         for (_y, row) in view.get_rows() {
             for (_x, button) in row.get_buttons() {
-                let keystate = button.state.borrow();
+                let keystate = &layout.keys[button.key.0];
                 for keycode in &keystate.keycodes {
                     match xkb_states[keycode.keymap_idx].key_get_one_sym(keycode.code) {
                         xkb::KEY_NoSymbol => {
@@ -1,12 +1,19 @@
 /*! Assorted helpers */
 use std::collections::HashMap;
+use std::ffi::CString;
+use std::path::Path;
+use std::ptr;
 use std::rc::Rc;
+use std::slice;
 
 use ::float_ord::FloatOrd;
 
+use glib_sys;
+
 use std::borrow::Borrow;
 use std::hash::{ Hash, Hasher };
 use std::iter::FromIterator;
+use std::os::unix::ffi::OsStrExt;
 
 pub mod c {
     use super::*;
@@ -192,6 +199,47 @@ impl<T> Borrow<Rc<T>> for Pointer<T> {
     }
 }
 
+/// A read-only file mapped into memory
+pub struct MappedFile(*mut glib_sys::GMappedFile);
+
+impl MappedFile {
+    pub fn open(path: &Path) -> Result<MappedFile, String> {
+        let cpath = CString::new(path.as_os_str().as_bytes())
+            .map_err(|e| e.to_string())?;
+        let mut error = ptr::null_mut();
+        let file = unsafe {
+            glib_sys::g_mapped_file_new(cpath.as_ptr(), 0, &mut error)
+        };
+        if file.is_null() {
+            if !error.is_null() {
+                unsafe { glib_sys::g_error_free(error) };
+            }
+            Err(format!("Can't map {:?}", path))
+        } else {
+            Ok(MappedFile(file))
+        }
+    }
+
+    pub fn as_bytes(&self) -> &[u8] {
+        unsafe {
+            let data = glib_sys::g_mapped_file_get_contents(self.0);
+            let len = glib_sys::g_mapped_file_get_length(self.0);
+            if data.is_null() {
+                // Empty files are not mapped
+                &[]
+            } else {
+                slice::from_raw_parts(data as *const u8, len)
+            }
+        }
+    }
+}
+
+impl Drop for MappedFile {
+    fn drop(&mut self) {
+        unsafe { glib_sys::g_mapped_file_unref(self.0) }
+    }
+}
+
 pub trait WarningHandler {
     /// Handle a warning
     fn handle(&mut self, warning: &str);
@@ -1,7 +1,22 @@
 /*! Managing the events belonging to virtual-keyboard interface. */
 
+use std::collections::hash_map::DefaultHasher;
+use std::ffi::{ CStr, CString };
+use std::fs;
+use std::io;
+use std::io::Write;
+use std::path::{ Path, PathBuf };
+use std::process;
+use std::rc::Rc;
+
 use ::keyboard::{ Modifiers, PressType };
+use ::logging;
 use ::submission::Timestamp;
+use ::xdg;
+
+// Traits
+use std::hash::Hasher;
+use ::logging::Warn;
 
 /// Standard xkb keycode
 type KeyCode = u32;
@@ -15,6 +30,7 @@ pub mod c {
     #[derive(Clone, Copy)]
     pub struct ZwpVirtualKeyboardV1(*const c_void);
 
+    /// A sealed file, safe to send to the compositor any number of times
     #[repr(C)]
     pub struct KeyMap {
         fd: u32,
@@ -22,9 +38,10 @@ pub mod c {
     }
     
     impl KeyMap {
-        pub fn from_cstr(s: &CStr) -> KeyMap {
+        /// Takes a keymap already compiled by xkbcommon
+        pub fn from_compiled(s: &CStr) -> KeyMap {
             unsafe {
-                squeek_key_map_from_str(s.as_ptr())
+                squeek_key_map_from_compiled(s.as_ptr())
             }
         }
     }
@@ -40,6 +57,8 @@ pub mod c {
     extern "C" {
         // From libc, to let KeyMap get deallocated.
         fn close(fd: u32);
+        // From libc, to release compiled keymaps.
+        pub fn free(ptr: *mut c_void);
 
         pub fn eek_virtual_keyboard_v1_key(
             virtual_keyboard: ZwpVirtualKeyboardV1,
@@ -58,7 +77,238 @@ pub mod c {
             modifiers: u32,
         );
         
-        pub fn squeek_key_map_from_str(keymap_str: *const c_char) -> KeyMap;
+        /// Returns a string to be released with `free`
+        pub fn squeek_key_map_compile(keymap_str: *const c_char) -> *mut c_char;
+        pub fn squeek_key_map_from_compiled(compiled: *const c_char) -> KeyMap;
+    }
+
+    /// Stand-ins for the protocol, which isn't linked into tests.
+    #[cfg(test)]
+    pub mod test {
+        use super::*;
+
+        use std::cell::{ Cell, RefCell };
+        use std::ptr;
+
+        extern "C" {
+            fn strdup(s: *const c_char) -> *mut c_char;
+            fn strlen(s: *const c_char) -> usize;
+        }
+
+        thread_local! {
+            /// Keymaps compiled by the current test
+            pub static COMPILED: Cell<usize> = Cell::new(0);
+            /// Files created for keymaps by the current test
+            pub static FILES: Cell<usize> = Cell::new(0);
+            /// What the current test sent to the compositor
+            static EVENTS: RefCell<Vec<Event>> = RefCell::new(Vec::new());
+        }
+
+        #[derive(Clone, Debug, PartialEq)]
+        pub enum Event {
+            /// Key code and press type, as sent
+            Key(u32, u32),
+            Keymap,
+            Modifiers(u32),
+        }
+
+        fn record(event: Event) {
+            EVENTS.with(|events| events.borrow_mut().push(event));
+        }
+
+        /// Returns the events sent since the last call
+        pub fn take_events() -> Vec<Event> {
+            EVENTS.with(|events| events.replace(Vec::new()))
+        }
+
+        impl ZwpVirtualKeyboardV1 {
+            pub fn null() -> ZwpVirtualKeyboardV1 {
+                ZwpVirtualKeyboardV1(ptr::null())
+            }
+        }
+
+        #[no_mangle]
+        pub extern "C"
+        fn eek_virtual_keyboard_v1_key(
+            _virtual_keyboard: ZwpVirtualKeyboardV1,
+            _timestamp: u32,
+            keycode: u32,
+            press: u32,
+        ) {
+            record(Event::Key(keycode, press));
+        }
+
+        #[no_mangle]
+        pub extern "C"
+        fn eek_virtual_keyboard_update_keymap(
+            _virtual_keyboard: ZwpVirtualKeyboardV1,
+            _keymap: *const KeyMap,
+        ) {
+            record(Event::Keymap);
+        }
+
+        #[no_mangle]
+        pub extern "C"
+        fn eek_virtual_keyboard_set_modifiers(
+            _virtual_keyboard: ZwpVirtualKeyboardV1,
+            modifiers: u32,
+        ) {
+            record(Event::Modifiers(modifiers));
+        }
+
+        /// Returns the text unchanged
+        #[no_mangle]
+        pub extern "C"
+        fn squeek_key_map_compile(keymap_str: *const c_char) -> *mut c_char {
+            COMPILED.with(|c| c.set(c.get() + 1));
+            unsafe { strdup(keymap_str) }
+        }
+
+        /// Returns an invalid file
+        #[no_mangle]
+        pub extern "C"
+        fn squeek_key_map_from_compiled(compiled: *const c_char) -> KeyMap {
+            FILES.with(|c| c.set(c.get() + 1));
+            KeyMap {
+                fd: std::u32::MAX,
+                fd_len: unsafe { strlen(compiled) } + 1,
+            }
+        }
+    }
+}
+
+/// Stored compiled keymaps start with this, followed by the source length,
+/// a check of the source, and the hash of the rest of the file
+const CACHE_HEADER: &str = "squeekboard compiled keymap ";
+
+fn hash_bytes(data: &[u8]) -> u64 {
+    // Stable between runs, at least for the same build.
+    // Entries written by a different build will fail the check and get replaced.
+    let mut hasher = DefaultHasher::new();
+    hasher.write(data);
+    hasher.finish()
+}
+
+/// A hash independent of the one naming the file,
+/// so that a file left by a colliding source doesn't get used.
+fn check_source(source: &[u8]) -> u64 {
+    let mut hasher = DefaultHasher::new();
+    hasher.write(CACHE_HEADER.as_bytes());
+    hasher.write(source);
+    hasher.finish()
+}
+
+fn make_header(source: &[u8], body: &[u8]) -> String {
+    format!(
+        "{}{} {:016x} {:016x}",
+        CACHE_HEADER,
+        source.len(),
+        check_source(source),
+        hash_bytes(body),
+    )
+}
+
+fn compile(keymap_str: &CStr) -> CString {
+    unsafe {
+        let compiled = c::squeek_key_map_compile(keymap_str.as_ptr());
+        let owned = CStr::from_ptr(compiled).to_owned();
+        c::free(compiled as *mut _);
+        owned
+    }
+}
+
+/// Returns None if the file is missing, damaged,
+/// or compiled from a different source
+fn read_cached(path: &Path, source: &CStr) -> Option<CString> {
+    let data = fs::read(path).ok()?;
+    let split = data.iter().position(|b| *b == b'\n')?;
+    let (header, body) = (&data[..split], &data[split + 1..]);
+    if header != make_header(source.to_bytes(), body).as_bytes() {
+        return None;
+    }
+    CString::new(body).ok()
+}
+
+fn write_cached(path: &Path, source: &CStr, compiled: &CStr)
+    -> Result<(), io::Error>
+{
+    if let Some(dir) = path.parent() {
+        fs::create_dir_all(dir)?;
+    }
+    let body = compiled.to_bytes();
+    // Concurrent readers must never see a partial file
+    let temporary = path.with_extension(format!("{}.tmp", process::id()));
+    {
+        let mut file = fs::File::create(&temporary)?;
+        write!(file, "{}\n", make_header(source.to_bytes(), body))?;
+        file.write_all(body)?;
+    }
+    fs::rename(&temporary, path)
+}
+
+/// How many keymaps stay open after their layouts are gone.
+/// Enough for switching back and forth between a few layouts.
+const LOADED_MAX: usize = 8;
+
+/// Compiled keymaps, shared between layouts.
+/// Compiling takes a large part of the time spent switching layouts,
+/// so the results are also kept on disk between runs.
+pub struct KeyMapCache {
+    /// Hashes of the keymap sources, and their files,
+    /// the least recently used first.
+    /// Files stay open when the layout using them goes away,
+    /// so that switching back doesn't need to load them again.
+    loaded: Vec<(u64, Rc<c::KeyMap>)>,
+    /// Where compiled keymaps get stored, if anywhere
+    dir: Option<PathBuf>,
+}
+
+impl KeyMapCache {
+    pub fn new(dir: Option<PathBuf>) -> KeyMapCache {
+        KeyMapCache {
+            loaded: Vec::new(),
+            dir,
+        }
+    }
+
+    /// Uses the user's cache directory
+    pub fn new_default() -> KeyMapCache {
+        KeyMapCache::new(xdg::cache_path("squeekboard/keymaps"))
+    }
+
+    pub fn get(&mut self, keymap_str: &CStr) -> Rc<c::KeyMap> {
+        let hash = hash_bytes(keymap_str.to_bytes());
+        if let Some(idx) = self.loaded.iter().position(|(h, _)| *h == hash) {
+            let entry = self.loaded.remove(idx);
+            let keymap = entry.1.clone();
+            self.loaded.push(entry);
+            return keymap;
+        }
+
+        let path = self.dir.as_ref()
+            .map(|dir| dir.join(format!("{:016x}.xkb", hash)));
+        let compiled = path.as_ref()
+            .and_then(|path| read_cached(path, keymap_str));
+        let compiled = match (compiled, path) {
+            (Some(compiled), _) => compiled,
+            (None, path) => {
+                let compiled = compile(keymap_str);
+                if let Some(path) = path {
+                    let _ = write_cached(&path, keymap_str, &compiled).or_print(
+                        logging::Problem::Warning,
+                        &format!("Can't store keymap in {:?}", path),
+                    );
+                }
+                compiled
+            },
+        };
+        let keymap = Rc::new(c::KeyMap::from_compiled(&compiled));
+        if self.loaded.len() == LOADED_MAX {
+            // Layouts still using it keep it open
+            self.loaded.remove(0);
+        }
+        self.loaded.push((hash, keymap.clone()));
+        keymap
     }
 }
 
@@ -97,3 +347,103 @@ impl VirtualKeyboard {
         }
     }
 }
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use std::env;
+
+    fn compiled_count() -> usize {
+        c::test::COMPILED.with(|c| c.get())
+    }
+
+    /// An empty directory, unique to the test
+    fn make_dir(name: &str) -> PathBuf {
+        let dir = env::temp_dir()
+            .join(format!("squeekboard-test-{}-{}", process::id(), name));
+        let _ = fs::remove_dir_all(&dir);
+        dir
+    }
+
+    #[test]
+    fn reuse_loaded() {
+        let mut cache = KeyMapCache::new(None);
+        let source = CString::new("xkb_keymap { }").unwrap();
+        let first = cache.get(&source);
+        let second = cache.get(&source);
+        assert!(Rc::ptr_eq(&first, &second));
+        assert_eq!(compiled_count(), 1);
+        cache.get(&CString::new("xkb_keymap { };").unwrap());
+        assert_eq!(compiled_count(), 2);
+    }
+
+    #[test]
+    fn reuse_stored() {
+        let dir = make_dir("stored");
+        let source = CString::new("xkb_keymap { }").unwrap();
+        KeyMapCache::new(Some(dir.clone())).get(&source);
+        KeyMapCache::new(Some(dir.clone())).get(&source);
+        assert_eq!(compiled_count(), 1);
+        fs::remove_dir_all(&dir).unwrap();
+    }
+
+    #[test]
+    fn reject_damaged() {
+        let dir = make_dir("damaged");
+        let path = dir.join("keymap.xkb");
+        let source = CString::new("xkb_keymap { }").unwrap();
+        let compiled = CString::new("xkb_keymap { };").unwrap();
+        write_cached(&path, &source, &compiled).unwrap();
+        assert_eq!(read_cached(&path, &source), Some(compiled));
+
+        let mut data = fs::read(&path).unwrap();
+        data.pop();
+        fs::write(&path, &data).unwrap();
+        assert_eq!(read_cached(&path, &source), None);
+        fs::remove_dir_all(&dir).unwrap();
+    }
+
+    #[test]
+    fn reject_other_source() {
+        let dir = make_dir("other");
+        let path = dir.join("keymap.xkb");
+        let source = CString::new("xkb_keymap { }").unwrap();
+        let compiled = CString::new("xkb_keymap { };").unwrap();
+        write_cached(&path, &source, &compiled).unwrap();
+        // As if the other source had the same hash
+        let other = CString::new("xkb_keymap { } ").unwrap();
+        assert_eq!(read_cached(&path, &other), None);
+        fs::remove_dir_all(&dir).unwrap();
+    }
+
+    #[test]
+    fn reuse_after_switch() {
+        let mut cache = KeyMapCache::new(None);
+        let first = CString::new("xkb_keymap { }").unwrap();
+        let second = CString::new("xkb_keymap { };").unwrap();
+        let keymap = Rc::downgrade(&cache.get(&first));
+        // The first layout is gone while the second one is in use
+        let _other = cache.get(&second);
+        let again = cache.get(&first);
+        // Still the same open file
+        assert!(Rc::ptr_eq(&again, &keymap.upgrade().unwrap()));
+        assert_eq!(compiled_count(), 2);
+    }
+
+    #[test]
+    fn drop_least_recent() {
+        let mut cache = KeyMapCache::new(None);
+        let source = |idx| CString::new(format!("xkb_keymap {{ {} }}", idx)).unwrap();
+        for idx in 0..LOADED_MAX {
+            cache.get(&source(idx));
+        }
+        // The first one is now the most recent
+        cache.get(&source(0));
+        cache.get(&source(LOADED_MAX));
+        assert_eq!(cache.loaded.len(), LOADED_MAX);
+        cache.get(&source(0));
+        assert_eq!(compiled_count(), LOADED_MAX + 1);
+        cache.get(&source(1));
+        assert_eq!(compiled_count(), LOADED_MAX + 2);
+    }
+}
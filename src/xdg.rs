@@ -61,3 +61,39 @@ pub fn data_path<P>(path: P) -> Option<PathBuf>
         dir.join(path.as_ref())
     })
 }
+
+fn cache_dir() -> Option<PathBuf> {
+    env::var_os("XDG_CACHE_HOME")
+        .and_then(is_absolute_path)
+        .or_else(|| home_dir().map(|h| h.join(".cache")))
+}
+
+/// Returns the path to the directory within the cache dir
+pub fn cache_path<P>(path: P) -> Option<PathBuf>
+    where P: AsRef<Path>
+{
+    cache_dir().map(|dir| {
+        dir.join(path.as_ref())
+    })
+}
+
+/// System-wide data dirs, in the order of preference
+fn data_dirs() -> Vec<PathBuf> {
+    let dirs = env::var_os("XDG_DATA_DIRS")
+        .and_then(|d| if d.is_empty() { None } else { Some(d) })
+        .unwrap_or_else(|| OsString::from("/usr/local/share:/usr/share"));
+    env::split_paths(&dirs)
+        .filter(|dir| dir.is_absolute())
+        .collect()
+}
+
+/// Returns the paths to the file within the user's data dir,
+/// followed by the system-wide data dirs
+pub fn data_paths<P>(path: P) -> Vec<PathBuf>
+    where P: AsRef<Path>
+{
+    data_dir().into_iter()
+        .chain(data_dirs())
+        .map(|dir| dir.join(path.as_ref()))
+        .collect()
+}
@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2020 Purism, SPC
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/* Compares loading icons straight from the theme,
+ * like every draw of an icon button used to,
+ * with going through the renderer's cache. */
+
+#include <gtk/gtk.h>
+
+#include "eek/eek-renderer.h"
+
+#define ITERATIONS 1000
+
+/// Icons shown on the builtin layouts
+static const gchar *icons[] = {
+    "key-enter",
+    "key-shift",
+    "keyboard-mode-symbolic",
+    "edit-clear-symbolic",
+    NULL,
+};
+
+/// Icons from the list above which the theme provides
+static const gchar *available[G_N_ELEMENTS (icons)] = { NULL };
+
+static gdouble
+time_theme (GtkIconTheme *theme, gint scale)
+{
+    gint64 start = g_get_monotonic_time ();
+    for (guint i = 0; i < ITERATIONS; i++) {
+        for (const gchar **name = available; *name; name++) {
+            cairo_surface_t *surface = gtk_icon_theme_load_surface (theme,
+                *name, 16, scale, NULL, 0, NULL);
+            g_assert_nonnull (surface);
+            cairo_surface_destroy (surface);
+        }
+    }
+    return (gdouble)(g_get_monotonic_time () - start) / ITERATIONS;
+}
+
+static gdouble
+time_renderer (gint scale)
+{
+    gint64 start = g_get_monotonic_time ();
+    for (guint i = 0; i < ITERATIONS; i++) {
+        for (const gchar **name = available; *name; name++) {
+            cairo_surface_t *surface = eek_renderer_get_icon_surface (*name,
+                16, scale);
+            g_assert_nonnull (surface);
+            cairo_surface_destroy (surface);
+        }
+    }
+    return (gdouble)(g_get_monotonic_time () - start) / ITERATIONS;
+}
+
+int
+main (int argc, char *argv[])
+{
+    if (!gtk_init_check (&argc, &argv)) {
+        g_printerr ("No display, skipping\n");
+        return 77;
+    }
+
+    GtkIconTheme *theme = gtk_icon_theme_get_default ();
+    gtk_icon_theme_add_resource_path (theme, "/sm/puri/squeekboard/icons");
+
+    // Some come from the system theme, which may not be installed
+    guint count = 0;
+    for (const gchar **name = icons; *name; name++) {
+        if (gtk_icon_theme_has_icon (theme, *name)) {
+            available[count++] = *name;
+        } else {
+            g_print ("Icon %s not in the theme, skipping\n", *name);
+        }
+    }
+
+    for (gint scale = 1; scale <= 2; scale++) {
+        gdouble uncached = time_theme (theme, scale);
+        gdouble cached = time_renderer (scale);
+        g_print ("scale %d: %.1f us per frame uncached, %.1f us cached\n",
+                 scale, uncached, cached);
+    }
+    return 0;
+}
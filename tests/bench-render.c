@@ -0,0 +1,135 @@
+/*
+ * Copyright (C) 2020 Purism, SPC
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/* Renders every builtin layout into an image surface,
+ * and prints one JSON object with timings per layout.
+ *
+ * Style contexts need a GDK display, but nothing gets shown,
+ * so running under Xvfb or the broadway backend is enough. */
+
+#include <gtk/gtk.h>
+
+#include "eek/eek-keyboard.h"
+#include "eek/eek-renderer.h"
+#include "src/layout.h"
+
+#define WIDTH 360
+#define HEIGHT 210
+#define WARM_FRAMES 100
+
+static gdouble
+elapsed_us (gint64 start)
+{
+    return (gdouble)(g_get_monotonic_time () - start);
+}
+
+/// Only the buttons in a non-base state, without the cached background.
+static void
+draw_changed (EekRenderer *renderer, struct render_geometry geometry,
+              cairo_t *cr, LevelKeyboard *keyboard)
+{
+    cairo_save (cr);
+    cairo_translate (cr, geometry.widget_to_layout.origin_x,
+                     geometry.widget_to_layout.origin_y);
+    cairo_scale (cr, geometry.widget_to_layout.scale,
+                 geometry.widget_to_layout.scale);
+    squeek_layout_draw_all_changed (keyboard->layout, renderer,
+                                    renderer->atlas, cr, NULL);
+    cairo_restore (cr);
+}
+
+static void
+bench_layout (const char *name, void *data)
+{
+    PangoContext *pcontext = data;
+    struct squeek_layout *layout = squeek_load_builtin_layout (name);
+    if (!layout) {
+        return;
+    }
+    LevelKeyboard *keyboard = level_keyboard_new (layout);
+    cairo_surface_t *surface = cairo_image_surface_create (CAIRO_FORMAT_ARGB32,
+                                                           WIDTH, HEIGHT);
+    cairo_t *cr = cairo_create (surface);
+    struct render_geometry geometry =
+        eek_render_geometry_from_allocation_size (layout, WIDTH, HEIGHT, 1);
+    EekRenderer *renderer = eek_renderer_new (keyboard, pcontext);
+    guint buttons = squeek_layout_get_button_count (layout);
+
+    /* Nothing cached by the renderer yet */
+    gint64 start = g_get_monotonic_time ();
+    eek_renderer_render_keyboard (renderer, geometry, NULL, cr, keyboard);
+    gdouble cold = elapsed_us (start);
+
+    /* The atlas and the other views get filled in idle time */
+    start = g_get_monotonic_time ();
+    while (g_main_context_iteration (NULL, FALSE)) {}
+    gdouble prerender = elapsed_us (start);
+
+    start = g_get_monotonic_time ();
+    for (guint i = 0; i < WARM_FRAMES; i++) {
+        eek_renderer_render_keyboard (renderer, geometry, NULL, cr, keyboard);
+    }
+    gdouble warm = elapsed_us (start) / WARM_FRAMES;
+
+    /* Every button pressed in turn */
+    gdouble press = 0;
+    gdouble changed = 0;
+    for (guint i = 0; i < buttons; i++) {
+        squeek_layout_set_button_pressed (layout, i, TRUE);
+        start = g_get_monotonic_time ();
+        eek_renderer_render_keyboard (renderer, geometry, NULL, cr, keyboard);
+        press += elapsed_us (start);
+
+        start = g_get_monotonic_time ();
+        draw_changed (renderer, geometry, cr, keyboard);
+        changed += elapsed_us (start);
+        squeek_layout_set_button_pressed (layout, i, FALSE);
+    }
+    if (buttons) {
+        press /= buttons;
+        changed /= buttons;
+    }
+
+    g_print ("{\"layout\": \"%s\", \"buttons\": %u, "
+             "\"cold_us\": %.1f, \"prerender_us\": %.1f, \"warm_us\": %.1f, "
+             "\"press_us\": %.1f, \"press_changed_us\": %.1f, "
+             "\"cold_per_button_us\": %.2f, \"warm_per_button_us\": %.2f}\n",
+             name, buttons, cold, prerender, warm, press, changed,
+             buttons ? cold / buttons : 0.0,
+             buttons ? warm / buttons : 0.0);
+
+    eek_renderer_free (renderer);
+    cairo_destroy (cr);
+    cairo_surface_destroy (surface);
+    level_keyboard_free (keyboard);
+}
+
+int
+main (int argc, char *argv[])
+{
+    if (!gtk_init_check (&argc, &argv)) {
+        g_printerr ("No display, skipping\n");
+        return 77;
+    }
+
+    gtk_icon_theme_add_resource_path (gtk_icon_theme_get_default (),
+                                      "/sm/puri/squeekboard/icons");
+    PangoContext *pcontext = pango_font_map_create_context (
+        pango_cairo_font_map_get_default ());
+
+    squeek_builtin_layout_foreach (bench_layout, pcontext);
+
+    g_object_unref (pcontext);
+    return 0;
+}